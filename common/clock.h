@@ -0,0 +1,166 @@
+#ifndef MAP_CLOCK_H
+#define MAP_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+namespace MapClock {
+
+/*
+  clock policies of SinHashMap and ShmHashMap, expiries are milliseconds
+  of the wall clock:
+    - SystemClock, the wall clock is read by every call
+    - CoarseClock, reads a ClockPage, a load instead of a clock call
+
+  ClockPage:
+    - the time published to readers, ShmHashMap places it in the segment
+      so every attached process reads the same value
+    - a ticker thread per process moves every page in use to the wall
+      clock each CLOCK_TICK_MS, never back, so readers see a monotonic
+      value even if tickers of many processes write it
+    - a clock set back is waited for, expiries don't run twice
+
+  a clock is attached to a page once by the map, a forked child starts its
+  own ticker when it attaches a page
+*/
+
+const uint32_t CLOCK_TICK_MS = 1;
+const uint32_t CLOCK_MAX_PAGES = 64;  // pages ticked by a process
+
+inline int64_t WallMillis() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+struct ClockPage {
+  ClockPage() : _now_ms(WallMillis()) {}
+
+  void Tick() {
+    int64_t now = WallMillis();
+    int64_t last = _now_ms.load(std::memory_order_relaxed);
+    while (last < now &&
+           !_now_ms.compare_exchange_weak(last, now, std::memory_order_release,
+                                          std::memory_order_relaxed)) {
+    }
+  }
+
+  std::atomic<int64_t> _now_ms;
+};
+
+// the ticker thread of this process
+class ClockTicker {
+ public:
+  // never destroyed, the thread runs until the process exits
+  static ClockTicker &Instance() {
+    static ClockTicker *ticker = new ClockTicker;
+    return *ticker;
+  }
+
+  // false if CLOCK_MAX_PAGES are ticked already
+  bool Add(ClockPage *page) {
+    std::lock_guard<std::mutex> lock(_lock);
+    page->Tick();
+    if (_pid != getpid()) {
+      _pid = getpid();
+      _busy = false;
+      std::thread(&ClockTicker::Run, this).detach();
+    }
+
+    for (auto &slot : _slots) {
+      if (slot._page.load(std::memory_order_relaxed) != page) continue;
+      slot._refs++;
+      return true;
+    }
+    for (auto &slot : _slots) {
+      if (slot._refs != 0) continue;
+      slot._refs = 1;
+      slot._page.store(page, std::memory_order_seq_cst);
+      return true;
+    }
+    return false;
+  }
+
+  // the page is not touched once it returns
+  void Remove(ClockPage *page) {
+    std::lock_guard<std::mutex> lock(_lock);
+    for (auto &slot : _slots) {
+      if (slot._page.load(std::memory_order_relaxed) != page) continue;
+      if (--slot._refs != 0) return;
+
+      // a tick which loaded the page before it is cleared has set _busy
+      slot._page.store(NULL, std::memory_order_seq_cst);
+      while (_pid == getpid() && _busy.load(std::memory_order_seq_cst))
+        std::this_thread::yield();
+      return;
+    }
+  }
+
+ private:
+  struct Slot {
+    Slot() : _page(NULL), _refs(0) {}
+
+    std::atomic<ClockPage *> _page;
+    uint32_t _refs;  // clocks attached, under _lock
+  };
+
+  ClockTicker() : _pid(0), _busy(false) {}
+
+  void Run() {
+    while (true) {
+      _busy.store(true, std::memory_order_seq_cst);
+      for (auto &slot : _slots) {
+        ClockPage *page = slot._page.load(std::memory_order_seq_cst);
+        if (page != NULL) page->Tick();
+      }
+      _busy.store(false, std::memory_order_seq_cst);
+      std::this_thread::sleep_for(std::chrono::milliseconds(CLOCK_TICK_MS));
+    }
+  }
+
+  std::mutex _lock;
+  pid_t _pid;  // process running the thread
+  std::atomic<bool> _busy;
+  Slot _slots[CLOCK_MAX_PAGES];
+};
+
+struct SystemClock {
+  void Attach(ClockPage * /* page */) {}
+
+  int64_t NowMs() const { return WallMillis(); }
+};
+
+class CoarseClock {
+ public:
+  CoarseClock() : _page(NULL), _ticked(false) {}
+
+  ~CoarseClock() {
+    if (_ticked) ClockTicker::Instance().Remove(_page);
+  }
+
+  // NULL for a page of this clock only, the wall clock is read if the
+  // ticker is full
+  void Attach(ClockPage *page) {
+    _page = page != NULL ? page : &_local;
+    _ticked = ClockTicker::Instance().Add(_page);
+  }
+
+  int64_t NowMs() const {
+    return _ticked ? _page->_now_ms.load(std::memory_order_acquire)
+                   : WallMillis();
+  }
+
+ private:
+  ClockPage *_page;
+  ClockPage _local;
+  bool _ticked;
+};
+
+}  // namespace MapClock
+#endif  // MAP_CLOCK_H
@@ -0,0 +1,124 @@
+#ifndef MAP_FREQUENCY_SKETCH_H
+#define MAP_FREQUENCY_SKETCH_H
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+
+namespace MapSketch {
+
+/*
+  count-min sketch of 4-bit counters estimating how often a hash was seen,
+  the admission filter of TinyLFU:
+    - a word holds 16 counters, 4 groups of 4, a hash picks one group and
+      uses one counter of it in 4 words picked by 4 seeded hashes, the
+      estimate is the least of the 4
+    - counters stop at 15, after sample_size additions every counter is
+      halved so popularity of the past fades
+    - the words and SketchMeta are plain memory, the map may place them in
+      a shared segment, increments race freely and lose nothing but the
+      precision of a halving which overlaps them
+
+  width is the number of words, a power of two about the entries cached
+*/
+
+const uint32_t SKETCH_SAMPLE_FACTOR = 10;  // additions per entry before aging
+
+struct SketchMeta {
+  explicit SketchMeta(uint32_t width)
+      : _width(width),
+        _sample_size((uint64_t)width * SKETCH_SAMPLE_FACTOR),
+        _additions(0) {}
+
+  uint32_t _width;
+  uint64_t _sample_size;
+  std::atomic<uint64_t> _additions;
+};
+
+class FrequencySketch {
+ public:
+  FrequencySketch(SketchMeta *meta, std::atomic<uint64_t> *table)
+      : _meta(meta), _table(table), _mask(meta->_width - 1) {}
+
+  // words of a sketch for about capacity entries
+  static uint32_t Width(uint32_t capacity) {
+    uint32_t width = 64;
+    while (width < capacity && width < (1u << 30)) width <<= 1;
+    return width;
+  }
+
+  uint32_t Frequency(uint32_t hash) const {
+    uint64_t spread = Spread(hash);
+    uint32_t start = (spread & 3) << 2;
+    uint32_t frequency = 15;
+    for (int i = 0; i < 4; ++i) {
+      uint64_t word = _table[Index(spread, i)].load(std::memory_order_relaxed);
+      frequency = std::min<uint32_t>(frequency,
+                                     (word >> ((start + i) << 2)) & 0xf);
+    }
+    return frequency;
+  }
+
+  void Increment(uint32_t hash) {
+    uint64_t spread = Spread(hash);
+    uint32_t start = (spread & 3) << 2;
+    bool added = false;
+    for (int i = 0; i < 4; ++i)
+      added |= IncrementAt(Index(spread, i), start + i);
+    if (!added) return;
+
+    // the thread reaching the sample size ages the sketch
+    uint64_t additions =
+        _meta->_additions.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (additions == _meta->_sample_size) Reset();
+  }
+
+ private:
+  static uint64_t Spread(uint32_t hash) {
+    uint64_t spread = hash * 0x9e3779b97f4a7c15ULL;
+    return spread ^ (spread >> 29);
+  }
+
+  uint32_t Index(uint64_t spread, int i) const {
+    static const uint64_t SEEDS[4] = {0xc3a5c85c97cb3127ULL,
+                                      0xb492b66fbe98f273ULL,
+                                      0x9ae16a3b2f90404fULL,
+                                      0xcbf29ce484222325ULL};
+    uint64_t hash = (spread + SEEDS[i]) * SEEDS[i];
+    return (hash + (hash >> 32)) & _mask;
+  }
+
+  // false if the counter is at 15 already
+  bool IncrementAt(uint32_t index, uint32_t counter) {
+    uint32_t offset = counter << 2;
+    uint64_t mask = 0xfULL << offset;
+    uint64_t word = _table[index].load(std::memory_order_relaxed);
+    while ((word & mask) != mask) {
+      if (_table[index].compare_exchange_weak(word, word + (1ULL << offset),
+                                              std::memory_order_relaxed))
+        return true;
+    }
+    return false;
+  }
+
+  // halve every counter
+  void Reset() {
+    for (uint32_t i = 0; i <= _mask; ++i) {
+      uint64_t word = _table[i].load(std::memory_order_relaxed);
+      while (!_table[i].compare_exchange_weak(
+          word, (word >> 1) & 0x7777777777777777ULL,
+          std::memory_order_relaxed)) {
+      }
+    }
+    _meta->_additions.fetch_sub(_meta->_sample_size / 2,
+                                std::memory_order_relaxed);
+  }
+
+  SketchMeta *_meta;
+  std::atomic<uint64_t> *_table;
+  uint32_t _mask;
+};
+
+}  // namespace MapSketch
+#endif  // MAP_FREQUENCY_SKETCH_H
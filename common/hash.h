@@ -0,0 +1,238 @@
+#ifndef MAP_HASH_H
+#define MAP_HASH_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <type_traits>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace MapHash {
+
+/*
+  hash policies of SinHashMap and ShmHashMap, a Hasher is a functor whose
+  low bits are well mixed, buckets are picked by masking them:
+    - VirtualHasher, the map calls its virtual HashCode and folds it like
+      IntHasher, a HashCode needs not mix its low bits
+    - IntHasher, multiplicative, integer keys only
+    - Crc32cHasher, crc32 instruction if the cpu has SSE4.2, table otherwise
+    - WyHasher, wyhash, 64 bits
+
+  std::string is hashed by its content, other keys by their bytes
+*/
+
+inline const void *KeyData(const std::string &key) { return key.data(); }
+
+inline size_t KeySize(const std::string &key) { return key.size(); }
+
+template <typename Key>
+const void *KeyData(const Key &key) {
+  static_assert(std::is_trivially_copyable<Key>::value,
+                "key is hashed by its bytes");
+  return &key;
+}
+
+template <typename Key>
+size_t KeySize(const Key & /* key */) {
+  return sizeof(Key);
+}
+
+// bucket index, tables are powers of two
+inline uint32_t BucketIndex(uint32_t hash, uint32_t bucket_size) {
+  return hash & (bucket_size - 1);
+}
+
+inline uint32_t RoundUpPowerOfTwo(uint32_t size) {
+  if (size <= 1) return 1;
+  return 1u << (32 - __builtin_clz(size - 1));
+}
+
+struct VirtualHasher {};
+
+struct IntHasher {
+  template <typename Key>
+  uint64_t operator()(const Key &key) const {
+    static_assert(std::is_integral<Key>::value, "IntHasher takes integers");
+
+    // high bits are folded down, masking sees all of them
+    uint64_t hash = (uint64_t)key * 0x9E3779B97F4A7C15ULL;
+    return hash ^ (hash >> 32);
+  }
+};
+
+inline const uint32_t *Crc32cTable() {
+  static const struct Table {
+    Table() {
+      for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; ++k)
+          crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+        _data[i] = crc;
+      }
+    }
+    uint32_t _data[256];
+  } table;
+  return table._data;
+}
+
+inline uint32_t Crc32cSoftware(const void *data, size_t size, uint32_t crc) {
+  const uint32_t *table = Crc32cTable();
+  const uint8_t *p = (const uint8_t *)data;
+  while (size--) crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) inline uint32_t Crc32cHardware(
+    const void *data, size_t size, uint32_t crc) {
+  const uint8_t *p = (const uint8_t *)data;
+  uint64_t crc64 = crc;
+  for (; size >= 8; size -= 8, p += 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+
+  crc = crc64;
+  while (size--) crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+#endif
+
+inline uint32_t Crc32c(const void *data, size_t size) {
+#if defined(__x86_64__)
+  static const bool hardware = __builtin_cpu_supports("sse4.2");
+  if (hardware) return ~Crc32cHardware(data, size, ~0u);
+#endif
+  return ~Crc32cSoftware(data, size, ~0u);
+}
+
+// one instruction when built with -msse4.2
+inline uint32_t Crc32cWord(uint64_t word) {
+#if defined(__SSE4_2__)
+  return ~_mm_crc32_u64(~0u, word);
+#else
+  return Crc32c(&word, sizeof(word));
+#endif
+}
+
+struct Crc32cHasher {
+  template <typename Key>
+  uint64_t operator()(const Key &key) const {
+    uint64_t crc;
+    if constexpr (std::is_integral<Key>::value && sizeof(Key) <= 8) {
+      crc = Crc32cWord((uint64_t)key);
+    } else {
+      crc = Crc32c(KeyData(key), KeySize(key));
+    }
+
+    // crc is linear, keys differing in high bits only may share low bits,
+    // a multiply spreads every bit down
+    return (crc * 0x9E3779B97F4A7C15ULL) >> 32;
+  }
+};
+
+inline uint64_t WyMix(uint64_t a, uint64_t b) {
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+inline uint64_t WyRead8(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+inline uint64_t WyRead4(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+const uint64_t WY_SECRET[4] = {0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+                               0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL};
+
+inline uint64_t WyHash(const void *data, size_t size, uint64_t seed = 0) {
+  const uint8_t *p = (const uint8_t *)data;
+  const uint64_t *s = WY_SECRET;
+  seed ^= WyMix(seed ^ s[0], s[1]);
+
+  uint64_t a, b;
+  if (size <= 16) {
+    if (size >= 4) {
+      a = (WyRead4(p) << 32) | WyRead4(p + ((size >> 3) << 2));
+      b = (WyRead4(p + size - 4) << 32) |
+          WyRead4(p + size - 4 - ((size >> 3) << 2));
+    } else if (size > 0) {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[size >> 1] << 8) |
+          p[size - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = size;
+    if (i > 48) {
+      uint64_t seed1 = seed, seed2 = seed;
+      do {
+        seed = WyMix(WyRead8(p) ^ s[1], WyRead8(p + 8) ^ seed);
+        seed1 = WyMix(WyRead8(p + 16) ^ s[2], WyRead8(p + 24) ^ seed1);
+        seed2 = WyMix(WyRead8(p + 32) ^ s[3], WyRead8(p + 40) ^ seed2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= seed1 ^ seed2;
+    }
+
+    for (; i > 16; i -= 16, p += 16)
+      seed = WyMix(WyRead8(p) ^ s[1], WyRead8(p + 8) ^ seed);
+
+    a = WyRead8(p + i - 16);
+    b = WyRead8(p + i - 8);
+  }
+
+  a ^= s[1];
+  b ^= seed;
+  __uint128_t r = (__uint128_t)a * b;
+  return WyMix((uint64_t)r ^ s[0] ^ size, (uint64_t)(r >> 64) ^ s[1]);
+}
+
+struct WyHasher {
+  template <typename Key>
+  uint64_t operator()(const Key &key) const {
+    if constexpr (std::is_integral<Key>::value && sizeof(Key) <= 8) {
+      // wyhash64 of the key, two multiplies
+      __uint128_t r = (__uint128_t)((uint64_t)key ^ WY_SECRET[0]) *
+                      WY_SECRET[1];
+      return WyMix((uint64_t)r ^ WY_SECRET[0], (uint64_t)(r >> 64) ^
+                                                   WY_SECRET[1]);
+    } else {
+      return WyHash(KeyData(key), KeySize(key));
+    }
+  }
+};
+
+// Hash of the map, with VirtualHasher it is the virtual HashCode mixed
+template <typename Key, typename Hasher>
+class HashAdapter {
+ protected:
+  uint32_t Hash(const Key &key) { return Hasher()(key); }
+};
+
+template <typename Key>
+class HashAdapter<Key, VirtualHasher> {
+ public:
+  virtual ~HashAdapter() = default;
+
+ protected:
+  uint32_t Hash(const Key &key) { return IntHasher()(HashCode(key)); }
+
+  virtual uint32_t HashCode(const Key &key) = 0;
+};
+
+}  // namespace MapHash
+#endif  // MAP_HASH_H
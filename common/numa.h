@@ -0,0 +1,138 @@
+#ifndef MAP_NUMA_H
+#define MAP_NUMA_H
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace MapNuma {
+
+/*
+  placement of shared memory over NUMA nodes, without libnuma:
+    - Place sets the policy of a range by mbind, pages faulted in later go
+      to the node, pages present already are moved, the policy of a shared
+      mapping is kept by the segment so every process attached sees it
+    - RunOnNode runs the first touch on a thread bound to the cpus of the
+      node, memset is local even where the policy doesn't decide
+    - a machine of one node, or a node it doesn't have, is left to the
+      kernel default, both return false and change nothing
+
+  a node is NODE_ANY, NODE_INTERLEAVE or a node number
+*/
+
+const int NODE_ANY = -1;         // kernel default, the first toucher's node
+const int NODE_INTERLEAVE = -2;  // pages round robin over every node
+
+const uint32_t NUMA_MAX_NODES = 1024;
+
+// "0-3,5" of sysfs to 0, 1, 2, 3, 5
+inline std::vector<int> ParseList(const std::string &list) {
+  std::vector<int> items;
+  int low = -1, value = -1;
+  for (size_t i = 0; i <= list.size(); ++i) {
+    char c = i < list.size() ? list[i] : ',';
+    if (c >= '0' && c <= '9') {
+      value = (value < 0 ? 0 : value * 10) + (c - '0');
+    } else if (c == '-') {
+      low = value;
+      value = -1;
+    } else if (c == ',' || c == '\n') {
+      if (value < 0) continue;
+      for (int v = low < 0 ? value : low; v <= value; ++v) items.push_back(v);
+      low = value = -1;
+    }
+  }
+  return items;
+}
+
+inline std::string ReadSysfs(const std::string &path) {
+  std::string content;
+  FILE *file = fopen(path.c_str(), "r");
+  if (file == NULL) return content;
+
+  char buffer[4096];
+  size_t size = fread(buffer, 1, sizeof(buffer), file);
+  fclose(file);
+  content.assign(buffer, size);
+  return content;
+}
+
+// nodes online, 1 if sysfs can't tell
+inline int NodeCount() {
+  static const int count = [] {
+    std::vector<int> nodes =
+        ParseList(ReadSysfs("/sys/devices/system/node/online"));
+    int highest = 0;
+    for (int node : nodes) highest = std::max(highest, node);
+    return nodes.empty() ? 1 : std::min<int>(highest + 1, NUMA_MAX_NODES);
+  }();
+  return count;
+}
+
+inline bool IsNode(int node) {
+  return NodeCount() > 1 && (node == NODE_INTERLEAVE ||
+                             (node >= 0 && node < NodeCount()));
+}
+
+inline std::vector<int> NodeCpus(int node) {
+  return ParseList(ReadSysfs("/sys/devices/system/node/node" +
+                             std::to_string(node) + "/cpulist"));
+}
+
+// whole pages inside [addr, addr + size) only, a neighbour sharing the
+// first or last page keeps its policy
+inline bool Place(void *addr, size_t size, int node) {
+  if (!IsNode(node)) return false;
+
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t begin = ((uintptr_t)addr + page - 1) & ~(page - 1);
+  uintptr_t end = ((uintptr_t)addr + size) & ~(page - 1);
+  if (begin >= end) return false;
+
+  unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+  int mode = MPOL_BIND;
+  if (node == NODE_INTERLEAVE) {
+    mode = MPOL_INTERLEAVE;
+    for (int i = 0; i < NodeCount(); ++i)
+      mask[i / (8 * sizeof(unsigned long))] |=
+          1UL << (i % (8 * sizeof(unsigned long)));
+  } else {
+    mask[node / (8 * sizeof(unsigned long))] |=
+        1UL << (node % (8 * sizeof(unsigned long)));
+  }
+
+  return syscall(SYS_mbind, begin, end - begin, mode, mask,
+                 NUMA_MAX_NODES + 1, MPOL_MF_MOVE) == 0;
+}
+
+// fn on a thread bound to the cpus of node, on this thread if node is not
+// one node of this machine
+template <typename Fn>
+void RunOnNode(int node, Fn fn) {
+  std::vector<int> cpus;
+  if (IsNode(node) && node >= 0) cpus = NodeCpus(node);
+  if (cpus.empty()) return fn();
+
+  std::thread thread([&] {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+      if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    fn();
+  });
+  thread.join();
+}
+
+}  // namespace MapNuma
+#endif  // MAP_NUMA_H
@@ -0,0 +1,129 @@
+#ifndef MAP_PAGE_H
+#define MAP_PAGE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+namespace MapPage {
+
+/*
+  page setup of big segments:
+    - AdviseHuge asks for transparent huge pages on a range of a shared
+      segment, only 2MB extents inside the range get them, false if
+      shmem_enabled of the kernel is never or deny
+    - HugetlbfsMount finds a hugetlbfs mount of a page size, a file there
+      backs a segment by huge pages reserved in advance
+    - Prefault faults a range in by threads of disjoint slices, locked in
+      memory if asked, so the first requests don't page-fault
+
+  all of them fall back to normal pages, a false return changes nothing
+*/
+
+const size_t HUGE_PAGE_2M = 2UL << 20;
+const size_t HUGE_PAGE_1G = 1UL << 30;
+
+// the value in brackets of a sysfs switch, "always [madvise] never"
+inline std::string SysfsChoice(const std::string &path) {
+  char buffer[256] = {0};
+  FILE *file = fopen(path.c_str(), "r");
+  if (file == NULL) return "";
+  size_t size = fread(buffer, 1, sizeof(buffer) - 1, file);
+  fclose(file);
+
+  std::string content(buffer, size);
+  size_t begin = content.find('['), end = content.find(']');
+  if (begin == std::string::npos || end == std::string::npos || end < begin)
+    return "";
+  return content.substr(begin + 1, end - begin - 1);
+}
+
+inline bool AdviseHuge(void *addr, size_t size) {
+  std::string shmem =
+      SysfsChoice("/sys/kernel/mm/transparent_hugepage/shmem_enabled");
+  if (shmem.empty() || shmem == "never" || shmem == "deny") return false;
+
+  uintptr_t begin = ((uintptr_t)addr + HUGE_PAGE_2M - 1) & ~(HUGE_PAGE_2M - 1);
+  uintptr_t end = ((uintptr_t)addr + size) & ~(HUGE_PAGE_2M - 1);
+  if (begin >= end) return false;
+  return madvise((void *)begin, end - begin, MADV_HUGEPAGE) == 0;
+}
+
+// "" if there is none
+inline std::string HugetlbfsMount(size_t page_size) {
+  std::string mount;
+  FILE *file = fopen("/proc/mounts", "r");
+  if (file == NULL) return mount;
+
+  char device[256], path[1024], type[64], options[1024];
+  while (fscanf(file, "%255s %1023s %63s %1023s %*d %*d", device, path, type,
+                options) == 4) {
+    if (strcmp(type, "hugetlbfs") != 0) continue;
+
+    // the default page size has no pagesize option
+    const char *option = strstr(options, "pagesize=");
+    size_t size = option == NULL ? HUGE_PAGE_2M : 0;
+    if (option != NULL) {
+      char unit = 0;
+      sscanf(option, "pagesize=%zu%c", &size, &unit);
+      if (unit == 'M') size <<= 20;
+      if (unit == 'G') size <<= 30;
+    }
+    if (size == page_size && access(path, W_OK) == 0) {
+      mount = path;
+      break;
+    }
+  }
+  fclose(file);
+  return mount;
+}
+
+// false if some slice could not be locked, it is faulted in anyway
+inline bool Prefault(void *addr, size_t size, int thread_num,
+                     bool lock = false) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t begin = (uintptr_t)addr & ~(page - 1);
+  uintptr_t end = ((uintptr_t)addr + size + page - 1) & ~(page - 1);
+  if (thread_num < 1) thread_num = 1;
+
+  // slices of whole 2MB, a huge page of an aligned segment is faulted by
+  // one thread
+  size_t slice = ((end - begin) / thread_num + HUGE_PAGE_2M - 1) &
+                 ~(HUGE_PAGE_2M - 1);
+  std::vector<char> locked(thread_num, 1);
+  auto fault = [&](int index) {
+    uintptr_t from = begin + index * slice;
+    uintptr_t to = std::min<uintptr_t>(end, from + slice);
+    if (from >= to) return;
+
+    // mlock faults the pages in itself
+    if (lock && mlock((void *)from, to - from) == 0) return;
+    locked[index] = !lock;
+
+    // older kernels, a write of the same value keeps what others wrote
+    if (madvise((void *)from, to - from, MADV_POPULATE_WRITE) == 0) return;
+    for (uintptr_t p = from; p < to; p += page)
+      __atomic_fetch_add((char *)p, 0, __ATOMIC_RELAXED);
+  };
+
+  std::vector<std::thread> threads;
+  for (int t = 1; t < thread_num; ++t) threads.push_back(std::thread(fault, t));
+  fault(0);
+  for (auto &t : threads) t.join();
+
+  return std::find(locked.begin(), locked.end(), 0) == locked.end();
+}
+
+}  // namespace MapPage
+#endif  // MAP_PAGE_H
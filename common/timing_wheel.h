@@ -0,0 +1,250 @@
+#ifndef MAP_TIMING_WHEEL_H
+#define MAP_TIMING_WHEEL_H
+
+#include <stdint.h>
+
+#include <atomic>
+
+namespace MapWheel {
+
+/*
+  hierarchical timing wheel indexing nodes by expiry second, so GC only
+  visits the nodes which are due instead of every chain:
+    - level 0 has 512 one-second slots, level 1 and 2 have 64 slots of
+      512 and 32768 seconds, farther expiries wait in the last level
+    - a slot of level 1 or 2 is cascaded down when the clock reaches it
+    - nodes are linked into slots by WheelLinks the map keeps for each
+      of them, in the node or aside, and referenced by uint64_t, a pointer
+      or a segment offset, so the wheel can be placed in shared memory
+    - Link and Unlink are O(1) under the slot lock, an Insert changing the
+      expiry relinks the node at once
+
+  Advance pops a slot at a time and hands every node to the map, which
+  collects it, links it again or drops it, the node is WHEEL_POPPED until
+  then and left alone by Unlink, the map must re-read the expiry after
+  locking the node
+
+  Links is the map's adapter:
+    WheelLinks &Node(uint64_t ref)
+    bool Lock(Lock &lock)  // true if taken over from a dead owner
+    void Unlock(Lock &lock)
+*/
+
+const uint32_t WHEEL_BITS = 9;        // level 0
+const uint32_t WHEEL_UPPER_BITS = 6;  // level 1 and 2
+const uint32_t WHEEL_LEVEL0_SIZE = 1u << WHEEL_BITS;
+const uint32_t WHEEL_UPPER_SIZE = 1u << WHEEL_UPPER_BITS;
+const uint32_t WHEEL_SLOT_NUM = WHEEL_LEVEL0_SIZE + 2 * WHEEL_UPPER_SIZE;
+
+const int64_t WHEEL_LEVEL1_SPAN = (int64_t)WHEEL_LEVEL0_SIZE
+                                  << WHEEL_UPPER_BITS;
+const int64_t WHEEL_LEVEL2_SPAN = WHEEL_LEVEL1_SPAN << WHEEL_UPPER_BITS;
+
+const uint64_t WHEEL_NULL = ~0ULL;
+const int32_t WHEEL_NONE = -1;    // not in the wheel
+const int32_t WHEEL_POPPED = -2;  // handed to the map by Advance
+
+struct WheelLinks {
+  WheelLinks() : _prev(WHEEL_NULL), _next(WHEEL_NULL), _slot(WHEEL_NONE) {}
+
+  uint64_t _prev;
+  uint64_t _next;
+  std::atomic<int32_t> _slot;
+};
+
+// links of nodes in a map without a wheel, an empty base adding nothing
+struct NoLinks {};
+
+template <typename Lock>
+struct WheelSlot {
+  WheelSlot() : _head(WHEEL_NULL) {}
+
+  Lock _lock;
+  uint64_t _head;
+};
+
+template <typename Lock>
+class TimingWheel {
+ public:
+  explicit TimingWheel(int64_t now) : _clock(now), _sequence(0) {}
+
+  // link a node out of the wheel or popped, expiry in the past is due
+  // by the next Advance
+  template <typename Links>
+  void Link(Links &links, uint64_t ref, int64_t expire) {
+    while (true) {
+      // a pop between reading the clock and locking may have passed the
+      // slot, then compute it again
+      uint64_t sequence = _sequence.load(std::memory_order_acquire);
+      int32_t index = SlotIndex(expire, _clock.load(std::memory_order_acquire));
+
+      WheelSlot<Lock> &slot = _slots[index];
+      LockSlot(links, slot, index);
+      if (_sequence.load(std::memory_order_relaxed) != sequence) {
+        links.Unlock(slot._lock);
+        continue;
+      }
+
+      WheelLinks &node = links.Node(ref);
+      node._prev = WHEEL_NULL;
+      node._next = slot._head;
+      if (slot._head != WHEEL_NULL) links.Node(slot._head)._prev = ref;
+      slot._head = ref;
+      node._slot.store(index, std::memory_order_release);
+
+      links.Unlock(slot._lock);
+      return;
+    }
+  }
+
+  // take a node out, nothing is done if it is not in a slot
+  template <typename Links>
+  void Unlink(Links &links, uint64_t ref) {
+    WheelLinks &node = links.Node(ref);
+    while (true) {
+      int32_t index = node._slot.load(std::memory_order_acquire);
+      if (index < 0) return;
+
+      WheelSlot<Lock> &slot = _slots[index];
+      LockSlot(links, slot, index);
+      if (node._slot.load(std::memory_order_relaxed) != index) {
+        // relinked or popped meanwhile
+        links.Unlock(slot._lock);
+        continue;
+      }
+
+      if (node._prev != WHEEL_NULL) {
+        links.Node(node._prev)._next = node._next;
+      } else if (slot._head == ref) {
+        slot._head = node._next;
+      }
+      if (node._next != WHEEL_NULL) links.Node(node._next)._prev = node._prev;
+      node._prev = node._next = WHEEL_NULL;
+      node._slot.store(WHEEL_NONE, std::memory_order_release);
+
+      links.Unlock(slot._lock);
+      return;
+    }
+  }
+
+  // expiry of a node changed, popped nodes are left to Advance
+  template <typename Links>
+  void Relink(Links &links, uint64_t ref, int64_t expire) {
+    if (links.Node(ref)._slot.load(std::memory_order_acquire) == WHEEL_POPPED)
+      return;
+
+    Unlink(links, ref);
+    if (expire != 0) Link(links, ref, expire);
+  }
+
+  // a popped node is neither collected nor linked again
+  template <typename Links>
+  void Drop(Links &links, uint64_t ref) {
+    links.Node(ref)._slot.store(WHEEL_NONE, std::memory_order_release);
+  }
+
+  // visit the seconds before now, handler(ref) takes every popped node,
+  // one thread advances at a time, return the number of nodes handled
+  template <typename Links, typename Handler>
+  uint64_t Advance(Links &links, int64_t now, Handler &&handler) {
+    uint64_t count = 0;
+    int64_t clock = _clock.load(std::memory_order_acquire);
+
+    // far behind, e.g. no GC for hours, sort every node against now
+    // instead of stepping second by second
+    if (now - clock > WHEEL_LEVEL1_SPAN) {
+      for (uint32_t i = 0; i < WHEEL_SLOT_NUM; ++i)
+        count += Pop(links, i, now, handler);
+      return count;
+    }
+
+    for (; clock < now; ++clock) {
+      if ((clock & (WHEEL_LEVEL0_SIZE - 1)) == 0) {
+        if ((clock & (WHEEL_LEVEL1_SPAN - 1)) == 0) {
+          count += Pop(links, UpperIndex(2, clock), clock, handler);
+        }
+        count += Pop(links, UpperIndex(1, clock), clock, handler);
+      }
+      count += Pop(links, clock & (WHEEL_LEVEL0_SIZE - 1), clock + 1, handler);
+    }
+    return count;
+  }
+
+  int64_t Clock() { return _clock.load(std::memory_order_acquire); }
+
+ private:
+  static int32_t UpperIndex(int level, int64_t expire) {
+    uint32_t shift = WHEEL_BITS + (level - 1) * WHEEL_UPPER_BITS;
+    return WHEEL_LEVEL0_SIZE + (level - 1) * WHEEL_UPPER_SIZE +
+           ((expire >> shift) & (WHEEL_UPPER_SIZE - 1));
+  }
+
+  static int32_t SlotIndex(int64_t expire, int64_t clock) {
+    if (expire < clock) expire = clock;
+
+    int64_t delta = expire - clock;
+    if (delta < WHEEL_LEVEL0_SIZE) return expire & (WHEEL_LEVEL0_SIZE - 1);
+    if (delta < WHEEL_LEVEL1_SPAN) return UpperIndex(1, expire);
+    if (delta >= WHEEL_LEVEL2_SPAN) expire = clock + WHEEL_LEVEL2_SPAN - 1;
+    return UpperIndex(2, expire);
+  }
+
+  template <typename Links>
+  void LockSlot(Links &links, WheelSlot<Lock> &slot, int32_t index) {
+    if (!links.Lock(slot._lock)) return;
+
+    // last owner died in the middle, rebuild the back links and slots
+    // from the forward chain
+    uint64_t prev = WHEEL_NULL;
+    for (uint64_t p = slot._head; p != WHEEL_NULL; p = links.Node(p)._next) {
+      links.Node(p)._prev = prev;
+      links.Node(p)._slot.store(index, std::memory_order_relaxed);
+      prev = p;
+    }
+  }
+
+  // take the whole slot, the clock is set under the lock so Link never
+  // picks a slot already passed
+  template <typename Links, typename Handler>
+  uint64_t Pop(Links &links, int32_t index, int64_t clock, Handler &handler) {
+    WheelSlot<Lock> &slot = _slots[index];
+    LockSlot(links, slot, index);
+    uint64_t head = slot._head;
+    slot._head = WHEEL_NULL;
+    for (uint64_t p = head; p != WHEEL_NULL; p = links.Node(p)._next)
+      links.Node(p)._slot.store(WHEEL_POPPED, std::memory_order_relaxed);
+    _clock.store(clock, std::memory_order_release);
+    _sequence.fetch_add(1, std::memory_order_acq_rel);
+    links.Unlock(slot._lock);
+
+    uint64_t count = 0;
+    while (head != WHEEL_NULL) {
+      uint64_t next = links.Node(head)._next;
+      handler(head);
+      head = next;
+      ++count;
+    }
+    return count;
+  }
+
+  std::atomic<int64_t> _clock;  // seconds before are visited
+  std::atomic<uint64_t> _sequence;  // pops so far
+  WheelSlot<Lock> _slots[WHEEL_SLOT_NUM];
+};
+
+// slot lock of a wheel in the heap
+struct SpinLock {
+  SpinLock() : _locked(false) {}
+
+  void Lock() {
+    while (_locked.exchange(true, std::memory_order_acquire)) {
+    }
+  }
+
+  void Unlock() { _locked.store(false, std::memory_order_release); }
+
+  std::atomic<bool> _locked;
+};
+
+}  // namespace MapWheel
+#endif  // MAP_TIMING_WHEEL_H
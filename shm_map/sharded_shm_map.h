@@ -0,0 +1,343 @@
+#ifndef SHARDED_SHM_MAP_H
+#define SHARDED_SHM_MAP_H
+
+#include <assert.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "../common/numa.h"
+#include "./shm_map.h"
+#include "./shm_pool.h"
+
+namespace ShmMap {
+
+/*
+  ShmHashMap split into shards, each with its own MemoryPool and bucket
+  array so writers of different shards share no free ring, lock or cache
+  line:
+    - shard i is the map name + "_" + i with the pool name + "_pool_" + i,
+      processes attach to the shards by the base name
+    - a key goes to the shard picked by the high bits of its hash, the
+      shards pick buckets by the low bits
+    - a thread owning a partition of the keys may pass its shard as a hint
+      instead, see InsertAt
+    - GetCount, GetAllKeys, GetAllValues, GC and Recover visit every shard
+    - with _numa the pool of shard i is placed on NUMA node i % nodes,
+      threads bound to ShardNode of their shard read and write local memory
+
+  Hasher must be a functor, shards are built by the front-end and can't
+  override HashCode
+*/
+
+const std::string SHARD_META = "_shard_meta";
+const std::string SHARD_POOL = "_pool_";
+
+// MapOptions of every shard and the pools of the shards
+struct ShardedMapOptions : public MapOptions {
+  ShardedMapOptions() {
+    _magazine = false;
+    _numa = false;
+  }
+
+  // pools cache free nodes per thread, see ShmPool::MemoryPool
+  bool _magazine;
+  // the pool of shard i is placed on NUMA node i % nodes, only used when
+  // the pools are created
+  bool _numa;
+};
+
+template <typename Key, typename Value,
+          typename Storage = DirectStorage<Key, Value>,
+          typename Hasher = MapHash::WyHasher,
+          typename Clock = MapClock::SystemClock>
+class ShardedShmHashMap {
+ public:
+  typedef ShmHashMap<Key, Value, Storage, Hasher, Clock> Shard;
+  typedef ItemNode<typename Storage::StoredKey, typename Storage::StoredValue>
+      Node;
+
+  // node_size and bucket_size are of the whole map, split evenly, the
+  // other arguments are passed to every shard, all processes must pass the
+  // same shard_num
+  ShardedShmHashMap(std::string name, uint32_t shard_num, uint32_t node_size,
+                    ShmPool::Segment segment,
+                    uint32_t bucket_size = DEBFAULT_BUCKET_SIZE,
+                    float max_load_factor = DEFAULT_MAX_LOAD_FACTOR,
+                    const ShardedMapOptions &options = ShardedMapOptions());
+
+  ~ShardedShmHashMap();
+
+  uint32_t ShardNum() { return _shards.size(); }
+
+  Shard *GetShard(uint32_t index) { return _shards[index]; }
+
+  // NUMA node of the pool of a shard, MapNuma::NODE_ANY without numa or on
+  // a machine of one node
+  int ShardNode(uint32_t index) { return _nodes[index]; }
+
+  // shard of key when no hint is given
+  uint32_t ShardOf(const Key &key) {
+    return ((uint64_t)(uint32_t)Hasher()(key) * _shards.size()) >> 32;
+  }
+
+  int Insert(const Key &key, const Value &value, int expire = 0) {
+    return _shards[ShardOf(key)]->Insert(key, value, expire);
+  }
+
+  int InsertMs(const Key &key, const Value &value, int64_t expire_ms) {
+    return _shards[ShardOf(key)]->InsertMs(key, value, expire_ms);
+  }
+
+  int Get(const Key &key, Value &value) {
+    return _shards[ShardOf(key)]->Get(key, value);
+  }
+
+  int Erase(const Key &key) { return _shards[ShardOf(key)]->Erase(key); }
+
+  // shard hint, a thread writing a partition of the keys of its own passes
+  // its shard so writers of other partitions don't meet it, every call on
+  // a key must pass the same shard, taken modulo ShardNum
+  int InsertAt(uint32_t shard, const Key &key, const Value &value,
+               int expire = 0) {
+    return _shards[shard % _shards.size()]->Insert(key, value, expire);
+  }
+
+  int GetAt(uint32_t shard, const Key &key, Value &value) {
+    return _shards[shard % _shards.size()]->Get(key, value);
+  }
+
+  int EraseAt(uint32_t shard, const Key &key) {
+    return _shards[shard % _shards.size()]->Erase(key);
+  }
+
+  // keys grouped by shard, each group batched by its shard
+  void MultiGet(const Key *keys, size_t n, Value *values, int *rets);
+
+  // keys grouped by shard, thread_num threads load disjoint shards
+  int BulkLoad(const Key *keys, const Value *values, size_t n, int expire = 0,
+               int thread_num = 1);
+
+  int GetCount();
+
+  int GetAllValues(std::vector<Value> &values);
+
+  int GetAllKeys(std::vector<Key> &keys);
+
+  void GC();
+
+  // incremental GC of one shard a call, shards in turn, a shard collected
+  // by another process is skipped, false if all of them are
+  bool GC(uint32_t max_steps, uint32_t max_micros);
+
+  // thread_num threads collect disjoint shards
+  void ParallelGC(int thread_num);
+
+  // shards recovered in turn by thread_num threads each, see
+  // ShmHashMap::Recover, false if a shard is held by a living process
+  bool Recover(int thread_num = 1);
+
+ private:
+  static_assert(!std::is_same<Hasher, MapHash::VirtualHasher>::value,
+                "shards are hashed by a Hasher functor");
+
+  // indexes of keys of each shard
+  void GroupByShard(const Key *keys, size_t n,
+                    std::vector<std::vector<size_t>> &groups);
+
+  std::vector<ShmPool::MemoryPool<Node> *> _pools;
+  std::vector<Shard *> _shards;
+  std::vector<int> _nodes;
+  uint32_t _gc_cursor;
+};
+
+// implements
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+ShardedShmHashMap<Key, Value, Storage, Hasher, Clock>::ShardedShmHashMap(
+    std::string name, uint32_t shard_num, uint32_t node_size,
+    ShmPool::Segment segment, uint32_t bucket_size, float max_load_factor,
+    const ShardedMapOptions &options) {
+  assert(shard_num != 0);
+  uint32_t *meta =
+      segment.find_or_construct<uint32_t>((name + SHARD_META).c_str())(
+          shard_num);
+  assert(*meta == shard_num);
+
+  uint32_t shard_nodes = (node_size + shard_num - 1) / shard_num;
+  uint32_t shard_buckets = std::max(1u, bucket_size / shard_num);
+  for (uint32_t i = 0; i < shard_num; ++i) {
+    std::string index = std::to_string(i);
+    int node = MapNuma::NODE_ANY;
+    if (options._numa && MapNuma::NodeCount() > 1)
+      node = i % MapNuma::NodeCount();
+    _nodes.push_back(node);
+
+    _pools.push_back(new ShmPool::MemoryPool<Node>(
+        name + SHARD_POOL + index, shard_nodes, segment, options._magazine,
+        node));
+    _shards.push_back(new Shard(name + "_" + index, _pools[i], segment,
+                                shard_buckets, max_load_factor, options));
+  }
+  _gc_cursor = 0;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+ShardedShmHashMap<Key, Value, Storage, Hasher, Clock>::~ShardedShmHashMap() {
+  for (auto shard : _shards) delete shard;
+  for (auto pool : _pools) delete pool;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShardedShmHashMap<Key, Value, Storage, Hasher, Clock>::GroupByShard(
+    const Key *keys, size_t n, std::vector<std::vector<size_t>> &groups) {
+  groups.assign(_shards.size(), std::vector<size_t>());
+  for (size_t i = 0; i < n; ++i) groups[ShardOf(keys[i])].push_back(i);
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShardedShmHashMap<Key, Value, Storage, Hasher, Clock>::MultiGet(
+    const Key *keys, size_t n, Value *values, int *rets) {
+  if (_shards.size() == 1) return _shards[0]->MultiGet(keys, n, values, rets);
+
+  std::vector<std::vector<size_t>> groups;
+  GroupByShard(keys, n, groups);
+
+  std::vector<Key> batch_keys;
+  std::vector<Value> batch_values;
+  std::vector<int> batch_rets;
+  for (uint32_t s = 0; s < _shards.size(); ++s) {
+    std::vector<size_t> &group = groups[s];
+    if (group.empty()) continue;
+
+    batch_keys.clear();
+    for (size_t i : group) batch_keys.push_back(keys[i]);
+    batch_values.resize(group.size());
+    batch_rets.resize(group.size());
+    _shards[s]->MultiGet(batch_keys.data(), group.size(), batch_values.data(),
+                         batch_rets.data());
+
+    for (size_t i = 0; i < group.size(); ++i) {
+      rets[group[i]] = batch_rets[i];
+      if (batch_rets[i] == RET_OK) values[group[i]] = batch_values[i];
+    }
+  }
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+int ShardedShmHashMap<Key, Value, Storage, Hasher, Clock>::BulkLoad(
+    const Key *keys, const Value *values, size_t n, int expire,
+    int thread_num) {
+  std::vector<std::vector<size_t>> groups;
+  GroupByShard(keys, n, groups);
+
+  // a failed shard is reported, the others are loaded anyway
+  std::vector<int> rets(_shards.size(), RET_OK);
+  auto load = [&](int owner) {
+    std::vector<Key> batch_keys;
+    std::vector<Value> batch_values;
+    for (uint32_t s = owner; s < _shards.size(); s += thread_num) {
+      batch_keys.clear();
+      batch_values.clear();
+      for (size_t i : groups[s]) {
+        batch_keys.push_back(keys[i]);
+        batch_values.push_back(values[i]);
+      }
+      rets[s] = _shards[s]->BulkLoad(batch_keys.data(), batch_values.data(),
+                                     batch_keys.size(), expire);
+    }
+  };
+
+  if (thread_num < 1) thread_num = 1;
+  std::vector<std::thread> threads;
+  for (int t = 1; t < thread_num; ++t) threads.push_back(std::thread(load, t));
+  load(0);
+  for (auto &t : threads) t.join();
+
+  for (int ret : rets) {
+    if (ret != RET_OK) return ret;
+  }
+  return RET_OK;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+int ShardedShmHashMap<Key, Value, Storage, Hasher, Clock>::GetCount() {
+  int count = 0;
+  for (auto shard : _shards) count += shard->GetCount();
+  return count;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+int ShardedShmHashMap<Key, Value, Storage, Hasher, Clock>::GetAllValues(
+    std::vector<Value> &values) {
+  for (auto shard : _shards) shard->GetAllValues(values);
+  return RET_OK;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+int ShardedShmHashMap<Key, Value, Storage, Hasher, Clock>::GetAllKeys(
+    std::vector<Key> &keys) {
+  for (auto shard : _shards) shard->GetAllKeys(keys);
+  return RET_OK;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShardedShmHashMap<Key, Value, Storage, Hasher, Clock>::GC() {
+  for (auto shard : _shards) shard->GC();
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+bool ShardedShmHashMap<Key, Value, Storage, Hasher, Clock>::GC(
+    uint32_t max_steps, uint32_t max_micros) {
+  // one shard a call, a shard busy with another collector is skipped
+  for (uint32_t i = 0; i < _shards.size(); ++i) {
+    uint32_t index = _gc_cursor++ % _shards.size();
+    if (_shards[index]->GC(max_steps, max_micros)) return true;
+  }
+  return false;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShardedShmHashMap<Key, Value, Storage, Hasher, Clock>::ParallelGC(
+    int thread_num) {
+  if (thread_num < 1) thread_num = 1;
+  auto collect = [&](int owner) {
+    for (uint32_t s = owner; s < _shards.size(); s += thread_num)
+      _shards[s]->GC();
+  };
+
+  std::vector<std::thread> threads;
+  for (int t = 1; t < thread_num; ++t)
+    threads.push_back(std::thread(collect, t));
+  collect(0);
+  for (auto &t : threads) t.join();
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+bool ShardedShmHashMap<Key, Value, Storage, Hasher, Clock>::Recover(
+    int thread_num) {
+  bool recovered = true;
+  for (Shard *shard : _shards) {
+    if (!shard->Recover(thread_num)) recovered = false;
+  }
+  return recovered;
+}
+
+}  // namespace ShmMap
+#endif  // SHARDED_SHM_MAP_H
@@ -0,0 +1,162 @@
+#include "./sharded_shm_map.h"
+
+#include <algorithm>
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace ShmMap;
+
+typedef ShardedShmHashMap<uint32_t, uint32_t, DirectStorage<uint32_t, uint32_t>,
+                          MapHash::IntHasher>
+    MyShardedMap;
+
+const uint64_t GetTimestampMS() {
+  return (std::chrono::duration_cast<std::chrono::milliseconds>(
+              std::chrono::system_clock::now().time_since_epoch()))
+      .count();
+}
+
+void SimpleTest() {
+  const uint32_t KEY_NUM = 100000;
+
+  shared_memory_object::remove("MyShardedMap");
+  boost::interprocess::managed_shared_memory managedSharedMemory(
+      create_only, "MyShardedMap", 256 * 1024 * 1024);
+
+  MyShardedMap hash_map("SimpleTest", 8, KEY_NUM * 2, &managedSharedMemory,
+                        KEY_NUM / 4);
+  for (uint32_t i = 0; i < KEY_NUM; ++i) hash_map.Insert(i, i, i % 2);
+  // keys of a partition of shard 3
+  for (uint32_t i = KEY_NUM; i < KEY_NUM + 100; ++i)
+    hash_map.InsertAt(3, i, i);
+
+  uint32_t value = 0;
+  int count = 0;
+  for (uint32_t i = 0; i < KEY_NUM; ++i) {
+    if (hash_map.Get(i, value) != RET_OK || value != i) {
+      cout << "ERROR" << endl;
+      exit(0);
+    }
+    count += hash_map.GetShard(hash_map.ShardOf(i))->Get(i, value) == RET_OK;
+  }
+  cout << "keys in their shard: " << count << endl;
+
+  if (hash_map.GetAt(3, KEY_NUM, value) != RET_OK ||
+      hash_map.GetShard(3)->GetCount() < 100) {
+    cout << "ERROR" << endl;
+    exit(0);
+  }
+
+  std::vector<uint32_t> keys;
+  hash_map.GetAllKeys(keys);
+  cout << "count: " << hash_map.GetCount() << " keys: " << keys.size()
+       << endl;
+
+  // a second attach sees the same shards
+  MyShardedMap other("SimpleTest", 8, KEY_NUM * 2, &managedSharedMemory,
+                     KEY_NUM / 4);
+  uint32_t batch[4] = {1, 2, KEY_NUM * 3, 4}, values[4];
+  int rets[4];
+  other.MultiGet(batch, 4, values, rets);
+  cout << "multi get: " << rets[0] << " " << rets[1] << " " << rets[2] << " "
+       << rets[3] << endl;
+
+  sleep(2);
+  hash_map.ParallelGC(4);
+  hash_map.ParallelGC(4);
+  cout << "count after gc: " << hash_map.GetCount() << endl;
+
+  if (hash_map.GetCount() != (int)(KEY_NUM / 2 + 100)) {
+    cout << "ERROR" << endl;
+    exit(0);
+  }
+  shared_memory_object::remove("MyShardedMap");
+}
+
+// writers of disjoint keys into one shard or a shard a writer
+void WriteCost(int thread_num, uint32_t shard_num) {
+  const uint32_t KEY_NUM = 2000000;
+
+  shared_memory_object::remove("MyShardedMap");
+  boost::interprocess::managed_shared_memory managedSharedMemory(
+      create_only, "MyShardedMap", 1024 * 1024 * 1024);
+
+  MyShardedMap hash_map("WriteCost", shard_num, KEY_NUM, &managedSharedMemory,
+                        KEY_NUM);
+
+  auto insert = [&](int index) {
+    for (uint32_t i = index; i < KEY_NUM; i += thread_num)
+      hash_map.InsertAt(index, i, i);
+  };
+
+  uint64_t begin = GetTimestampMS();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_num; ++t)
+    threads.push_back(std::thread(insert, t));
+  for (auto& t : threads) t.join();
+  uint64_t cost = GetTimestampMS() - begin;
+
+  cout << thread_num << " writers " << shard_num
+       << " shards inserts/s: " << KEY_NUM * 1000ULL / (cost ? cost : 1)
+       << endl;
+
+  if (hash_map.GetCount() != (int)KEY_NUM) {
+    cout << "ERROR" << endl;
+    exit(0);
+  }
+  shared_memory_object::remove("MyShardedMap");
+}
+
+// shard pools placed on the nodes, a reader bound to the node of each
+// shard, a machine of one node keeps the default placement
+void NumaTest() {
+  const uint32_t KEY_NUM = 1000000;
+  const uint32_t SHARD_NUM = 4;
+
+  shared_memory_object::remove("MyShardedMap");
+  boost::interprocess::managed_shared_memory managedSharedMemory(
+      create_only, "MyShardedMap", 512 * 1024 * 1024);
+
+  ShardedMapOptions options;
+  options._numa = true;
+  MyShardedMap hash_map("NumaTest", SHARD_NUM, KEY_NUM, &managedSharedMemory,
+                        KEY_NUM, DEFAULT_MAX_LOAD_FACTOR, options);
+  for (uint32_t i = 0; i < KEY_NUM; ++i) hash_map.InsertAt(i % SHARD_NUM, i, i);
+
+  uint64_t begin = GetTimestampMS();
+  for (uint32_t s = 0; s < SHARD_NUM; ++s) {
+    MapNuma::RunOnNode(hash_map.ShardNode(s), [&] {
+      uint32_t value;
+      for (uint32_t i = s; i < KEY_NUM; i += SHARD_NUM) {
+        if (hash_map.GetAt(s, i, value) != RET_OK || value != i) {
+          cout << "ERROR" << endl;
+          exit(0);
+        }
+      }
+    });
+  }
+  cout << "numa nodes: " << MapNuma::NodeCount()
+       << " node of shard 1: " << hash_map.ShardNode(1)
+       << " local get cost: " << GetTimestampMS() - begin << "ms" << endl;
+  shared_memory_object::remove("MyShardedMap");
+}
+
+void WriteTest() {
+  for (int thread_num = 1; thread_num <= 16; thread_num *= 2) {
+    WriteCost(thread_num, 1);
+    WriteCost(thread_num, thread_num);
+  }
+}
+
+int main() {
+  SimpleTest();
+
+  NumaTest();
+
+  WriteTest();
+
+  return 0;
+}
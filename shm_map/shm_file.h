@@ -0,0 +1,164 @@
+#ifndef SHM_FILE_H
+#define SHM_FILE_H
+
+#include <assert.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <boost/interprocess/managed_mapped_file.hpp>
+#include <string>
+
+#include "./shm_pool.h"
+
+namespace ShmPool {
+
+/*
+  segment in a file for maps which outlive a reboot, pools and maps are
+  built on Get() as on shared memory and reopened in place, nothing is
+  loaded, pages come in on first touch:
+    - Checkpoint syncs the whole mapping, then the header naming a new
+      generation, a generation on disk holds everything written before
+      the call, it is consistent if writers of every process are paused
+    - Close checkpoints, the last process of the boot to close marks the
+      file clean, an open marks it dirty on disk before it returns
+    - after a reboot the content is whole if the file was clean, otherwise
+      pages written after the last checkpoint may be partly on disk and
+      the map is to be rebuilt, within a boot the page cache holds the
+      content so a process restart always finds it whole
+    - on a hugetlbfs mount the size is rounded up to the huge page
+
+  readers and writers of the maps don't know about the file, the page
+  cache writes pages back as it does for any shared mapping
+*/
+
+const std::string FILE_HEADER = "_file_header";
+const uint64_t FILE_MAGIC = 0x53484d46494c4531ULL;  // "SHMFILE1"
+const uint32_t BOOT_ID_SIZE = 40;
+const long HUGETLBFS_MAGIC_NUMBER = 0x958458f6;
+
+struct FileHeader {
+  FileHeader() {
+    _magic = FILE_MAGIC;
+    _generation = 0;
+    _clean = 0;
+    _open_count = 0;
+    memset(_boot_id, 0, sizeof(_boot_id));
+  }
+
+  uint64_t _magic;
+  std::atomic<uint64_t> _generation;  // checkpoints done
+  std::atomic<uint32_t> _clean;       // closed by the last process
+  std::atomic<uint32_t> _open_count;  // processes of the boot of _boot_id
+  char _boot_id[BOOT_ID_SIZE];
+};
+
+// changes with every boot of the host
+inline std::string BootId() {
+  char buffer[BOOT_ID_SIZE] = {0};
+  FILE *file = fopen("/proc/sys/kernel/random/boot_id", "r");
+  if (file == NULL) return "";
+  size_t size = fread(buffer, 1, sizeof(buffer) - 1, file);
+  fclose(file);
+
+  std::string boot_id(buffer, size);
+  while (!boot_id.empty() && boot_id.back() == '\n') boot_id.pop_back();
+  return boot_id;
+}
+
+// size rounded up to the page of the file system of path, huge pages on
+// hugetlbfs
+inline size_t FileSegmentSize(const std::string &path, size_t size) {
+  std::string copy = path;
+  struct statfs fs;
+  if (statfs(dirname(&copy[0]), &fs) != 0 ||
+      fs.f_type != HUGETLBFS_MAGIC_NUMBER || fs.f_bsize <= 0)
+    return size;
+  return (size + fs.f_bsize - 1) / fs.f_bsize * fs.f_bsize;
+}
+
+class MappedFile {
+ public:
+  // opens path or creates it of size
+  MappedFile(const std::string &path, size_t size)
+      : _file(open_or_create, path.c_str(), FileSegmentSize(path, size)),
+        _closed(false) {
+    std::string boot_id = BootId();
+    auto open = [&] {
+      _header = _file.find<FileHeader>(FILE_HEADER.c_str()).first;
+      _warm = _header != NULL;
+      if (!_warm) _header = _file.construct<FileHeader>(FILE_HEADER.c_str())();
+      assert(_header->_magic == FILE_MAGIC);
+
+      // processes of an earlier boot are gone
+      bool rebooted = strncmp(_header->_boot_id, boot_id.c_str(),
+                              BOOT_ID_SIZE - 1) != 0;
+      _consistent = !_warm || !rebooted || _header->_clean;
+      if (rebooted) {
+        strncpy(_header->_boot_id, boot_id.c_str(), BOOT_ID_SIZE - 1);
+        _header->_open_count = 0;
+      }
+      _header->_open_count++;
+      _header->_clean = 0;
+    };
+    _file.get_segment_manager()->atomic_func(open);
+    SyncHeader();
+  }
+
+  ~MappedFile() { Close(); }
+
+  // the segment of pools and maps
+  managed_mapped_file *Get() { return &_file; }
+
+  // the file had content of an earlier run
+  bool Warm() const { return _warm; }
+
+  // the content is whole, false after a reboot which followed writes not
+  // closed by Close
+  bool Consistent() const { return _consistent; }
+
+  uint64_t Generation() const { return _header->_generation.load(); }
+
+  // return the generation on disk
+  uint64_t Checkpoint() {
+    msync(_file.get_address(), _file.get_size(), MS_SYNC);
+    uint64_t generation = ++_header->_generation;
+    SyncHeader();
+    return generation;
+  }
+
+  // writers and GC of this process must be done, the maps of the file are
+  // not used once it returns
+  void Close() {
+    if (_closed) return;
+    _closed = true;
+
+    Checkpoint();
+    auto close = [&] {
+      if (--_header->_open_count == 0) _header->_clean = 1;
+    };
+    _file.get_segment_manager()->atomic_func(close);
+    SyncHeader();
+  }
+
+ private:
+  void SyncHeader() {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = (uintptr_t)_header & ~(page - 1);
+    uintptr_t end = ((uintptr_t)(_header + 1) + page - 1) & ~(page - 1);
+    msync((void *)begin, end - begin, MS_SYNC);
+  }
+
+  managed_mapped_file _file;
+  FileHeader *_header;
+  bool _warm;
+  bool _consistent;
+  bool _closed;
+};
+
+}  // namespace ShmPool
+#endif  // SHM_FILE_H
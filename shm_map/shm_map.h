@@ -1,34 +1,216 @@
 #ifndef SHM_MAP_H
 #define SHM_MAP_H
 
+#include <sched.h>
 #include <stdio.h>
 #include <time.h>
 
+#include <algorithm>
 #include <atomic>
 #include <boost/interprocess/managed_shared_memory.hpp>
+#include <thread>
+#include <utility>
 #include <vector>
 
+#include "../common/clock.h"
+#include "../common/frequency_sketch.h"
+#include "../common/hash.h"
+#include "../common/timing_wheel.h"
 #include "./shm_pool.h"
+#include "./shm_slab.h"
 
 namespace ShmMap {
 
 using namespace boost::interprocess;
 const std::string BUCKET = "_bucket";
 const std::string BUCKET_SIZE = "_bucket_size";
+const std::string BUCKET_TABLE = "_bucket_table";
+const std::string READER_TABLE = "_reader_table";
 const std::string GARBAGE_LIST_HEAD = "_garbage_head";
 const std::string GARBAGE_LIST_TAIL = "_garbage_tail";
+const std::string ERASED_LIST = "_erased_list";
+const std::string TIMING_WHEEL = "_timing_wheel";
+const std::string WHEEL_LINKS = "_wheel_links";
+const std::string CLOCK_PAGE = "_clock_page";  // one for all maps of a segment
+const std::string SKETCH = "_sketch";
+const std::string SKETCH_TABLE = "_sketch_table";
 const uint32_t DEBFAULT_BUCKET_SIZE = 1024;
 
+const uint32_t READER_SLOT_SIZE = 1024;  // threads reading at the same time
+const float DEFAULT_MAX_LOAD_FACTOR = 4.0;
+const uint32_t MIGRATE_STEP = 4;        // buckets moved on the back of Insert
+const uint32_t GC_MIGRATE_STEP = 4096;  // buckets moved on the back of GC
+const int MULTI_GET_BATCH = 16;         // lookups whose memory loads overlap
+const uint32_t BULK_ALLOCATE_BATCH = 1024;  // pool nodes taken at a time
+const uint32_t EVICT_BATCH = 64;  // nodes evicted to make room at a time
+const int EVICT_RETRY = 8;  // evictions an Insert tries before failing
+const int EVICT_WAIT_SPINS = 1000;  // yields waiting for readers to leave
+const uint32_t ADMIT_SAMPLE = 4;  // cold nodes a key to admit is compared with
+const int EVICT_BUSY = -1;      // another thread holds the maintain lock
+const int EVICT_REJECTED = -2;  // no entry seen less often than the new key
+
 template <typename Key, typename Value>
 struct ItemNode {
-  uint64_t _next;
+  // a node is linked in two bucket tables while migrating,
+  // table of generation g uses _next[g & 1]
+  uint64_t _next[2];
   Key _key;
   Value _value;
-  volatile int _expire;
+  volatile int64_t _expire;  // milliseconds of the wall clock, 0 for never
 
-  std::atomic<int>
-      _invalid;  // 0 - valid  1 - add garbage list  2 - should to delete
+  std::atomic<int> _invalid;  // 0 - valid  1 - collecting  2 - in garbage list
+  std::atomic<uint32_t> _generation;  // generation of table the node is in
+  std::atomic<uint8_t> _referenced;  // read since the eviction hand passed
   uint64_t _del_next;
+  uint64_t _retire_epoch;  // epoch when unlinked from the bucket
+};
+
+/*
+  storage policy, how Key and Value are kept in ItemNode:
+    - StoredKey / StoredValue are the types of ItemNode::_key / _value
+    - Store* may allocate out of line and fails if there is no memory,
+      Release gives out-of-line memory back when the node is freed
+    - InPlace tells whether a value can be overwritten while readers copy
+      it, otherwise Insert links a new node and leaves the old one to GC
+*/
+
+// Key and Value are kept in the node as they are
+template <typename Key, typename Value>
+struct DirectStorage {
+  typedef Key StoredKey;
+  typedef Value StoredValue;
+
+  static bool KeyEqual(const Key &stored, const Key &key,
+                       ShmPool::SlabPool * /* slab */) {
+    return stored == key;
+  }
+
+  static void LoadKey(const Key &stored, Key &key,
+                      ShmPool::SlabPool * /* slab */) {
+    key = stored;
+  }
+
+  static void LoadValue(const Value &stored, Value &value,
+                        ShmPool::SlabPool * /* slab */) {
+    value = stored;
+  }
+
+  static bool StoreKey(Key &stored, const Key &key,
+                       ShmPool::SlabPool * /* slab */) {
+    stored = key;
+    return true;
+  }
+
+  static bool StoreValue(Value &stored, const Value &value,
+                         ShmPool::SlabPool * /* slab */) {
+    stored = value;
+    return true;
+  }
+
+  static bool InPlace(const Value & /* stored */, const Value & /* value */) {
+    return true;
+  }
+
+  static void Release(Key & /* key */, Value & /* value */,
+                      ShmPool::SlabPool * /* slab */) {}
+};
+
+// string kept in the node up to N bytes, in a slab blob if longer
+template <uint32_t N>
+struct InlineBlob {
+  InlineBlob() { _size = 0; }
+
+  bool Spilled() const { return _size > N; }
+
+  const char *Data(ShmPool::SlabPool *slab) const {
+    return Spilled() ? (const char *)slab->GetPtr(_offset) : _data;
+  }
+
+  bool Equal(const std::string &str, ShmPool::SlabPool *slab) const {
+    return _size == str.size() && memcmp(Data(slab), str.data(), _size) == 0;
+  }
+
+  void Load(std::string &str, ShmPool::SlabPool *slab) const {
+    str.assign(Data(slab), _size);
+  }
+
+  bool Store(const std::string &str, ShmPool::SlabPool *slab) {
+    Release(slab);
+
+    if (str.size() <= N) {
+      memcpy(_data, str.data(), str.size());
+      _size = str.size();
+      return true;
+    }
+
+    uint64_t offset = slab->Allocate(str.size());
+    if (offset == OFFSET_NULL) return false;
+
+    memcpy(slab->GetPtr(offset), str.data(), str.size());
+    _offset = offset;
+    _size = str.size();
+    return true;
+  }
+
+  // only a spilled blob is given back
+  void Release(ShmPool::SlabPool *slab) {
+    if (!Spilled()) return;
+
+    slab->Free(_offset, _size);
+    _size = 0;
+  }
+
+  uint32_t _size;
+  union {
+    char _data[N];
+    uint64_t _offset;  // slab blob if _size > N
+  };
+};
+
+// std::string key and value, inline up to KEY_INLINE and VALUE_INLINE
+// bytes, up to ShmPool::SLAB_MAX_SIZE out of line
+template <uint32_t KEY_INLINE, uint32_t VALUE_INLINE>
+struct InlineStorage {
+  typedef InlineBlob<KEY_INLINE> StoredKey;
+  typedef InlineBlob<VALUE_INLINE> StoredValue;
+
+  static bool KeyEqual(const StoredKey &stored, const std::string &key,
+                       ShmPool::SlabPool *slab) {
+    return stored.Equal(key, slab);
+  }
+
+  static void LoadKey(const StoredKey &stored, std::string &key,
+                      ShmPool::SlabPool *slab) {
+    stored.Load(key, slab);
+  }
+
+  static void LoadValue(const StoredValue &stored, std::string &value,
+                        ShmPool::SlabPool *slab) {
+    stored.Load(value, slab);
+  }
+
+  static bool StoreKey(StoredKey &stored, const std::string &key,
+                       ShmPool::SlabPool *slab) {
+    return stored.Store(key, slab);
+  }
+
+  static bool StoreValue(StoredValue &stored, const std::string &value,
+                         ShmPool::SlabPool *slab) {
+    return stored.Store(value, slab);
+  }
+
+  // readers copy the bytes and the size unlocked, a changed string would
+  // be torn, every value goes to a new node
+  static bool InPlace(const StoredValue & /* stored */,
+                      const std::string & /* value */) {
+    return false;
+  }
+
+  static void Release(StoredKey &key, StoredValue &value,
+                      ShmPool::SlabPool *slab) {
+    key.Release(slab);
+    value.Release(slab);
+  }
 };
 
 struct BucketItem {
@@ -36,12 +218,220 @@ struct BucketItem {
 
   uint64_t _head;
   std::atomic<uint64_t> _tail;
+  std::atomic<bool> _migrated;  // chain is moved to the new bucket table
+  ShmPool::OwnerLock _unlink_lock;  // one thread unlinks or moves nodes
 
   BucketItem() {
     _count = 0;
     _head = OFFSET_NULL;
     _tail = OFFSET_NULL;
+    _migrated = false;
+  }
+};
+
+/*
+  bucket table descriptor shared by all attached processes:
+    - bucket arrays are addressed by segment handle
+    - a state is never changed after published, the writer fills the other
+      state and flips _version, readers retry if _version moved meanwhile
+    - while migrating, chains of the old table stay readable and nodes are
+      moved one by one into the new table through the other _next link
+*/
+struct BucketTableState {
+  uint32_t _generation;
+  uint64_t _handle;
+  uint32_t _bucket_size;
+
+  // migrating if _old_bucket_size != 0
+  uint64_t _old_handle;
+  uint32_t _old_bucket_size;
+};
+
+struct BucketTableMeta {
+  BucketTableMeta(uint64_t handle, uint32_t bucket_size) {
+    _version = 0;
+    _states[0]._generation = 0;
+    _states[0]._handle = handle;
+    _states[0]._bucket_size = bucket_size;
+    _states[0]._old_handle = 0;
+    _states[0]._old_bucket_size = 0;
+    _states[1] = _states[0];
+    _migrate_index = 0;
+    _retired_handle = 0;
+    _retired_bucket_size = 0;
+    _retired_epoch = 0;
+    _item_count = 0;
+    _scan_cursor = 0;
+    _scan_rounds = 0;
+    _garbage_count = 0;
+    _erased_pending = OFFSET_NULL;
+    _evict_cursor = 0;
+  }
+
+  BucketTableState &Current() {
+    return _states[_version.load(std::memory_order_acquire) & 1];
+  }
+
+  void Publish(const BucketTableState &state) {
+    uint64_t version = _version.load(std::memory_order_acquire);
+    _states[(version + 1) & 1] = state;
+    _version.store(version + 1, std::memory_order_release);
+  }
+
+  std::atomic<uint64_t> _version;
+  BucketTableState _states[2];
+  uint32_t _migrate_index;
+
+  // freed once no reader is in the epoch migration finished
+  uint64_t _retired_handle;
+  uint32_t _retired_bucket_size;
+  uint64_t _retired_epoch;
+
+  std::atomic<int64_t> _item_count;
+
+  // one process scan or migrate at the same time
+  ShmPool::OwnerLock _maintain_lock;
+
+  // GC state under the maintain lock, a GC call of any process resumes
+  // the scan round left by the last one
+  uint32_t _scan_cursor;    // next bucket to scan
+  uint64_t _scan_rounds;    // rounds finished
+  uint64_t _garbage_count;  // nodes in the garbage list
+  uint64_t _erased_pending;  // taken from the erased list, not moved yet
+  uint32_t _evict_cursor;    // hand of the CLOCK eviction
+};
+
+/*
+  epoch based reclamation shared by all attached processes:
+    - each reading thread owns a slot in the segment and publishes the
+      global epoch it entered with, memory unlinked at epoch e is freed
+      once no slot is still in an epoch <= e
+    - slot of a dead thread or process is skipped by the reclaimer and
+      taken over by the next thread short of a slot
+*/
+struct ReaderSlot {
+  std::atomic<uint64_t> _owner;  // pid << 32 | tid, 0 - free
+  std::atomic<uint64_t> _epoch;  // 0 - not reading
+  char _padding[48];             // one slot per cache line
+};
+
+struct ReaderTable {
+  ReaderTable() {
+    _epoch = 1;
+    for (uint32_t i = 0; i < READER_SLOT_SIZE; ++i) {
+      _slots[i]._owner = 0;
+      _slots[i]._epoch = 0;
+    }
+  }
+
+  ReaderSlot *Enter() {
+    ReaderSlot *slot = LocalSlot();
+
+    // pairs with the fence in SafeEpoch, either the reclaimer sees us or
+    // we see the node unlinked
+    slot->_epoch.store(_epoch.load(std::memory_order_seq_cst),
+                       std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return slot;
+  }
+
+  static void Exit(ReaderSlot *slot) {
+    slot->_epoch.store(0, std::memory_order_release);
+  }
+
+  uint64_t Current() { return _epoch.load(std::memory_order_seq_cst); }
+
+  // readers entering after Advance can't reach memory unlinked before it
+  void Advance() { _epoch.fetch_add(1, std::memory_order_seq_cst); }
+
+  // memory retired at an epoch less than the result can be freed
+  uint64_t SafeEpoch() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    uint64_t safe = Current();
+    for (uint32_t i = 0; i < READER_SLOT_SIZE; ++i) {
+      uint64_t epoch = _slots[i]._epoch.load(std::memory_order_acquire);
+      if (epoch == 0 || epoch >= safe) continue;
+
+      // owner died in the middle of reading, owner is loaded after the
+      // epoch so a thread taking the slot over is never skipped
+      uint64_t owner = _slots[i]._owner.load(std::memory_order_acquire);
+      if (!ShmPool::OwnerAlive(owner)) continue;
+
+      safe = epoch;
+    }
+    return safe;
+  }
+
+ private:
+  ReaderSlot *LocalSlot() {
+    // slots owned by this thread, one for each attached table
+    static thread_local std::vector<std::pair<ReaderTable *, ReaderSlot *>>
+        local_slots;
+
+    uint64_t owner = ShmPool::CurrentOwner();
+    for (auto &local : local_slots) {
+      if (local.first == this) {
+        if (local.second->_owner.load(std::memory_order_relaxed) == owner)
+          return local.second;
+
+        // segment was remapped at the same address
+        local.second = AcquireSlot(owner);
+        return local.second;
+      }
+    }
+
+    local_slots.push_back(std::make_pair(this, AcquireSlot(owner)));
+    return local_slots.back().second;
+  }
+
+  ReaderSlot *AcquireSlot(uint64_t owner) {
+    uint32_t start = (owner * 0x9E3779B97F4A7C15ULL) >> 32;
+
+    while (true) {
+      // free slot or the one left by a dead thread with the same tid
+      for (uint32_t i = 0; i < READER_SLOT_SIZE; ++i) {
+        ReaderSlot &slot = _slots[(start + i) % READER_SLOT_SIZE];
+        uint64_t expected = 0;
+        if (slot._owner.load(std::memory_order_relaxed) == owner ||
+            slot._owner.compare_exchange_strong(expected, owner,
+                                                std::memory_order_acq_rel))
+          return &slot;
+      }
+
+      // take over a slot whose owner died
+      for (uint32_t i = 0; i < READER_SLOT_SIZE; ++i) {
+        ReaderSlot &slot = _slots[(start + i) % READER_SLOT_SIZE];
+        uint64_t expected = slot._owner.load(std::memory_order_acquire);
+        if (!ShmPool::OwnerAlive(expected) &&
+            slot._owner.compare_exchange_strong(expected, owner,
+                                                std::memory_order_acq_rel))
+          return &slot;
+      }
+
+      // all slots are in use by living threads
+      sched_yield();
+    }
   }
+
+  std::atomic<uint64_t> _epoch;
+  ReaderSlot _slots[READER_SLOT_SIZE];
+};
+
+struct ReaderGuard {
+  explicit ReaderGuard(ReaderTable *table) : _slot(table->Enter()) {}
+  ~ReaderGuard() { ReaderTable::Exit(_slot); }
+
+  ReaderSlot *_slot;
+};
+
+// process local snapshot of BucketTableMeta
+struct BucketTableView {
+  uint32_t _generation;
+  BucketItem *_buckets;
+  uint32_t _bucket_size;
+  BucketItem *_old_buckets;
+  uint32_t _old_bucket_size;
 };
 
 struct NsCalcTool {
@@ -67,34 +457,128 @@ struct NsCalcTool {
   }
 };
 
+inline uint64_t MonotonicMicros() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+// work a GC call may do, 0 for no limit
+struct GCBudget {
+  GCBudget(uint32_t max_steps, uint32_t max_micros) {
+    _steps = max_steps != 0 ? max_steps : UINT32_MAX;
+    _deadline = max_micros != 0 ? MonotonicMicros() + max_micros : 0;
+    _unlimited = max_steps == 0 && max_micros == 0;
+    _spent = 0;
+  }
+
+  bool Exhausted() {
+    return _steps == 0 || (_deadline != 0 && MonotonicMicros() >= _deadline);
+  }
+
+  void Spend(uint64_t steps) {
+    _steps = steps < _steps ? _steps - steps : 0;
+    _spent += steps;
+  }
+
+  uint32_t _steps;  // left
+  uint64_t _deadline;
+  bool _unlimited;
+  uint64_t _spent;
+};
+
+// what a GC call did and the backlog it left
+struct GCProgress {
+  uint32_t _steps;
+  uint32_t _collected;     // nodes moved to the garbage list
+  uint32_t _freed;
+  uint32_t _scan_left;     // buckets left in the scan round, 0 with the wheel
+  uint32_t _migrate_left;  // buckets of the old table not moved yet
+  int64_t _wheel_lag;      // seconds the wheel has not visited
+  uint64_t _garbage;       // nodes waiting for readers to leave
+  uint64_t _scan_rounds;   // rounds finished so far by all processes
+};
+
 enum SinHashRet {
   RET_OK = 0,
   RET_NOT_FOUND = 1,
   RET_NO_MEMORY = 2,
+  RET_NOT_ADMITTED = 3,  // cache is full of entries seen more often
 };
 
 enum ItemStatus {
   VALID = 0,
   COLLECTING = 1,
-  WAITING_DELETE = 2,
+  WAITING_DELETE = 2,  // in garbage list
   WRITING = 3,
 };
 
-#define Item ItemNode<Key, Value>
+// features of a map beyond the defaults
+struct MapOptions {
+  MapOptions() {
+    _slab = NULL;
+    _timing_wheel = false;
+    _cache_mode = false;
+    _admission = false;
+  }
 
-template <typename Key, typename Value>
-class ShmHashMap {
+  // keeps keys and values Storage puts out of line
+  ShmPool::SlabPool *_slab;
+  // GC visits the nodes due instead of every chain, all processes must
+  // pass the same
+  bool _timing_wheel;
+  // an Insert of this process finding the pool or the slab full evicts
+  // entries not read lately instead of failing
+  bool _cache_mode;
+  // reads and inserts are counted in a frequency sketch of the segment and
+  // an entry is evicted only for a key seen more often, all processes must
+  // pass the same
+  bool _admission;
+};
+
+#define Item \
+  ItemNode<typename Storage::StoredKey, typename Storage::StoredValue>
+
+// Hasher is one of MapHash, the default calls the virtual HashCode,
+// Clock is one of MapClock, CoarseClock reads the clock page of the segment
+template <typename Key, typename Value,
+          typename Storage = DirectStorage<Key, Value>,
+          typename Hasher = MapHash::VirtualHasher,
+          typename Clock = MapClock::SystemClock>
+class ShmHashMap : public MapHash::HashAdapter<Key, Hasher> {
  public:
+  // bucket_size is only used when the map is created, rounded up to a power
+  // of two as buckets are picked by masking the hash, the bucket array
+  // doubles when count / bucket_size is over max_load_factor (0 to disable)
   explicit ShmHashMap(std::string name, ShmPool::MemoryPool<Item> *pool,
-                      managed_shared_memory *segment,
-                      uint32_t bucket_size = DEBFAULT_BUCKET_SIZE);
+                      ShmPool::Segment segment,
+                      uint32_t bucket_size = DEBFAULT_BUCKET_SIZE,
+                      float max_load_factor = DEFAULT_MAX_LOAD_FACTOR,
+                      const MapOptions &options = MapOptions());
 
   virtual ~ShmHashMap();
 
+  // expire in seconds, 0 for never
   int Insert(const Key &key, const Value &value, int expire = 0);
 
+  // expire in milliseconds
+  int InsertMs(const Key &key, const Value &value, int64_t expire_ms);
+
   int Get(const Key &key, Value &value);
 
+  // rets[i] is the return of Get(keys[i], values[i])
+  void MultiGet(const Key *keys, size_t n, Value *values, int *rets);
+
+  // unlink the node at once, memory is freed by the next GC
+  int Erase(const Key &key);
+
+  // warm-up, same as Insert of every key in order but keys are grouped
+  // by bucket and each chain is linked at once, thread_num threads link
+  // disjoint bucket ranges, resize and GC wait until it returns, nothing
+  // is evicted in cache mode, RET_NO_MEMORY if the pool runs out
+  int BulkLoad(const Key *keys, const Value *values, size_t n, int expire = 0,
+               int thread_num = 1);
+
   int GetCount();
 
   int GetAllValues(std::vector<Value> &values);
@@ -103,351 +587,1408 @@ class ShmHashMap {
 
   void GC();
 
+  // incremental GC for request threads, does at most max_steps steps and
+  // returns about max_micros later, 0 for no limit, a step is a bucket
+  // scanned or migrated or a node expired by the wheel or freed, the scan
+  // goes on from a cursor in the segment so any process continues where
+  // the last call stopped, false if another one is collecting
+  bool GC(uint32_t max_steps, uint32_t max_micros,
+          GCProgress *progress = NULL);
+
+  // GC with thread_num threads scanning disjoint bucket ranges, each keeps
+  // the nodes it unlinks in its own list, the lists are joined for SafeFree
+  // when all threads finished
+  bool ParallelGC(int thread_num, GCProgress *progress = NULL);
+
+  // restart after a crash, before any process uses the map again, the
+  // pool must hold nodes of this map only:
+  //   - thread_num threads walk disjoint bucket ranges once and mark the
+  //     linked nodes in a bitmap, tails cut off by a crash in LinkNode are
+  //     repaired and counts are taken again
+  //   - the pool rebuilds its free ring from the bitmap, nodes unlinked
+  //     but not freed, never linked or left in magazines come back
+  //   - garbage and erased lists are dropped, the wheel is built again
+  // false if a living process holds the maintain lock
+  bool Recover(int thread_num = 1);
+
  protected:
   void *Allocate();
 
   void Free(Item *ptr);
 
-  virtual uint32_t HashCode(const Key &key) = 0;
+  using MapHash::HashAdapter<Key, Hasher>::Hash;
 
  private:
-  void SafeFree();
+  typedef MapWheel::TimingWheel<ShmPool::OwnerLock> Wheel;
+
+  // slot locks of a dead owner are taken over
+  struct WheelAdapter {
+    explicit WheelAdapter(ShmHashMap *map) : _map(map) {}
+
+    MapWheel::WheelLinks &Node(uint64_t ref) {
+      return _map->_wheel_links[_map->_pool->NodeIndex(ref)];
+    }
+
+    bool Lock(ShmPool::OwnerLock &lock) {
+      int ret;
+      while ((ret = lock.TryLock()) == ShmPool::LOCK_FAILED) {
+      }
+      return ret == ShmPool::LOCK_RECOVERED;
+    }
+
+    void Unlock(ShmPool::OwnerLock &lock) { lock.Unlock(); }
+
+    ShmHashMap *_map;
+  };
+
+  // nodes unlinked by one GC thread
+  struct GarbageSublist {
+    GarbageSublist() : _head(OFFSET_NULL), _tail(OFFSET_NULL), _count(0) {}
+
+    uint64_t _head;
+    uint64_t _tail;
+    uint64_t _count;
+  };
+
+  bool Collect(GCBudget &budget, int thread_num, GCProgress *progress);
+
+  int InsertNode(const Key &key, uint32_t hash, const Value &value,
+                 int64_t expire_at);
+
+  // free EVICT_BATCH nodes by CLOCK for a key of hash, one with admission,
+  // return the number freed, EVICT_BUSY or EVICT_REJECTED
+  int Evict(uint32_t hash);
+
+  // return the number of nodes unlinked, cold nodes seen are added to
+  // sampled, with the sketch they are unlinked if less frequent than
+  // frequency
+  uint32_t EvictBucket(BucketItem &bucket, uint32_t link, int64_t now,
+                       uint32_t frequency, uint32_t *sampled);
+
+  // return the number of nodes freed
+  uint32_t SafeFree(uint64_t safe_epoch, GCBudget &budget);
+
+  void Scan(GCBudget &budget);
+
+  // a whole round, thread_num threads scan disjoint ranges
+  void ParallelScan(int thread_num);
+
+  void ScanBucket(BucketItem &bucket, uint32_t link,
+                  GarbageSublist *garbage = NULL);
+
+  // expire the nodes due by the wheel
+  void ScanWheel(GCBudget &budget);
+
+  void ExpireNode(Item *p, int64_t now);
+
+  // link a node again whose expiry changed, 0 to take it out
+  void WheelRelink(Item *node, int64_t expire_at);
+
+  // append to garbage if given, to the garbage list otherwise
+  void AddGarbageList(Item *node, uint64_t epoch,
+                      GarbageSublist *garbage = NULL);
+
+  void SpliceGarbageList(GarbageSublist &garbage);
+
+  void RemoveExpireNode(Item *p, BucketItem &bucket,
+                        GarbageSublist *garbage = NULL);
+
+  int AddNodeItem(const BucketTableView &view, uint32_t hash, const Key &key,
+                  const Value &value, int64_t expire_at);
+
+  void LinkNode(BucketItem &bucket, uint32_t link, Item *node);
+
+  // false if node is not in the bucket
+  bool UnlinkNode(BucketItem &bucket, uint32_t link, Item *node);
+
+  void LockBucket(BucketItem &bucket);
 
-  void Scan();
+  void UnlockBucket(BucketItem &bucket);
 
-  void AddGarbageList(Item *node);
+  Item *GetNode(BucketItem &bucket, uint32_t link, const Key &key);
 
-  void RemoveExpireNode(Item *p, BucketItem &bucket);
+  Item *FindNode(const BucketTableView &view, uint32_t hash, const Key &key);
 
-  int AddNodeItem(int index, const Key &key, const Value &value, int expire);
+  bool MatchNode(Item *item, const Key &key);
 
-  Item *GetNode(uint32_t index, const Key &key);
+  uint32_t NodeHashCode(Item *node);
+
+  int ReadNode(Item *item, Value &value);
+
+  int LockItem(Item *item, int status);
 
   Item *OffsetToNode(uint64_t);
 
   uint64_t NodeToOffset(Item *node);
 
-  bool CheckDoubleFree(Item *node);
+  MapWheel::WheelLinks &NodeLinks(Item *node);
 
   Item *NextNode(uint64_t);
 
   Item *NextDelNode(uint64_t);
 
-  uint32_t _bucket_size;
-  std::atomic<uint32_t> _gc_timestamp;
+  // resize
+  void LoadTable(BucketTableView *view);
+
+  BucketItem *HandleToBuckets(uint64_t handle);
+
+  bool LockMaintain();
+
+  void UnlockMaintain();
+
+  void StartResize(const BucketTableView &view);
+
+  bool ResizeTo(uint32_t bucket_size);
+
+  void Reserve(int64_t count);
+
+  void BulkLoadRange(const BucketTableView &view, const Key *keys,
+                     const Value *values,
+                     std::vector<std::vector<std::vector<size_t>>> &bins,
+                     int owner, int expire, int *ret);
+
+  void Migrate(uint32_t step, bool recover);
+
+  void MigrateBucket(BucketItem &bucket, uint32_t link, bool recover);
+
+  void MoveNode(BucketItem &bucket, Item *node, bool recover);
+
+  void FreeRetiredTable(uint64_t safe_epoch);
+
+  // mark the nodes of a chain, return the number not moved to the new
+  // table yet if old, every node otherwise
+  uint32_t RecoverBucket(BucketItem &bucket, uint32_t link, bool old,
+                         uint32_t generation, ShmPool::NodeBitmap &live);
 
   ShmPool::MemoryPool<Item> *_pool;
-  managed_shared_memory *_segment;
+  ShmPool::SlabPool *_slab;
+  ShmPool::Segment _segment;
   std::string _name;
 
-  // TODO: use a lock-free class implement
-  // garbage list (one thread add and remove)
+  float _max_load_factor;
+
+  // garbage list, one thread add and remove, threads of ParallelGC fill
+  // their own lists joined by it
   uint64_t *_garbage_list_head_offset;
   uint64_t *_garbage_list_tail_offset;
-  BucketItem *_buckets;
+
+  // nodes unlinked by Erase, moved into garbage list by GC
+  std::atomic<uint64_t> *_erased_list;
+  BucketTableMeta *_table_meta;
+  ReaderTable *_reader_table;
+
+  Clock _clock;
+
+  // expiry index by second, NULL if GC scans every chain
+  Wheel *_wheel;
+  // links of the wheel by pool node index, kept aside so nodes of maps
+  // without a wheel do not carry them
+  MapWheel::WheelLinks *_wheel_links;
+  bool _cache_mode;
+  // admission filter, NULL without admission
+  MapSketch::FrequencySketch *_sketch;
+  // nodes popped by a collector died in the middle are out of the wheel,
+  // GC scans every chain until a scan round started after this process
+  // attached or took over the maintain lock finishes
+  uint64_t _scan_until;
 };
 
 // implements
-template <typename Key, typename Value>
-ShmHashMap<Key, Value>::ShmHashMap(std::string name,
-                                   ShmPool::MemoryPool<Item> *pool,
-                                   managed_shared_memory *segment,
-                                   uint32_t bucket_size) {
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+ShmHashMap<Key, Value, Storage, Hasher, Clock>::ShmHashMap(
+    std::string name, ShmPool::MemoryPool<Item> *pool,
+    ShmPool::Segment segment, uint32_t bucket_size, float max_load_factor,
+    const MapOptions &options) {
   if (bucket_size == 0) bucket_size = DEBFAULT_BUCKET_SIZE;
+  bucket_size = MapHash::RoundUpPowerOfTwo(bucket_size);
 
   _segment = segment;
   _name = name;
   _pool = pool;
-  _bucket_size = bucket_size;
+  _slab = options._slab;
+  _max_load_factor = max_load_factor;
+
+  // the first bucket array keeps its name, tables grown later are
+  // referenced by the descriptor only
+  BucketTableMeta *table_meta =
+      _segment.find<BucketTableMeta>((name + BUCKET_TABLE).c_str()).first;
+  if (table_meta == NULL) {
+    BucketItem *buckets = _segment.find_or_construct<BucketItem>(
+        (name + BUCKET).c_str())[bucket_size]();
+    table_meta = _segment.find_or_construct<BucketTableMeta>(
+        (name + BUCKET_TABLE).c_str())(
+        _segment.get_handle_from_address(buckets), bucket_size);
+  }
+  _table_meta = table_meta;
 
-  _buckets = _segment->find_or_construct<BucketItem>(
-      (name + BUCKET).c_str())[bucket_size]();
-  _garbage_list_head_offset = _segment->find_or_construct<uint64_t>(
+  _reader_table = _segment.find_or_construct<ReaderTable>(
+      (name + READER_TABLE).c_str())();
+
+  _garbage_list_head_offset = _segment.find_or_construct<uint64_t>(
       (name + GARBAGE_LIST_HEAD).c_str())(OFFSET_NULL);
-  _garbage_list_tail_offset = _segment->find_or_construct<uint64_t>(
+  _garbage_list_tail_offset = _segment.find_or_construct<uint64_t>(
       (name + GARBAGE_LIST_TAIL).c_str())(OFFSET_NULL);
-}
-
-template <typename Key, typename Value>
-ShmHashMap<Key, Value>::~ShmHashMap() {
-  if (_buckets != NULL) {
-    for (int i = 0; i < _bucket_size; ++i) _buckets[i].~BucketItem();
-    _segment->destroy<BucketItem>((_name + BUCKET).c_str());
+  _erased_list = _segment.find_or_construct<std::atomic<uint64_t>>(
+      (name + ERASED_LIST).c_str())(OFFSET_NULL);
+
+  _clock.Attach(_segment.find_or_construct<MapClock::ClockPage>(
+      CLOCK_PAGE.c_str())());
+
+  _wheel = NULL;
+  _wheel_links = NULL;
+  if (options._timing_wheel) {
+    _wheel = _segment.find_or_construct<Wheel>((name + TIMING_WHEEL).c_str())(
+        _clock.NowMs() / 1000);
+    _wheel_links = _segment.find_or_construct<MapWheel::WheelLinks>(
+        (name + WHEEL_LINKS).c_str())[_pool->NodeCount()]();
   }
+  _cache_mode = options._cache_mode;
+
+  _sketch = NULL;
+  if (options._admission) {
+    MapSketch::SketchMeta *meta =
+        _segment.find_or_construct<MapSketch::SketchMeta>(
+            (name + SKETCH).c_str())(
+            MapSketch::FrequencySketch::Width(_pool->Capacity()));
+    std::atomic<uint64_t> *table =
+        _segment.find_or_construct<std::atomic<uint64_t>>(
+            (name + SKETCH_TABLE).c_str())[meta->_width](0);
+    _sketch = new MapSketch::FrequencySketch(meta, table);
+  }
+  _scan_until = _table_meta->_scan_rounds +
+                (_table_meta->_scan_cursor != 0 ? 2 : 1);
+}
 
-  _buckets = NULL;
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+ShmHashMap<Key, Value, Storage, Hasher, Clock>::~ShmHashMap() {
+  // bucket tables are shared by other processes and kept for reattach
+  _table_meta = NULL;
+  delete _sketch;
+  _sketch = NULL;
 }
 
 // offset to Item
-template <typename Key, typename Value>
-Item *ShmHashMap<Key, Value>::OffsetToNode(uint64_t offset) {
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+Item *ShmHashMap<Key, Value, Storage, Hasher, Clock>::OffsetToNode(
+    uint64_t offset) {
   return _pool->GetObjByOffset(offset);
 }
 
-template <typename Key, typename Value>
-Item *ShmHashMap<Key, Value>::NextNode(uint64_t offset) {
-  return OffsetToNode(OffsetToNode(offset)->_next);
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+Item *ShmHashMap<Key, Value, Storage, Hasher, Clock>::NextNode(
+    uint64_t offset) {
+  uint32_t link = _table_meta->Current()._generation & 1;
+  return OffsetToNode(OffsetToNode(offset)->_next[link]);
 }
 
-template <typename Key, typename Value>
-Item *ShmHashMap<Key, Value>::NextDelNode(uint64_t offset) {
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+Item *ShmHashMap<Key, Value, Storage, Hasher, Clock>::NextDelNode(
+    uint64_t offset) {
   return OffsetToNode(OffsetToNode(offset)->_del_next);
 }
 
-template <typename Key, typename Value>
-uint64_t ShmHashMap<Key, Value>::NodeToOffset(Item *node) {
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+uint64_t ShmHashMap<Key, Value, Storage, Hasher, Clock>::NodeToOffset(
+    Item *node) {
   return _pool->GetOffsetByObj(node);
 }
 
-template <typename Key, typename Value>
-int ShmHashMap<Key, Value>::Insert(const Key &key, const Value &value,
-                                   int expire) {
-  int index = HashCode(key) % _bucket_size;
-
-  Item *item = GetNode(index, key);
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+MapWheel::WheelLinks &ShmHashMap<Key, Value, Storage, Hasher,
+                                 Clock>::NodeLinks(Item *node) {
+  return _wheel_links[_pool->NodeIndex(NodeToOffset(node))];
+}
 
-  if (item == NULL || (item->_expire != 0 && item->_expire < time(NULL))) {
-    if (AddNodeItem(index, key, value, expire) == RET_NO_MEMORY) {
-      return RET_NO_MEMORY;
-    }
-  } else {
-    int invalid = VALID, write = WRITING;
-
-    // lock the item first
-    while (!item->_invalid.compare_exchange_strong(invalid, write,
-                                                   std::memory_order_acq_rel)) {
-      if (item->_invalid.load(std::memory_order_acquire) == WRITING) {
-        // writing occur, so wait
-        invalid = VALID, write = WRITING;
-        continue;
-      } else {
-        // item is add to garbage list
-        if (AddNodeItem(index, key, value, expire) == RET_NO_MEMORY)
-          return RET_NO_MEMORY;
-      }
-    }
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+BucketItem *ShmHashMap<Key, Value, Storage, Hasher, Clock>::HandleToBuckets(
+    uint64_t handle) {
+  return (BucketItem *)_segment.get_address_from_handle(handle);
+}
 
-    item->_value = value;
-    item->_expire = expire != 0 ? time(NULL) + expire : 0;
-    item->_invalid.store(VALID, std::memory_order_release);
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::LoadTable(
+    BucketTableView *view) {
+  while (true) {
+    uint64_t version = _table_meta->_version.load(std::memory_order_acquire);
+    const BucketTableState &state = _table_meta->_states[version & 1];
+
+    view->_generation = state._generation;
+    view->_buckets = HandleToBuckets(state._handle);
+    view->_bucket_size = state._bucket_size;
+    view->_old_bucket_size = state._old_bucket_size;
+    view->_old_buckets =
+        state._old_bucket_size != 0 ? HandleToBuckets(state._old_handle) : NULL;
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (_table_meta->_version.load(std::memory_order_relaxed) == version)
+      return;
   }
-  return RET_OK;
 }
 
-template <typename Key, typename Value>
-int ShmHashMap<Key, Value>::Get(const Key &key, Value &value) {
-  int index = HashCode(key) % _bucket_size;
-  Item *item = GetNode(index, key);
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+int ShmHashMap<Key, Value, Storage, Hasher, Clock>::Insert(const Key &key,
+                                                           const Value &value,
+                                                           int expire) {
+  return InsertMs(key, value, expire * 1000LL);
+}
 
-  if (item == NULL || (item->_expire != 0 && item->_expire < time(NULL))) {
-    return RET_NOT_FOUND;
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+int ShmHashMap<Key, Value, Storage, Hasher, Clock>::InsertMs(
+    const Key &key, const Value &value, int64_t expire_ms) {
+  int64_t expire_at = expire_ms != 0 ? _clock.NowMs() + expire_ms : 0;
+  uint32_t hash = Hash(key);
+  if (_sketch != NULL) _sketch->Increment(hash);
+  int ret = InsertNode(key, hash, value, expire_at);
+
+  // evicted out of the reader slot, the nodes are freed at once, the
+  // holder of the maintain lock is collecting or evicting as well
+  for (int i = 0; ret == RET_NO_MEMORY && _cache_mode && i < EVICT_RETRY;) {
+    int freed = Evict(hash);
+    if (freed == EVICT_REJECTED) return RET_NOT_ADMITTED;
+
+    if (freed == EVICT_BUSY) {
+      sched_yield();
+    } else {
+      ++i;
+    }
+    ret = InsertNode(key, hash, value, expire_at);
   }
-
-  value = item->_value;
-  return RET_OK;
+  return ret;
 }
 
-template <typename Key, typename Value>
-int ShmHashMap<Key, Value>::GetAllValues(std::vector<Value> &values) {
-  for (int i = 0; i < _bucket_size; ++i) {
-    BucketItem &bucket = _buckets[i];
-    Item *p = OffsetToNode(bucket._head);
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+int ShmHashMap<Key, Value, Storage, Hasher, Clock>::InsertNode(
+    const Key &key, uint32_t hash, const Value &value, int64_t expire_at) {
+  ReaderGuard guard(_reader_table);
+  BucketTableView view;
+  LoadTable(&view);
+
+  if (view._old_bucket_size != 0 && LockMaintain()) {
+    Migrate(MIGRATE_STEP, false);
+    UnlockMaintain();
+  }
 
-    while (p != NULL) {
-      values.push_back(p->_value);
-      p = OffsetToNode(p->_next);
+  while (true) {
+    LoadTable(&view);
+    Item *item = FindNode(view, hash, key);
+
+    if (item == NULL) {
+      if (AddNodeItem(view, hash, key, value, expire_at) == RET_NO_MEMORY) {
+        return RET_NO_MEMORY;
+      }
+      break;
+    }
+
+    // lock the item first, replaced, erased or expired meanwhile if failed
+    if (LockItem(item, WRITING) != VALID) continue;
+
+    if (!Storage::InPlace(item->_value, value)) {
+      // readers may still copy the old value, link the new node before
+      // the old one is left to Scan, writers of the key wait on the lock
+      if (AddNodeItem(view, hash, key, value, expire_at) == RET_NO_MEMORY) {
+        item->_invalid.store(VALID, std::memory_order_release);
+        return RET_NO_MEMORY;
+      }
+      item->_invalid.store(COLLECTING, std::memory_order_release);
+      // due at once if the wheel collects it
+      if (_wheel != NULL) WheelRelink(item, _wheel->Clock() * 1000);
+      break;
     }
+
+    Storage::StoreValue(item->_value, value, _slab);
+    if (item->_expire != expire_at) WheelRelink(item, expire_at);
+    item->_expire = expire_at;
+    item->_invalid.store(VALID, std::memory_order_release);
+    break;
   }
 
+  if (_max_load_factor > 0 &&
+      _table_meta->_item_count.load(std::memory_order_relaxed) >
+          _max_load_factor * view._bucket_size) {
+    StartResize(view);
+  }
   return RET_OK;
 }
 
-template <typename Key, typename Value>
-int ShmHashMap<Key, Value>::GetAllKeys(std::vector<Key> &keys) {
-  for (int i = 0; i < _bucket_size; ++i) {
-    BucketItem &bucket = _buckets[i];
-    Item *p = OffsetToNode(bucket._head);
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+int ShmHashMap<Key, Value, Storage, Hasher, Clock>::Get(const Key &key,
+                                                        Value &value) {
+  ReaderGuard guard(_reader_table);
+  BucketTableView view;
+  LoadTable(&view);
+
+  uint32_t hash = Hash(key);
+  if (_sketch != NULL) _sketch->Increment(hash);
+  return ReadNode(FindNode(view, hash, key), value);
+}
 
-    while (p != NULL) {
-      keys.push_back(p->_key);
-      p = OffsetToNode(p->_next);
-    }
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+int ShmHashMap<Key, Value, Storage, Hasher, Clock>::ReadNode(Item *item,
+                                                             Value &value) {
+  if (item == NULL ||
+      (item->_expire != 0 && item->_expire < _clock.NowMs())) {
+    return RET_NOT_FOUND;
   }
 
-  return RET_OK;
-};
+  // a node replaced or erased after it matched is read as it was, the
+  // value is kept until the readers of its epoch leave
 
-template <typename Key, typename Value>
-int ShmHashMap<Key, Value>::GetCount() {
-  int sum = 0;
-  for (int i = 0; i < _bucket_size; ++i)
-    sum += _buckets[i]._count.load(std::memory_order_consume);
+  // written once per pass of the hand
+  if (item->_referenced.load(std::memory_order_relaxed) == 0)
+    item->_referenced.store(1, std::memory_order_relaxed);
 
-  return sum;
+  Storage::LoadValue(item->_value, value, _slab);
+  return RET_OK;
 }
 
-template <typename Key, typename Value>
-void ShmHashMap<Key, Value>::GC() {
-  /* two steps:
-      1. scan expire ItemNode, push into garbage list
-      2. clear ItemNode-s whose cal more than 1 in garbage list
-
-      the two steps need pause at least BREAK_TIME seconds
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::MultiGet(const Key *keys,
+                                                              size_t n,
+                                                              Value *values,
+                                                              int *rets) {
+  /* lookups of a batch go stage by stage, the memory of every lookup in
+     the next stage is prefetched while the current stage runs:
+      1. hash keys, prefetch buckets
+      2. load chain heads, prefetch head nodes
+      3. step every chain one node per round, prefetch the next nodes
+
+     keys missed in the new table are looked up in the old one
   */
+  ReaderGuard guard(_reader_table);
+  BucketTableView view;
+  LoadTable(&view);
+  uint32_t link = view._generation & 1;
+
+  uint32_t hashes[MULTI_GET_BATCH];
+  BucketItem *buckets[MULTI_GET_BATCH];
+  uint64_t offsets[MULTI_GET_BATCH];
+  Item *items[MULTI_GET_BATCH];
+
+  for (size_t begin = 0; begin < n; begin += MULTI_GET_BATCH) {
+    int count = std::min(n - begin, (size_t)MULTI_GET_BATCH);
+    const Key *batch = keys + begin;
+
+    for (int i = 0; i < count; ++i) {
+      hashes[i] = Hash(batch[i]);
+      if (_sketch != NULL) _sketch->Increment(hashes[i]);
+      buckets[i] =
+          &view._buckets[MapHash::BucketIndex(hashes[i], view._bucket_size)];
+      __builtin_prefetch(buckets[i]);
+    }
 
-  const int BREAK_TIME = 2;
-  uint32_t last_timestamp = _gc_timestamp.load(std::memory_order_acquire);
+    for (int i = 0; i < count; ++i) {
+      offsets[i] = buckets[i]->_head;
+      _pool->Prefetch(offsets[i]);
+    }
 
-  // for better performance using cas weak version
-  uint32_t now = time(0);
-  if (last_timestamp + BREAK_TIME < time(NULL) &&
-      _gc_timestamp.compare_exchange_weak(last_timestamp, now,
-                                          std::memory_order_release)) {
-    Scan();
-    SafeFree();
-  }
-}
+    uint32_t walking = (1u << count) - 1;
+    while (walking != 0) {
+      for (int i = 0; i < count; ++i) {
+        if (!(walking & (1u << i))) continue;
 
-template <typename Key, typename Value>
-void ShmHashMap<Key, Value>::SafeFree() {
-  Item *p0 = OffsetToNode(*_garbage_list_head_offset);
-  if (p0 == NULL) {
-    return;
-  }
+        items[i] = OffsetToNode(offsets[i]);
+        if (items[i] == NULL || MatchNode(items[i], batch[i])) {
+          walking &= ~(1u << i);
+        } else {
+          offsets[i] = items[i]->_next[link];
+          _pool->Prefetch(offsets[i]);
+        }
+      }
+    }
 
-  Item *p1 = OffsetToNode(p0->_del_next);
+    for (int i = 0; i < count; ++i) {
+      Item *item = items[i];
+      if (item == NULL && view._old_bucket_size != 0) {
+        item = GetNode(view._old_buckets[MapHash::BucketIndex(
+                           hashes[i], view._old_bucket_size)],
+                       (view._generation + 1) & 1, batch[i]);
+      }
 
-  while (p1) {
-    if (p1->_invalid.fetch_add(1, std::memory_order_acq_rel) == 2) {
-      p0->_del_next = p1->_del_next;
-      p1->~Item();
-      Free(p1);
-      p1 = OffsetToNode(p0->_del_next);
-    } else {
-      p0 = p1;
-      p1 = OffsetToNode(p1->_del_next);
+      rets[begin + i] = ReadNode(item, values[begin + i]);
     }
   }
-  *_garbage_list_tail_offset = NodeToOffset(p0);
 }
 
-template <typename Key, typename Value>
-bool ShmHashMap<Key, Value>::CheckDoubleFree(Item *node) {
-  Item *p0 = OffsetToNode(*_garbage_list_head_offset);
-  if (p0 == NULL) {
-    return false;
-  }
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+int ShmHashMap<Key, Value, Storage, Hasher, Clock>::Erase(const Key &key) {
+  /* node is unlinked under the bucket lock, which keeps Scan and the
+     migration of the bucket off
 
-  if (p0 == node) return true;
+     while migrating, a node already moved is linked in both tables,
+     it is only marked and left for Scan after the migration finished
+  */
+  ReaderGuard guard(_reader_table);
+  uint32_t hash = Hash(key);
+
+  while (true) {
+    BucketTableView view;
+    LoadTable(&view);
+
+    bool old = false;
+    BucketItem *bucket =
+        &view._buckets[MapHash::BucketIndex(hash, view._bucket_size)];
+    uint32_t link = view._generation & 1;
+    Item *item = GetNode(*bucket, link, key);
+
+    if (item == NULL && view._old_bucket_size != 0) {
+      old = true;
+      bucket =
+          &view._old_buckets[MapHash::BucketIndex(hash, view._old_bucket_size)];
+      link = (view._generation + 1) & 1;
+      item = GetNode(*bucket, link, key);
+    }
 
-  Item *p1 = OffsetToNode(p0->_del_next);
+    if (item == NULL) return RET_NOT_FOUND;
 
-  while (p1) {
-    if (p1 == node) return true;
+    LockBucket(*bucket);
 
-    p1 = OffsetToNode(p1->_del_next);
-  }
+    // table grown or the old bucket moved meanwhile, find it again
+    if (_table_meta->Current()._generation != view._generation ||
+        (old && bucket->_migrated.load(std::memory_order_acquire))) {
+      UnlockBucket(*bucket);
+      continue;
+    }
 
-  return false;
+    // replaced by Insert or erased by others, find it again
+    if (LockItem(item, COLLECTING) != VALID) {
+      UnlockBucket(*bucket);
+      continue;
+    }
+
+    bool expired = item->_expire != 0 && item->_expire < _clock.NowMs();
+
+    if (!old && view._old_bucket_size != 0) {
+      UnlockBucket(*bucket);
+      if (_wheel != NULL) WheelRelink(item, _wheel->Clock() * 1000);
+      return expired ? RET_NOT_FOUND : RET_OK;
+    }
+
+    UnlinkNode(*bucket, link, item);
+    item->_invalid.store(WAITING_DELETE, std::memory_order_release);
+    UnlockBucket(*bucket);
+
+    bucket->_count.fetch_sub(1, std::memory_order_acq_rel);
+    _table_meta->_item_count.fetch_sub(1, std::memory_order_relaxed);
+
+    // readers entered from now on can't reach it
+    item->_retire_epoch = _reader_table->Current();
+    uint64_t offset = NodeToOffset(item);
+    uint64_t head = _erased_list->load(std::memory_order_relaxed);
+    do {
+      item->_del_next = head;
+    } while (!_erased_list->compare_exchange_weak(head, offset,
+                                                  std::memory_order_release,
+                                                  std::memory_order_relaxed));
+
+    return expired ? RET_NOT_FOUND : RET_OK;
+  }
 }
 
-template <typename Key, typename Value>
-void ShmHashMap<Key, Value>::Scan() {
-  for (int i = 0; i < _bucket_size; ++i) {
-    BucketItem &bucket = _buckets[i];
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+int ShmHashMap<Key, Value, Storage, Hasher, Clock>::GetAllValues(
+    std::vector<Value> &values) {
+  ReaderGuard guard(_reader_table);
+  BucketTableView view;
+  LoadTable(&view);
 
-    Item *p0 = OffsetToNode(bucket._head);
+  for (uint32_t i = 0; i < view._bucket_size; ++i) {
+    BucketItem &bucket = view._buckets[i];
+    Item *p = OffsetToNode(bucket._head);
 
-    if (p0 == NULL) continue;
+    while (p != NULL) {
+      values.emplace_back();
+      Storage::LoadValue(p->_value, values.back(), _slab);
+      p = OffsetToNode(p->_next[view._generation & 1]);
+    }
+  }
 
-    Item *p1 = OffsetToNode(p0->_next);
+  // nodes not moved yet
+  for (uint32_t i = 0; i < view._old_bucket_size; ++i) {
+    BucketItem &bucket = view._old_buckets[i];
+    Item *p = OffsetToNode(bucket._head);
 
-    while (p1 != NULL && p1->_next != OFFSET_NULL) {
-      if (p1->_expire && p1->_expire < time(NULL)) {
-        // find expire ItemNode
+    while (p != NULL) {
+      if (p->_generation.load(std::memory_order_acquire) !=
+          view._generation) {
+        values.emplace_back();
+        Storage::LoadValue(p->_value, values.back(), _slab);
+      }
+      p = OffsetToNode(p->_next[(view._generation + 1) & 1]);
+    }
+  }
 
-        int valid = VALID;
-        int collecting = COLLECTING;
+  return RET_OK;
+}
 
-        // lock the item
-        if (p1->_invalid.compare_exchange_strong(valid, collecting,
-                                                 std::memory_order_acq_rel)) {
-          RemoveExpireNode(p1, bucket);
-
-          // remove the node
-          p0->_next = p1->_next;
-          p1 = OffsetToNode(p0->_next);
-        } else if (p1->_invalid.load(std::memory_order_consume) ==
-                       (int)COLLECTING &&
-                   p1->_expire < time(NULL) - 10) {
-          if (!CheckDoubleFree(p1)) {
-            RemoveExpireNode(p1, bucket);
-          }
-
-          // remove the node
-          p0->_next = p1->_next;
-          p1 = OffsetToNode(p0->_next);
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+int ShmHashMap<Key, Value, Storage, Hasher, Clock>::GetAllKeys(
+    std::vector<Key> &keys) {
+  ReaderGuard guard(_reader_table);
+  BucketTableView view;
+  LoadTable(&view);
+
+  for (uint32_t i = 0; i < view._bucket_size; ++i) {
+    BucketItem &bucket = view._buckets[i];
+    Item *p = OffsetToNode(bucket._head);
+
+    while (p != NULL) {
+      keys.emplace_back();
+      Storage::LoadKey(p->_key, keys.back(), _slab);
+      p = OffsetToNode(p->_next[view._generation & 1]);
+    }
+  }
+
+  // nodes not moved yet
+  for (uint32_t i = 0; i < view._old_bucket_size; ++i) {
+    BucketItem &bucket = view._old_buckets[i];
+    Item *p = OffsetToNode(bucket._head);
+
+    while (p != NULL) {
+      if (p->_generation.load(std::memory_order_acquire) !=
+          view._generation) {
+        keys.emplace_back();
+        Storage::LoadKey(p->_key, keys.back(), _slab);
+      }
+      p = OffsetToNode(p->_next[(view._generation + 1) & 1]);
+    }
+  }
+
+  return RET_OK;
+};
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+int ShmHashMap<Key, Value, Storage, Hasher, Clock>::BulkLoad(
+    const Key *keys, const Value *values, size_t n, int expire,
+    int thread_num) {
+  /* 1. grow the table for all keys, finish migration
+     2. hash keys, bin them by the thread owning their bucket
+     3. every thread groups its keys by bucket, takes pool nodes in
+        batches and links a whole chain with one tail exchange
+  */
+  while (!LockMaintain()) sched_yield();
+
+  Reserve(_table_meta->_item_count.load(std::memory_order_relaxed) + n);
+  Migrate(UINT32_MAX, false);
+
+  BucketTableView view;
+  LoadTable(&view);
+
+  if (thread_num < 1) thread_num = 1;
+  std::vector<std::vector<std::vector<size_t>>> bins(
+      thread_num, std::vector<std::vector<size_t>>(thread_num));
+  std::vector<int> rets(thread_num, RET_OK);
+  std::vector<std::thread> threads;
+
+  auto partition = [&](int slice) {
+    size_t begin = n * slice / thread_num, end = n * (slice + 1) / thread_num;
+    for (size_t i = begin; i < end; ++i) {
+      uint64_t index = MapHash::BucketIndex(Hash(keys[i]), view._bucket_size);
+      bins[slice][index * thread_num / view._bucket_size].push_back(i);
+    }
+  };
+
+  for (int i = 1; i < thread_num; ++i)
+    threads.push_back(std::thread(partition, i));
+  partition(0);
+  for (auto &t : threads) t.join();
+  threads.clear();
+
+  for (int i = 1; i < thread_num; ++i) {
+    threads.push_back(std::thread(&ShmHashMap::BulkLoadRange, this,
+                                  std::cref(view), keys, values,
+                                  std::ref(bins), i, expire, &rets[i]));
+  }
+  BulkLoadRange(view, keys, values, bins, 0, expire, &rets[0]);
+  for (auto &t : threads) t.join();
+
+  UnlockMaintain();
+
+  for (int ret : rets) {
+    if (ret != RET_OK) return ret;
+  }
+  return RET_OK;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::BulkLoadRange(
+    const BucketTableView &view, const Key *keys, const Value *values,
+    std::vector<std::vector<std::vector<size_t>>> &bins, int owner, int expire,
+    int *ret) {
+  int thread_num = bins.size();
+  // buckets with index * thread_num / bucket_size == owner
+  uint64_t size = view._bucket_size;
+  uint32_t begin = (size * owner + thread_num - 1) / thread_num;
+  uint32_t end = (size * (owner + 1) + thread_num - 1) / thread_num;
+  uint32_t link = view._generation & 1;
+  int64_t expire_at = expire != 0 ? _clock.NowMs() + expire * 1000LL : 0;
+
+  // counting sort by bucket, input order is kept within a bucket
+  std::vector<uint32_t> starts(end - begin + 1, 0);
+  std::vector<uint32_t> buckets;
+  std::vector<size_t> order;
+
+  for (int slice = 0; slice < thread_num; ++slice) {
+    for (size_t i : bins[slice][owner]) {
+      buckets.push_back(
+          MapHash::BucketIndex(Hash(keys[i]), view._bucket_size) - begin);
+      order.push_back(i);
+      starts[buckets.back() + 1]++;
+    }
+  }
+  for (uint32_t i = 1; i < starts.size(); ++i) starts[i] += starts[i - 1];
+
+  std::vector<size_t> sorted(order.size());
+  std::vector<uint32_t> cursor(starts.begin(), starts.end() - 1);
+  for (size_t i = 0; i < order.size(); ++i)
+    sorted[cursor[buckets[i]]++] = order[i];
+
+  Item *cache[BULK_ALLOCATE_BATCH];
+  uint32_t cached = 0, used = 0;
+  int64_t count = 0;
+
+  for (uint32_t b = 0; b < end - begin && *ret == RET_OK; ++b) {
+    if (starts[b] == starts[b + 1]) continue;
+    BucketItem &bucket = view._buckets[begin + b];
+
+    // keys may exist already, go the usual way but never evict, the
+    // maintain lock eviction needs is held by BulkLoad
+    if (bucket._head != OFFSET_NULL) {
+      for (uint32_t i = starts[b]; i < starts[b + 1]; ++i) {
+        const Key &key = keys[sorted[i]];
+        if (InsertNode(key, Hash(key), values[sorted[i]], expire_at) !=
+            RET_OK)
+          *ret = RET_NO_MEMORY;
+      }
+      continue;
+    }
+
+    Item *head = NULL, *tail = NULL;
+    uint32_t length = 0;
+
+    for (uint32_t i = starts[b]; i < starts[b + 1]; ++i) {
+      const Key &key = keys[sorted[i]];
+
+      // later one wins if the key is repeated
+      Item *p = head;
+      while (p != NULL && !Storage::KeyEqual(p->_key, key, _slab))
+        p = OffsetToNode(p->_next[link]);
+      if (p != NULL) {
+        if (!Storage::StoreValue(p->_value, values[sorted[i]], _slab)) {
+          *ret = RET_NO_MEMORY;
+          break;
+        }
+        continue;
+      }
+
+      if (used == cached) {
+        cached = _pool->AllocateBatch(cache, BULK_ALLOCATE_BATCH);
+        used = 0;
+        if (cached == 0) {
+          *ret = RET_NO_MEMORY;
+          break;
         }
+      }
+
+      Item *node = new (cache[used++]) Item;
+      node->_invalid.store(VALID, std::memory_order_relaxed);
+      node->_generation.store(view._generation, std::memory_order_relaxed);
+      node->_next[0] = OFFSET_NULL;
+      node->_next[1] = OFFSET_NULL;
+      node->_expire = expire_at;
+      node->_del_next = OFFSET_NULL;
+      node->_retire_epoch = 0;
+      if (_wheel != NULL) new (&NodeLinks(node)) MapWheel::WheelLinks;
+
+      if (!Storage::StoreKey(node->_key, key, _slab) ||
+          !Storage::StoreValue(node->_value, values[sorted[i]], _slab)) {
+        Storage::Release(node->_key, node->_value, _slab);
+        node->~Item();
+        _pool->Free(node);
+        *ret = RET_NO_MEMORY;
+        break;
+      }
+      if (expire_at != 0) WheelRelink(node, expire_at);
 
+      if (tail == NULL) {
+        head = node;
       } else {
-        p0 = p1;
-        p1 = OffsetToNode(p1->_next);
+        tail->_next[link] = NodeToOffset(node);
       }
+      tail = node;
+      length++;
     }
 
-    // check head invalid
-    p0 = OffsetToNode(bucket._head);
-    if (p0->_expire && p0->_expire < time(NULL)) {
-      int valid = VALID;
-      int collecting = COLLECTING;
-
-      // lock the head
-      if (p0->_invalid.compare_exchange_strong(valid, collecting,
-                                               std::memory_order_acq_rel)) {
-        RemoveExpireNode(p0, bucket);
-
-        if (bucket._head == bucket._tail.load(std::memory_order_consume)) {
-          uint64_t expected = bucket._head, desire = OFFSET_NULL;
-          if (bucket._tail.compare_exchange_strong(expected, desire,
-                                                   std::memory_order_acq_rel)) {
-            bucket._head = OFFSET_NULL;
-          } else {
-            bucket._head = expected;
-          }
-        } else {
-          bucket._head = p0->_next;
-        }
+    if (head == NULL) continue;
+
+    // Insert may race with us, splice the chain like a single node
+    uint64_t old_offset =
+        bucket._tail.exchange(NodeToOffset(tail), std::memory_order_acq_rel);
+    Item *old_node = OffsetToNode(old_offset);
+    if (old_node == NULL) {
+      bucket._head = NodeToOffset(head);
+    } else {
+      old_node->_next[link] = NodeToOffset(head);
+    }
+
+    bucket._count.fetch_add(length, std::memory_order_acq_rel);
+    count += length;
+  }
+
+  while (used < cached) _pool->Free(cache[used++]);
+  _table_meta->_item_count.fetch_add(count, std::memory_order_relaxed);
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+int ShmHashMap<Key, Value, Storage, Hasher, Clock>::GetCount() {
+  ReaderGuard guard(_reader_table);
+  BucketTableView view;
+  LoadTable(&view);
+
+  int sum = 0;
+  for (uint32_t i = 0; i < view._bucket_size; ++i)
+    sum += view._buckets[i]._count.load(std::memory_order_consume);
+  for (uint32_t i = 0; i < view._old_bucket_size; ++i)
+    sum += view._old_buckets[i]._count.load(std::memory_order_consume);
+
+  return sum;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::GC() {
+  GC(0, 0);
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+bool ShmHashMap<Key, Value, Storage, Hasher, Clock>::GC(uint32_t max_steps,
+                                                        uint32_t max_micros,
+                                                        GCProgress *progress) {
+  GCBudget budget(max_steps, max_micros);
+  return Collect(budget, 1, progress);
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+bool ShmHashMap<Key, Value, Storage, Hasher, Clock>::ParallelGC(
+    int thread_num, GCProgress *progress) {
+  GCBudget budget(0, 0);
+  return Collect(budget, thread_num < 1 ? 1 : thread_num, progress);
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+bool ShmHashMap<Key, Value, Storage, Hasher, Clock>::Collect(
+    GCBudget &budget, int thread_num, GCProgress *progress) {
+  /* steps:
+      1. free ItemNode-s whose epoch all reader slots have left, first so
+         a scan using up the budget never starves it
+      2. move nodes unlinked by Erase to the garbage list, migrate
+         buckets, then scan expire ItemNode from the cursor, unlink and
+         push into garbage list with the current epoch
+      3. free again what the budget allows
+
+     without a limit every bucket is scanned, nodes unlinked by this round
+     are freed as soon as the readers which may still hold them return,
+     at the latest by the next round
+  */
+  if (progress != NULL) *progress = GCProgress();
+
+  // other process is collecting
+  if (!LockMaintain()) return false;
+
+  int64_t garbage = _table_meta->_garbage_count;
+
+  uint32_t freed = SafeFree(_reader_table->SafeEpoch(), budget);
+
+  // nodes unlinked by Erase, the rest is left for the next call
+  if (_table_meta->_erased_pending == OFFSET_NULL) {
+    _table_meta->_erased_pending =
+        _erased_list->exchange(OFFSET_NULL, std::memory_order_acquire);
+  }
+  Item *p = OffsetToNode(_table_meta->_erased_pending);
+  while (p != NULL && !budget.Exhausted()) {
+    _table_meta->_erased_pending = p->_del_next;
+    AddGarbageList(p, p->_retire_epoch);
+    budget.Spend(1);
+    p = OffsetToNode(_table_meta->_erased_pending);
+  }
+
+  if (budget._unlimited) {
+    Migrate(GC_MIGRATE_STEP, false);
+  } else {
+    while (_table_meta->Current()._old_bucket_size != 0 &&
+           !budget.Exhausted()) {
+      uint32_t step = std::min(MIGRATE_STEP, budget._steps);
+      Migrate(step, false);
+      budget.Spend(step);
+    }
+  }
+
+  // old chains may still link the nodes, scan after migration finished
+  if (_table_meta->Current()._old_bucket_size == 0) {
+    if (_wheel != NULL && _table_meta->_scan_rounds >= _scan_until) {
+      ScanWheel(budget);
+    } else if (thread_num > 1) {
+      ParallelScan(thread_num);
+    } else {
+      Scan(budget);
+    }
+  }
+  int64_t collected = _table_meta->_garbage_count - garbage + freed;
+
+  _reader_table->Advance();
+
+  uint64_t safe_epoch = _reader_table->SafeEpoch();
+  freed += SafeFree(safe_epoch, budget);
+  FreeRetiredTable(safe_epoch);
+
+  if (progress != NULL) {
+    BucketTableState &state = _table_meta->Current();
+    progress->_steps = budget._spent;
+    progress->_collected = collected;
+    progress->_freed = freed;
+    progress->_garbage = _table_meta->_garbage_count;
+    progress->_scan_rounds = _table_meta->_scan_rounds;
+    if (state._old_bucket_size != 0) {
+      progress->_migrate_left =
+          state._old_bucket_size - _table_meta->_migrate_index;
+    } else if (_wheel != NULL && _table_meta->_scan_rounds >= _scan_until) {
+      progress->_wheel_lag = _clock.NowMs() / 1000 - _wheel->Clock();
+    } else {
+      progress->_scan_left = state._bucket_size - _table_meta->_scan_cursor;
+    }
+  }
+
+  UnlockMaintain();
+  return true;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+uint32_t ShmHashMap<Key, Value, Storage, Hasher, Clock>::SafeFree(
+    uint64_t safe_epoch, GCBudget &budget) {
+  // garbage list is ordered by epoch, head moves before the node is freed
+  // so a crash leaks the node instead of freeing it twice
+  uint32_t count = 0;
+  Item *p = OffsetToNode(*_garbage_list_head_offset);
+  while (p != NULL && p->_retire_epoch < safe_epoch && !budget.Exhausted()) {
+    *_garbage_list_head_offset = p->_del_next;
+    _table_meta->_garbage_count--;
+    budget.Spend(1);
+    count++;
+
+    WheelRelink(p, 0);
+    Storage::Release(p->_key, p->_value, _slab);
+    p->~Item();
+    Free(p);
+    p = OffsetToNode(*_garbage_list_head_offset);
+  }
+
+  if (p == NULL) *_garbage_list_tail_offset = OFFSET_NULL;
+  return count;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::Scan(GCBudget &budget) {
+  BucketTableView view;
+  LoadTable(&view);
+  uint32_t link = view._generation & 1;
+
+  // a round at most
+  for (uint32_t i = 0; i < view._bucket_size && !budget.Exhausted(); ++i) {
+    uint32_t index = _table_meta->_scan_cursor;
+    if (index >= view._bucket_size) index = 0;
+    ScanBucket(view._buckets[index], link);
+    budget.Spend(1);
+
+    if (++index == view._bucket_size) {
+      index = 0;
+      _table_meta->_scan_rounds++;
+    }
+    _table_meta->_scan_cursor = index;
+  }
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::ParallelScan(
+    int thread_num) {
+  // the caller scans the first range, the lists are joined in range order
+  BucketTableView view;
+  LoadTable(&view);
+  uint32_t link = view._generation & 1;
+  std::vector<GarbageSublist> garbage(thread_num);
+  std::vector<std::thread> threads;
+
+  auto range = [&](int slice) {
+    uint64_t size = view._bucket_size;
+    for (uint32_t i = size * slice / thread_num;
+         i < size * (slice + 1) / thread_num; ++i)
+      ScanBucket(view._buckets[i], link, &garbage[slice]);
+  };
+
+  for (int i = 1; i < thread_num; ++i) threads.push_back(std::thread(range, i));
+  range(0);
+  for (auto &t : threads) t.join();
+
+  for (auto &sublist : garbage) SpliceGarbageList(sublist);
+
+  // the round left by Scan starts over
+  _table_meta->_scan_cursor = 0;
+  _table_meta->_scan_rounds++;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::ScanBucket(
+    BucketItem &bucket, uint32_t link, GarbageSublist *garbage) {
+  if (bucket._head == OFFSET_NULL) return;
+
+  // erasing, try next round
+  if (bucket._unlink_lock.TryLock() == ShmPool::LOCK_FAILED) return;
+
+  int64_t now = _clock.NowMs();
+  Item *prev = NULL, *p = OffsetToNode(bucket._head);
+  while (p != NULL) {
+    // find expire ItemNode and lock it, a node still linked while
+    // collecting is erased during migration or left by a collector
+    // died in the middle
+    int status = p->_invalid.load(std::memory_order_acquire);
+    if (status == VALID && p->_expire && p->_expire < now &&
+        p->_invalid.compare_exchange_strong(status, COLLECTING,
+                                            std::memory_order_acq_rel)) {
+      status = COLLECTING;
+    }
+
+    if (status == COLLECTING) {
+      UnlinkNode(bucket, link, p);
+      RemoveExpireNode(p, bucket, garbage);
+
+      p = OffsetToNode(prev != NULL ? prev->_next[link] : bucket._head);
+      continue;
+    }
+
+    // popped by a collector died in the middle, the item lock waits
+    // for Insert relinking it
+    if (_wheel != NULL && status == VALID && p->_expire != 0 &&
+        NodeLinks(p)._slot.load(std::memory_order_acquire) < 0 &&
+        LockItem(p, WRITING) == VALID) {
+      WheelAdapter links(this);
+      if (NodeLinks(p)._slot.load(std::memory_order_acquire) < 0) {
+        _wheel->Drop(links, NodeToOffset(p));
+        if (p->_expire != 0)
+          _wheel->Link(links, NodeToOffset(p), p->_expire / 1000);
       }
+      p->_invalid.store(VALID, std::memory_order_release);
     }
+
+    prev = p;
+    p = OffsetToNode(p->_next[link]);
   }
+
+  bucket._unlink_lock.Unlock();
 }
 
-template <typename Key, typename Value>
-void ShmHashMap<Key, Value>::AddGarbageList(Item *node) {
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+int ShmHashMap<Key, Value, Storage, Hasher, Clock>::Evict(uint32_t hash) {
+  /* CLOCK over the buckets, the hand is a cursor in the segment:
+      - a node read since the hand passed is kept, its access bit cleared
+      - an expired node or one not read is unlinked into the garbage list,
+        the hand stops when EVICT_BATCH such nodes are seen or after two
+        turns
+      - with the sketch a node not read is kept if seen as often as the
+        new key, the hand stops at the first one evicted, the key is
+        rejected if ADMIT_SAMPLE are kept
+      - the epoch is advanced, nodes are freed once the readers which may
+        hold them left
+
+     garbage freeable already is taken first, the maintain lock keeps GC
+     off the nodes the hand walks
+
+     while migrating, a node moved is linked in both tables, the hand walks
+     the old buckets not moved yet instead, whose nodes only the old chains
+     link, and moves MIGRATE_STEP buckets on the way
+  */
+  if (!LockMaintain()) return EVICT_BUSY;
+
+  // the reader table is scanned only if there is garbage to free
+  GCBudget budget(0, 0);
+  uint32_t freed = 0;
+  if (_table_meta->_garbage_count != 0)
+    freed = SafeFree(_reader_table->SafeEpoch(), budget);
+  if (freed == 0) {
+    Migrate(MIGRATE_STEP, false);
+
+    BucketTableView view;
+    LoadTable(&view);
+    BucketItem *buckets = view._buckets;
+    uint32_t link = view._generation & 1;
+    uint32_t begin = 0, end = view._bucket_size;
+    if (view._old_bucket_size != 0) {
+      buckets = view._old_buckets;
+      link = (view._generation + 1) & 1;
+      begin = _table_meta->_migrate_index;
+      end = view._old_bucket_size;
+    }
+
+    int64_t now = _clock.NowMs();
+    uint32_t frequency = _sketch != NULL ? _sketch->Frequency(hash) : 0;
+    // an admitted key takes the place of one entry, a batch freed would let
+    // the following keys in unchecked
+    uint32_t limit = _sketch != NULL ? 1 : EVICT_BATCH;
+    uint32_t sample = _sketch != NULL ? ADMIT_SAMPLE : EVICT_BATCH;
+    uint32_t evicted = 0, sampled = 0;
+    for (uint64_t i = 0;
+         i < 2ULL * (end - begin) && sampled < sample && evicted < limit;
+         ++i) {
+      uint32_t index = _table_meta->_evict_cursor;
+      if (index < begin || index >= end) index = begin;
+      evicted += EvictBucket(buckets[index], link, now, frequency, &sampled);
+      _table_meta->_evict_cursor = index + 1;
+    }
+
+    if (_sketch != NULL && evicted == 0 && sampled != 0) {
+      UnlockMaintain();
+      return EVICT_REJECTED;
+    }
+
+    _reader_table->Advance();
+    for (int i = 0; i < EVICT_WAIT_SPINS && _table_meta->_garbage_count != 0;
+         ++i) {
+      freed += SafeFree(_reader_table->SafeEpoch(), budget);
+      if (freed != 0) break;
+      sched_yield();
+    }
+  }
+
+  UnlockMaintain();
+  return freed;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+uint32_t ShmHashMap<Key, Value, Storage, Hasher, Clock>::EvictBucket(
+    BucketItem &bucket, uint32_t link, int64_t now, uint32_t frequency,
+    uint32_t *sampled) {
+  if (bucket._head == OFFSET_NULL) return 0;
+
+  // erasing, the hand goes on
+  if (bucket._unlink_lock.TryLock() == ShmPool::LOCK_FAILED) return 0;
+
+  // moved again after its migrator died, the nodes are in both tables
+  if (bucket._migrated.load(std::memory_order_acquire)) {
+    bucket._unlink_lock.Unlock();
+    return 0;
+  }
+
+  uint32_t count = 0;
+  Item *prev = NULL, *p = OffsetToNode(bucket._head);
+  while (p != NULL) {
+    // nodes left collecting are unlinked as Scan does
+    int status = p->_invalid.load(std::memory_order_acquire);
+    bool expired = p->_expire != 0 && p->_expire < now;
+    bool cold = expired || p->_referenced.load(std::memory_order_relaxed) == 0;
+    if (status == VALID && cold) ++*sampled;
+
+    bool victim = cold && (expired || _sketch == NULL ||
+                           _sketch->Frequency(NodeHashCode(p)) < frequency);
+    if (status == VALID && victim &&
+        p->_invalid.compare_exchange_strong(status, COLLECTING,
+                                            std::memory_order_acq_rel)) {
+      status = COLLECTING;
+    }
+
+    if (status == COLLECTING) {
+      UnlinkNode(bucket, link, p);
+      RemoveExpireNode(p, bucket);
+      count++;
+
+      p = OffsetToNode(prev != NULL ? prev->_next[link] : bucket._head);
+      continue;
+    }
+
+    if (!cold) p->_referenced.store(0, std::memory_order_relaxed);
+    prev = p;
+    p = OffsetToNode(p->_next[link]);
+  }
+
+  bucket._unlink_lock.Unlock();
+  return count;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::ScanWheel(
+    GCBudget &budget) {
+  // slots are seconds, a node is in the slot of the second it expires in
+  int64_t now = _clock.NowMs();
+  int64_t second = now / 1000;
+  WheelAdapter links(this);
+  auto expire = [this, now](uint64_t ref) {
+    ExpireNode(OffsetToNode(ref), now);
+  };
+
+  // far behind, one pass over every slot
+  if (budget._unlimited ||
+      second - _wheel->Clock() > MapWheel::WHEEL_LEVEL1_SPAN) {
+    budget.Spend(_wheel->Advance(links, second, expire));
+    return;
+  }
+
+  // a second at a time, the nodes of a slot are expired at once
+  while (_wheel->Clock() < second && !budget.Exhausted())
+    budget.Spend(_wheel->Advance(links, _wheel->Clock() + 1, expire));
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::ExpireNode(Item *p,
+                                                                int64_t now) {
+  /* p is popped from the wheel, the item lock keeps its expiry steady:
+      - not due, Insert changed the expiry, link it again
+      - due or left collecting by Insert or Erase, unlink it
+      - otherwise it is retired by others
+
+     the wheel is not advanced while migrating, p is in the current table
+  */
+  WheelAdapter links(this);
+  uint64_t offset = NodeToOffset(p);
+  int status = LockItem(p, WRITING);
+  if (status == VALID) {
+    if (p->_expire == 0 || p->_expire >= now) {
+      if (p->_expire != 0) {
+        _wheel->Link(links, offset, p->_expire / 1000);
+      } else {
+        _wheel->Drop(links, offset);
+      }
+      p->_invalid.store(VALID, std::memory_order_release);
+      return;
+    }
+
+    // not waiting for the bucket lock with the item locked, Erase takes
+    // them the other way round
+    p->_invalid.store(COLLECTING, std::memory_order_release);
+  } else if (status != COLLECTING) {
+    _wheel->Drop(links, offset);
+    return;
+  }
+  _wheel->Drop(links, offset);
+
+  BucketTableView view;
+  LoadTable(&view);
+  BucketItem &bucket =
+      view._buckets[MapHash::BucketIndex(NodeHashCode(p), view._bucket_size)];
+
+  // Erase unlinks a node it marked before releasing the bucket
+  LockBucket(bucket);
+  if (p->_invalid.load(std::memory_order_acquire) == COLLECTING &&
+      UnlinkNode(bucket, view._generation & 1, p))
+    RemoveExpireNode(p, bucket);
+  UnlockBucket(bucket);
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::WheelRelink(
+    Item *node, int64_t expire_at) {
+  if (_wheel == NULL) return;
+
+  WheelAdapter links(this);
+  _wheel->Relink(links, NodeToOffset(node), expire_at / 1000);
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::AddGarbageList(
+    Item *node, uint64_t epoch, GarbageSublist *garbage) {
+  node->_retire_epoch = epoch;
+  node->_del_next = OFFSET_NULL;
+
+  // nodes of a GC thread are leaked by a crash before joined
+  if (garbage != NULL) {
+    if (garbage->_head == OFFSET_NULL) {
+      garbage->_head = NodeToOffset(node);
+    } else {
+      OffsetToNode(garbage->_tail)->_del_next = NodeToOffset(node);
+    }
+    garbage->_tail = NodeToOffset(node);
+    garbage->_count++;
+    return;
+  }
+
+  // adding again after a crash is harmless, tail is always set last
+  _table_meta->_garbage_count++;
   if (*_garbage_list_head_offset == OFFSET_NULL) {
-    *_garbage_list_head_offset = NodeToOffset(node);
     *_garbage_list_tail_offset = NodeToOffset(node);
+    *_garbage_list_head_offset = NodeToOffset(node);
   } else {
     OffsetToNode(*_garbage_list_tail_offset)->_del_next = NodeToOffset(node);
     *_garbage_list_tail_offset = NodeToOffset(node);
   }
 }
 
-template <typename Key, typename Value>
-void ShmHashMap<Key, Value>::RemoveExpireNode(Item *p, BucketItem &bucket) {
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::SpliceGarbageList(
+    GarbageSublist &garbage) {
+  if (garbage._head == OFFSET_NULL) return;
+
+  _table_meta->_garbage_count += garbage._count;
+  if (*_garbage_list_head_offset == OFFSET_NULL) {
+    *_garbage_list_tail_offset = garbage._tail;
+    *_garbage_list_head_offset = garbage._head;
+  } else {
+    OffsetToNode(*_garbage_list_tail_offset)->_del_next = garbage._head;
+    *_garbage_list_tail_offset = garbage._tail;
+  }
+  garbage = GarbageSublist();
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::RemoveExpireNode(
+    Item *p, BucketItem &bucket, GarbageSublist *garbage) {
   //    // (1) atomic change invalid to 1
   //    p->_invalid.store(1, std::memory_order_release);
 
-  // (2) add garbage list
-  AddGarbageList(p);
+  // (2) add garbage list, readers entered from now on can't reach it
+  AddGarbageList(p, _reader_table->Current(), garbage);
+  p->_invalid.store(WAITING_DELETE, std::memory_order_release);
 
   // (3) count reduce 1
   bucket._count.fetch_sub(1, std::memory_order_acq_rel);
+  _table_meta->_item_count.fetch_sub(1, std::memory_order_relaxed);
 }
 
-template <typename Key, typename Value>
-int ShmHashMap<Key, Value>::AddNodeItem(int index, const Key &key,
-                                        const Value &value, int expire) {
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+int ShmHashMap<Key, Value, Storage, Hasher, Clock>::AddNodeItem(
+    const BucketTableView &view, uint32_t hash, const Key &key,
+    const Value &value, int64_t expire_at) {
   void *ptr = (Item *)Allocate();
 
   if (ptr == NULL) return RET_NO_MEMORY;
@@ -455,53 +1996,516 @@ int ShmHashMap<Key, Value>::AddNodeItem(int index, const Key &key,
   // construct node data
   Item *new_node = new (ptr) Item;
   new_node->_invalid.store(0, std::memory_order_release);
-  new_node->_key = key;
-  new_node->_value = value;
-  new_node->_next = OFFSET_NULL;
-  new_node->_expire = expire != 0 ? time(NULL) + expire : 0;
+  new_node->_generation.store(view._generation, std::memory_order_release);
+  new_node->_referenced.store(0, std::memory_order_relaxed);
+  new_node->_next[0] = OFFSET_NULL;
+  new_node->_next[1] = OFFSET_NULL;
+  new_node->_expire = expire_at;
   new_node->_del_next = OFFSET_NULL;
+  new_node->_retire_epoch = 0;
+  if (_wheel != NULL) new (&NodeLinks(new_node)) MapWheel::WheelLinks;
+
+  if (!Storage::StoreKey(new_node->_key, key, _slab) ||
+      !Storage::StoreValue(new_node->_value, value, _slab)) {
+    Storage::Release(new_node->_key, new_node->_value, _slab);
+    new_node->~Item();
+    Free(new_node);
+    return RET_NO_MEMORY;
+  }
+
+  if (expire_at != 0) WheelRelink(new_node, expire_at);
+
+  BucketItem &bucket =
+      view._buckets[MapHash::BucketIndex(hash, view._bucket_size)];
+  LinkNode(bucket, view._generation & 1, new_node);
+  _table_meta->_item_count.fetch_add(1, std::memory_order_relaxed);
+
+  // pairs with MigrateBucket, the migrator either walks over the new node
+  // or we see the bucket is migrated and move the node ourselves
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (bucket._migrated.load(std::memory_order_relaxed)) {
+    // the node may be erased before the bucket is migrated
+    LockBucket(bucket);
+    if (new_node->_invalid.load(std::memory_order_acquire) != WAITING_DELETE)
+      MoveNode(bucket, new_node, false);
+    UnlockBucket(bucket);
+  }
 
+  return RET_OK;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::LinkNode(
+    BucketItem &bucket, uint32_t link, Item *node) {
   // exchange tail
-  BucketItem &bucket = _buckets[index];
   uint64_t old_offset =
-      bucket._tail.exchange(NodeToOffset(new_node), std::memory_order_acq_rel);
+      bucket._tail.exchange(NodeToOffset(node), std::memory_order_acq_rel);
   Item *old_node = OffsetToNode(old_offset);
   // int count = bucket._count.load(std::memory_order_acquire);
   if (old_node == NULL) {
     // empty list
-    bucket._head = NodeToOffset(new_node);
+    bucket._head = NodeToOffset(node);
   } else {
-    old_node->_next = NodeToOffset(new_node);
+    old_node->_next[link] = NodeToOffset(node);
   }
 
   bucket._count.fetch_add(1, std::memory_order_acq_rel);
+}
 
-  return RET_OK;
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+bool ShmHashMap<Key, Value, Storage, Hasher, Clock>::UnlinkNode(
+    BucketItem &bucket, uint32_t link, Item *node) {
+  /* caller holds the bucket lock, only appenders race with us and they
+     touch nothing but _tail and _next of the tail (or _head if empty):
+      - node with a successor is skipped over by its predecessor
+      - tail is moved back to the predecessor by cas, if an appender wins
+        wait until it links node->_next, then node has a successor
+
+     every step leaves a walkable chain, a crash in the middle at most
+     keeps the node linked
+  */
+  uint64_t offset = NodeToOffset(node);
+  Item *prev = NULL, *p = OffsetToNode(bucket._head);
+  while (p != NULL && p != node) {
+    prev = p;
+    p = OffsetToNode(p->_next[link]);
+  }
+
+  // not linked
+  if (p == NULL) return false;
+
+  if (__atomic_load_n(&node->_next[link], __ATOMIC_ACQUIRE) == OFFSET_NULL) {
+    uint64_t expected = offset;
+    uint64_t prev_offset = prev != NULL ? NodeToOffset(prev) : OFFSET_NULL;
+    if (bucket._tail.compare_exchange_strong(expected, prev_offset,
+                                             std::memory_order_acq_rel)) {
+      // an appender after the cas links to prev itself, keep its link
+      uint64_t *next = prev != NULL ? &prev->_next[link] : &bucket._head;
+      expected = offset;
+      __atomic_compare_exchange_n(next, &expected, (uint64_t)OFFSET_NULL, false,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+      return true;
+    }
+
+    while (__atomic_load_n(&node->_next[link], __ATOMIC_ACQUIRE) ==
+           OFFSET_NULL) {
+      // appender is linking, so wait
+    }
+  }
+
+  if (prev != NULL) {
+    prev->_next[link] = node->_next[link];
+  } else {
+    bucket._head = node->_next[link];
+  }
+  return true;
 }
 
-template <typename Key, typename Value>
-Item *ShmHashMap<Key, Value>::GetNode(uint32_t index, const Key &key) {
-  BucketItem &bucket = _buckets[index];
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::LockBucket(
+    BucketItem &bucket) {
+  // lock of a dead owner is taken over, UnlinkNode never leaves a broken
+  // chain behind
+  while (bucket._unlink_lock.TryLock() == ShmPool::LOCK_FAILED) {
+  }
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::UnlockBucket(
+    BucketItem &bucket) {
+  bucket._unlink_lock.Unlock();
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+Item *ShmHashMap<Key, Value, Storage, Hasher, Clock>::GetNode(
+    BucketItem &bucket, uint32_t link, const Key &key) {
   Item *p = OffsetToNode(bucket._head);
 
   while (p != NULL) {
-    if (p->_key == key) return p;
-    p = OffsetToNode(p->_next);
+    if (MatchNode(p, key)) return p;
+    p = OffsetToNode(p->_next[link]);
   }
 
   return NULL;
 };
 
-template <typename Key, typename Value>
-void *ShmHashMap<Key, Value>::Allocate() {
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+Item *ShmHashMap<Key, Value, Storage, Hasher, Clock>::FindNode(
+    const BucketTableView &view, uint32_t hash, const Key &key) {
+  uint32_t index = MapHash::BucketIndex(hash, view._bucket_size);
+  Item *item = GetNode(view._buckets[index], view._generation & 1, key);
+  if (item == NULL && view._old_bucket_size != 0) {
+    index = MapHash::BucketIndex(hash, view._old_bucket_size);
+    item = GetNode(view._old_buckets[index], (view._generation + 1) & 1, key);
+  }
+
+  return item;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+bool ShmHashMap<Key, Value, Storage, Hasher, Clock>::MatchNode(Item *item,
+                                                               const Key &key) {
+  // a node replaced, erased or expired may be followed by a live one
+  if (!Storage::KeyEqual(item->_key, key, _slab)) return false;
+
+  int status = item->_invalid.load(std::memory_order_acquire);
+  return status != COLLECTING && status != WAITING_DELETE &&
+         (item->_expire == 0 || item->_expire >= _clock.NowMs());
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+uint32_t ShmHashMap<Key, Value, Storage, Hasher, Clock>::NodeHashCode(
+    Item *node) {
+  Key key;
+  Storage::LoadKey(node->_key, key, _slab);
+  return Hash(key);
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+int ShmHashMap<Key, Value, Storage, Hasher, Clock>::LockItem(Item *item,
+                                                             int status) {
+  // return VALID if locked, otherwise the status blocking us
+  int invalid = VALID;
+  while (!item->_invalid.compare_exchange_strong(invalid, status,
+                                                 std::memory_order_acq_rel)) {
+    if (invalid != WRITING) return invalid;
+
+    // writing occur, so wait
+    invalid = VALID;
+  }
+  return VALID;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+bool ShmHashMap<Key, Value, Storage, Hasher, Clock>::LockMaintain() {
+  int ret = _table_meta->_maintain_lock.TryLock();
+  if (ret == ShmPool::LOCK_FAILED) return false;
+
+  // last owner died in the middle of migrating or collecting
+  if (ret == ShmPool::LOCK_RECOVERED) {
+    Migrate(0, true);
+    _scan_until = _table_meta->_scan_rounds +
+                  (_table_meta->_scan_cursor != 0 ? 2 : 1);
+  }
+  return true;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::UnlockMaintain() {
+  _table_meta->_maintain_lock.Unlock();
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::StartResize(
+    const BucketTableView &view) {
+  if (!LockMaintain()) return;
+
+  BucketTableState &state = _table_meta->Current();
+  if (state._generation == view._generation && state._bucket_size <= (1u << 30))
+    ResizeTo(state._bucket_size * 2);
+
+  UnlockMaintain();
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+bool ShmHashMap<Key, Value, Storage, Hasher, Clock>::ResizeTo(
+    uint32_t bucket_size) {
+  // caller holds the maintain lock, one resize at a time, the retired
+  // table must be freed first
+  BucketTableState state = _table_meta->Current();
+  if (state._old_bucket_size != 0 || _table_meta->_retired_bucket_size != 0)
+    return false;
+
+  void *ptr =
+      _segment.allocate(bucket_size * sizeof(BucketItem), std::nothrow);
+  if (ptr == NULL) return false;
+
+  BucketItem *buckets = (BucketItem *)ptr;
+  for (uint32_t i = 0; i < bucket_size; ++i) new (&buckets[i]) BucketItem;
+
+  state._old_handle = state._handle;
+  state._old_bucket_size = state._bucket_size;
+  state._handle = _segment.get_handle_from_address(buckets);
+  state._bucket_size = bucket_size;
+  state._generation++;
+
+  _table_meta->_migrate_index = 0;
+  _table_meta->_scan_cursor = 0;
+  _table_meta->Publish(state);
+  return true;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::Reserve(int64_t count) {
+  // grow the table at once instead of doubling along the way,
+  // caller holds the maintain lock
+  uint32_t bucket_size = _table_meta->Current()._bucket_size;
+  if (_max_load_factor <= 0 || count <= _max_load_factor * bucket_size) return;
+
+  while (bucket_size <= (1u << 30) && count > _max_load_factor * bucket_size)
+    bucket_size *= 2;
+
+  Migrate(UINT32_MAX, false);
+
+  // table retired by the last migration may still be read
+  _reader_table->Advance();
+  FreeRetiredTable(_reader_table->SafeEpoch());
+
+  if (ResizeTo(bucket_size)) Migrate(UINT32_MAX, false);
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::Migrate(uint32_t step,
+                                                             bool recover) {
+  /* move step buckets from old table to new table,
+     caller holds the maintain lock
+
+     if recover, the bucket at _migrate_index is moved again since
+     the last owner may die in the middle of it
+  */
+  BucketTableState state = _table_meta->Current();
+  if (state._old_bucket_size == 0) return;
+
+  BucketItem *old_buckets = HandleToBuckets(state._old_handle);
+  uint32_t link = (state._generation + 1) & 1;
+
+  if (recover) {
+    if (_table_meta->_migrate_index < state._old_bucket_size)
+      MigrateBucket(old_buckets[_table_meta->_migrate_index], link, true);
+    return;
+  }
+
+  for (uint32_t i = 0;
+       i < step && _table_meta->_migrate_index < state._old_bucket_size; ++i) {
+    MigrateBucket(old_buckets[_table_meta->_migrate_index], link, false);
+    _table_meta->_migrate_index++;
+  }
+
+  if (_table_meta->_migrate_index >= state._old_bucket_size) {
+    // retired table is freed only after the old table is unpublished
+    _table_meta->_retired_handle = state._old_handle;
+    _table_meta->_retired_bucket_size = state._old_bucket_size;
+    _table_meta->_retired_epoch = _reader_table->Current();
+
+    state._old_bucket_size = 0;
+    _table_meta->Publish(state);
+  }
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::MigrateBucket(
+    BucketItem &bucket, uint32_t link, bool recover) {
+  // Erase unlinks nodes only from buckets not migrated
+  LockBucket(bucket);
+
+  bucket._migrated.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  Item *p = OffsetToNode(bucket._head);
+  while (p != NULL) {
+    MoveNode(bucket, p, recover);
+    p = OffsetToNode(p->_next[link]);
+  }
+
+  UnlockBucket(bucket);
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::MoveNode(
+    BucketItem &bucket, Item *node, bool recover) {
+  // node keeps its old link, readers of the old chain are not affected
+  BucketTableView view;
+  LoadTable(&view);
+
+  uint32_t generation = node->_generation.load(std::memory_order_acquire);
+  uint32_t link = view._generation & 1;
+  BucketItem &new_bucket =
+      view._buckets[MapHash::BucketIndex(NodeHashCode(node),
+                                         view._bucket_size)];
+
+  if (recover && generation == view._generation) {
+    // moved by the dead owner, make sure it is linked
+    Item *p = OffsetToNode(new_bucket._head);
+    while (p != NULL && p != node) p = OffsetToNode(p->_next[link]);
+    if (p == NULL) {
+      node->_next[link] = OFFSET_NULL;
+      LinkNode(new_bucket, link, node);
+    }
+    return;
+  }
+
+  if (generation + 1 != view._generation ||
+      !node->_generation.compare_exchange_strong(generation, generation + 1,
+                                                 std::memory_order_acq_rel)) {
+    // moved by others
+    return;
+  }
+
+  bucket._count.fetch_sub(1, std::memory_order_acq_rel);
+  node->_next[link] = OFFSET_NULL;
+  LinkNode(new_bucket, link, node);
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::FreeRetiredTable(
+    uint64_t safe_epoch) {
+  if (_table_meta->_retired_bucket_size == 0 ||
+      _table_meta->Current()._old_bucket_size != 0 ||
+      _table_meta->_retired_epoch >= safe_epoch) {
+    return;
+  }
+
+  BucketItem *buckets = HandleToBuckets(_table_meta->_retired_handle);
+  BucketItem *named =
+      _segment.find<BucketItem>((_name + BUCKET).c_str()).first;
+
+  if (buckets == named) {
+    _segment.destroy<BucketItem>((_name + BUCKET).c_str());
+  } else {
+    for (uint32_t i = 0; i < _table_meta->_retired_bucket_size; ++i)
+      buckets[i].~BucketItem();
+    _segment.deallocate(buckets);
+  }
+
+  _table_meta->_retired_bucket_size = 0;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+bool ShmHashMap<Key, Value, Storage, Hasher, Clock>::Recover(int thread_num) {
+  /* steps:
+      1. take the maintain lock, a migration left by a dead owner is
+         finished for the bucket it was in
+      2. mark the nodes linked in the current table and the old one,
+         nodes of the old table are counted there until moved
+      3. the pool frees every node not marked
+  */
+  if (!LockMaintain()) return false;
+
+  BucketTableView view;
+  LoadTable(&view);
+  if (thread_num < 1) thread_num = 1;
+
+  // nodes are linked again by the walk
+  if (_wheel != NULL) new (_wheel) Wheel(_clock.NowMs() / 1000);
+
+  ShmPool::NodeBitmap live(_pool->NodeCount());
+  std::vector<int64_t> counts(thread_num, 0);
+  std::vector<std::thread> threads;
+
+  auto range = [&](int slice) {
+    uint64_t size = view._bucket_size;
+    for (uint32_t i = size * slice / thread_num;
+         i < size * (slice + 1) / thread_num; ++i)
+      counts[slice] += RecoverBucket(view._buckets[i], view._generation & 1,
+                                     false, view._generation, live);
+
+    size = view._old_bucket_size;
+    for (uint32_t i = size * slice / thread_num;
+         i < size * (slice + 1) / thread_num; ++i)
+      counts[slice] +=
+          RecoverBucket(view._old_buckets[i], (view._generation + 1) & 1,
+                        true, view._generation, live);
+  };
+
+  for (int i = 1; i < thread_num; ++i) threads.push_back(std::thread(range, i));
+  range(0);
+  for (auto &t : threads) t.join();
+
+  int64_t count = 0;
+  for (int64_t c : counts) count += c;
+  _table_meta->_item_count.store(count, std::memory_order_relaxed);
+
+  // no reader is left, nodes of the lists are freed by the pool
+  *_garbage_list_head_offset = OFFSET_NULL;
+  *_garbage_list_tail_offset = OFFSET_NULL;
+  _table_meta->_garbage_count = 0;
+  _table_meta->_erased_pending = OFFSET_NULL;
+  _erased_list->store(OFFSET_NULL, std::memory_order_release);
+
+  _pool->Recover(live, thread_num, [this](Item *p) {
+    Storage::Release(p->_key, p->_value, _slab);
+    p->~Item();
+  });
+
+  UnlockMaintain();
+  return true;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+uint32_t ShmHashMap<Key, Value, Storage, Hasher, Clock>::RecoverBucket(
+    BucketItem &bucket, uint32_t link, bool old, uint32_t generation,
+    ShmPool::NodeBitmap &live) {
+  WheelAdapter links(this);
+  uint32_t count = 0;
+  Item *last = NULL, *p = OffsetToNode(bucket._head);
+  while (p != NULL) {
+    live.Mark(_pool->NodeIndex(NodeToOffset(p)));
+
+    // a node moved is in the new table as well
+    if (!old || p->_generation.load(std::memory_order_relaxed) != generation) {
+      // a writer died holding the item, or erased while migrating,
+      // collected by the next GC
+      int status = p->_invalid.load(std::memory_order_relaxed);
+      if (status == WRITING || status == WAITING_DELETE) {
+        status = COLLECTING;
+        p->_invalid.store(COLLECTING, std::memory_order_relaxed);
+      }
+
+      if (_wheel != NULL) {
+        new (&NodeLinks(p)) MapWheel::WheelLinks;
+        if (status == COLLECTING) {
+          _wheel->Link(links, NodeToOffset(p), _wheel->Clock());
+        } else if (p->_expire != 0) {
+          _wheel->Link(links, NodeToOffset(p), p->_expire / 1000);
+        }
+      }
+      count++;
+    }
+
+    last = p;
+    p = OffsetToNode(p->_next[link]);
+  }
+
+  // nodes past the last one reached were never linked
+  if (last == NULL) bucket._head = OFFSET_NULL;
+  bucket._tail.store(last != NULL ? NodeToOffset(last) : OFFSET_NULL,
+                     std::memory_order_relaxed);
+  bucket._count.store(count, std::memory_order_relaxed);
+  return count;
+}
+
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void *ShmHashMap<Key, Value, Storage, Hasher, Clock>::Allocate() {
   return _pool->Allocate();
 };
 
-template <typename Key, typename Value>
-void ShmHashMap<Key, Value>::Free(Item *ptr) {
+template <typename Key, typename Value, typename Storage, typename Hasher,
+          typename Clock>
+void ShmHashMap<Key, Value, Storage, Hasher, Clock>::Free(Item *ptr) {
   _pool->Free(ptr);
 };
 #undef Item
 }  // namespace ShmMap
 
-#endif  // SHM_MAP_H
\ No newline at end of file
+#endif  // SHM_MAP_H
@@ -1,5 +1,11 @@
 #include "./shm_map.h"
 
+#include "../common/page.h"
+#include "./shm_file.h"
+
+#include <math.h>
+
+#include <algorithm>
 #include <boost/interprocess/managed_shared_memory.hpp>
 #include <iostream>
 #include <random>
@@ -10,27 +16,47 @@ using namespace ShmMap;
 using namespace ShmPool;
 
 #ifdef STRING_TEST
-class MyHashMap : public ShmHashMap<string, string> {
+// short keys and values in the node, longer ones in the slab
+typedef InlineStorage<32, 64> MyStorage;
+typedef ItemNode<MyStorage::StoredKey, MyStorage::StoredValue> MyNode;
+const uint32_t NODE_NUM = 4000000;
+
+MapOptions SlabOptions(SlabPool* slab) {
+  MapOptions options;
+  options._slab = slab;
+  return options;
+}
+
+class MyHashMap : public ShmHashMap<string, string, MyStorage> {
  public:
-  MyHashMap(int size) : ShmHashMap<string, string>(size) {}
+  MyHashMap(std::string name, MemoryPool<MyNode>* pool,
+            managed_shared_memory* segment, uint32_t size)
+      : ShmHashMap<string, string, MyStorage>(
+            name, pool, segment, size, DEFAULT_MAX_LOAD_FACTOR,
+            SlabOptions(&_slab)),
+        _slab(name + "_slab", segment) {}
   virtual ~MyHashMap() = default;
 
  protected:
-  virtual void* Allocate(int size) { return malloc(size); }
-
-  virtual void Free(void* ptr) { free(ptr); }
-
   virtual uint32_t HashCode(const string& key) {
     return std::hash<string>{}(key);
   }
+
+ private:
+  SlabPool _slab;
 };
 #else
+typedef ItemNode<uint32_t, uint32_t> MyNode;
+const uint32_t NODE_NUM = 10000000;
 
 class MyHashMap : public ShmHashMap<uint32_t, uint32_t> {
  public:
-  MyHashMap(std::string name, MemoryPool<ItemNode<uint32_t, uint32_t> >* pool,
-            managed_shared_memory* segment, uint32_t size)
-      : ShmHashMap<uint32_t, uint32_t>(name, pool, segment, size) {}
+  MyHashMap(std::string name, MemoryPool<MyNode>* pool,
+            managed_shared_memory* segment, uint32_t size,
+            float max_load_factor = DEFAULT_MAX_LOAD_FACTOR,
+            const MapOptions& options = MapOptions())
+      : ShmHashMap<uint32_t, uint32_t>(name, pool, segment, size,
+                                       max_load_factor, options) {}
   virtual ~MyHashMap() = default;
 
  protected:
@@ -65,8 +91,7 @@ void SimpleTest() {
   boost::interprocess::managed_shared_memory managedSharedMemory(
       open_or_create, "MySharedMap", 1024 * 1024 * 1024);
 
-  MemoryPool<ItemNode<uint32_t, uint32_t> > pool("pool", 10000000,
-                                                 &managedSharedMemory);
+  MemoryPool<MyNode> pool("pool", NODE_NUM, &managedSharedMemory);
 
   MyHashMap hash_map("MultipleTest", &pool, &managedSharedMemory, 2048);
 
@@ -91,6 +116,23 @@ void SimpleTest() {
   ret = hash_map.Get(key3, value);
   cout << ret << " " << value << endl;
 
+  ret = hash_map.Erase(key2);
+  cout << "erase: " << ret << endl;
+
+  ret = hash_map.Get(key2, value);
+  cout << ret << endl;
+
+#ifdef STRING_TEST
+  // spilled to the slab, replaced by an inline one
+  hash_map.Insert(key1, string(1000, 'x'));
+  ret = hash_map.Get(key1, value);
+  cout << ret << " " << value.size() << endl;
+
+  hash_map.Insert(key1, key1);
+  ret = hash_map.Get(key1, value);
+  cout << ret << " " << value << endl;
+#endif
+
   cout << "count: " << hash_map.GetCount() << endl;
 }
 
@@ -155,8 +197,7 @@ void MultipleThreadsTest() {
   boost::interprocess::managed_shared_memory managedSharedMemory(
       open_or_create, "MySharedMap", 1024 * 1024 * 1024);
 
-  MemoryPool<ItemNode<uint32_t, uint32_t> > pool("pool", 10000000,
-                                                 &managedSharedMemory);
+  MemoryPool<MyNode> pool("pool", NODE_NUM, &managedSharedMemory);
 
   MyHashMap hash_map("MultipleTest", &pool, &managedSharedMemory, 2048);
 
@@ -190,9 +231,755 @@ void MultipleThreadsTest() {
   sleep(15);
 }
 
+#ifndef STRING_TEST
+// table far bigger than the cache, random keys looked up one by one or
+// batched
+void MultiGetTest() {
+  const uint32_t KEY_NUM = 2000000;
+  const int BATCH = 256;
+  const int ROUND = 4000;
+
+  shared_memory_object::remove("MultiGetMap");
+  boost::interprocess::managed_shared_memory managedSharedMemory(
+      create_only, "MultiGetMap", 512 * 1024 * 1024);
+
+  MemoryPool<ItemNode<uint32_t, uint32_t> > pool("pool", KEY_NUM,
+                                                 &managedSharedMemory);
+
+  MyHashMap hash_map("MultiGetTest", &pool, &managedSharedMemory,
+                     KEY_NUM / 2);
+  for (uint32_t i = 0; i < KEY_NUM; ++i) hash_map.Insert(i, i);
+
+  std::default_random_engine engine(GetTimestampNs());
+  std::vector<uint32_t> keys(BATCH * ROUND);
+  for (auto& key : keys) key = engine() % (KEY_NUM * 2);
+
+  uint32_t values[BATCH];
+  int rets[BATCH];
+
+  uint64_t begin = GetTimestampMS();
+  for (int r = 0; r < ROUND; ++r) {
+    for (int i = 0; i < BATCH; ++i)
+      rets[i] = hash_map.Get(keys[r * BATCH + i], values[i]);
+  }
+  cout << "get cost: " << GetTimestampMS() - begin << "ms" << endl;
+
+  begin = GetTimestampMS();
+  for (int r = 0; r < ROUND; ++r) {
+    hash_map.MultiGet(&keys[r * BATCH], BATCH, values, rets);
+
+    for (int i = 0; i < BATCH; ++i) {
+      if ((rets[i] == 0) != (keys[r * BATCH + i] < KEY_NUM) ||
+          (rets[i] == 0 && values[i] != keys[r * BATCH + i])) {
+        cout << "ERROR" << endl;
+        exit(0);
+      }
+    }
+  }
+  cout << "multi get cost: " << GetTimestampMS() - begin << "ms" << endl;
+
+  shared_memory_object::remove("MultiGetMap");
+}
+
+void BulkLoadTest() {
+  const uint32_t KEY_NUM = 2000000;
+  const int THREAD_NUM = 4;
+
+  std::vector<uint32_t> keys(KEY_NUM);
+  for (uint32_t i = 0; i < KEY_NUM; ++i) keys[i] = i;
+  std::shuffle(keys.begin(), keys.end(),
+               std::default_random_engine(GetTimestampNs()));
+
+  for (int bulk = 0; bulk < 2; ++bulk) {
+    shared_memory_object::remove("BulkLoadMap");
+    boost::interprocess::managed_shared_memory managedSharedMemory(
+        create_only, "BulkLoadMap", 512 * 1024 * 1024);
+
+    MemoryPool<ItemNode<uint32_t, uint32_t> > pool("pool", KEY_NUM,
+                                                   &managedSharedMemory);
+    MyHashMap hash_map("BulkLoadTest", &pool, &managedSharedMemory,
+                       KEY_NUM / 2);
+
+    uint64_t begin = GetTimestampMS();
+    if (bulk) {
+      hash_map.BulkLoad(keys.data(), keys.data(), KEY_NUM, 0, THREAD_NUM);
+    } else {
+      for (uint32_t i = 0; i < KEY_NUM; ++i) hash_map.Insert(keys[i], keys[i]);
+    }
+    cout << (bulk ? "bulk load cost: " : "insert cost: ")
+         << GetTimestampMS() - begin << "ms" << endl;
+
+    uint32_t value;
+    for (uint32_t i = 0; i < KEY_NUM; ++i) {
+      if (hash_map.Get(i, value) != 0 || value != i) {
+        cout << "ERROR" << endl;
+        exit(0);
+      }
+    }
+    cout << "count: " << hash_map.GetCount() << endl;
+  }
+
+  shared_memory_object::remove("BulkLoadMap");
+}
+
+void MagazineTest() {
+  const uint32_t NODE_NUM = 1000000;
+  const int THREAD_NUM = 8;
+  const int ROUND = 100000;
+  typedef ItemNode<uint32_t, uint32_t> Node;
+
+  for (int magazine = 0; magazine < 2; ++magazine) {
+    shared_memory_object::remove("MagazinePool");
+    boost::interprocess::managed_shared_memory managedSharedMemory(
+        create_only, "MagazinePool", 256 * 1024 * 1024);
+
+    MemoryPool<Node> pool("pool", NODE_NUM, &managedSharedMemory, magazine);
+
+    uint64_t begin = GetTimestampMS();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREAD_NUM; ++t) {
+      threads.push_back(std::thread([&pool]() {
+        Node* nodes[16];
+        for (int r = 0; r < ROUND; ++r) {
+          for (auto& node : nodes) node = pool.Allocate();
+          for (auto& node : nodes) pool.Free(node);
+        }
+      }));
+    }
+    for (auto& t : threads) t.join();
+    cout << (magazine ? "magazine cost: " : "ring cost: ")
+         << GetTimestampMS() - begin << "ms" << endl;
+  }
+
+  shared_memory_object::remove("MagazinePool");
+}
+
+// nodes freed into the magazine of a living thread are drained once the
+// ring is empty, not lost to other threads while it idles
+void MagazineDrainTest() {
+  const uint32_t NODE_NUM = 1000;
+  const uint32_t CACHED = 40;
+  typedef ItemNode<uint32_t, uint32_t> Node;
+
+  shared_memory_object::remove("MagazineDrainPool");
+  boost::interprocess::managed_shared_memory managedSharedMemory(
+      create_only, "MagazineDrainPool", 16 * 1024 * 1024);
+  MemoryPool<Node> pool("pool", NODE_NUM, &managedSharedMemory, true);
+
+  std::atomic<int> step(0);
+  std::thread holder([&]() {
+    std::vector<Node*> nodes;
+    Node* node;
+    while ((node = pool.Allocate()) != NULL) nodes.push_back(node);
+    for (uint32_t i = 0; i < CACHED; ++i) pool.Free(nodes[i]);
+    step = 1;
+    while (step.load() != 2) usleep(1000);
+  });
+  while (step.load() != 1) usleep(1000);
+
+  uint32_t count = 0;
+  while (pool.Allocate() != NULL) count++;
+  step = 2;
+  holder.join();
+
+  if (count != CACHED) {
+    cout << "ERROR" << endl;
+    exit(0);
+  }
+  shared_memory_object::remove("MagazineDrainPool");
+}
+
+// a pool created on a fresh segment, faulted in by the one thread
+// initializing it or by the prefault step and init threads
+void PrefaultCost(int thread_num, bool huge_page) {
+  const uint32_t NODE_NUM = 2000000;
+  typedef ItemNode<uint32_t, uint32_t> Node;
+
+  shared_memory_object::remove("PrefaultPool");
+  boost::interprocess::managed_shared_memory managedSharedMemory(
+      create_only, "PrefaultPool", 256 * 1024 * 1024);
+
+  uint64_t begin = GetTimestampMS();
+  bool huge = huge_page &&
+              MapPage::AdviseHuge(managedSharedMemory.get_address(),
+                                  managedSharedMemory.get_size());
+  bool locked = true;
+  if (thread_num > 1) {
+    locked = MapPage::Prefault(managedSharedMemory.get_address(),
+                               managedSharedMemory.get_size(), thread_num,
+                               true);
+  }
+  MemoryPool<Node> pool("pool", NODE_NUM, &managedSharedMemory, false,
+                        MapNuma::NODE_ANY, thread_num);
+  cout << thread_num << " threads huge pages: " << huge
+       << " locked: " << locked << " create cost: " << GetTimestampMS() - begin
+       << "ms" << endl;
+
+  shared_memory_object::remove("PrefaultPool");
+}
+
+void PrefaultTest() {
+  PrefaultCost(1, false);
+  PrefaultCost(4, false);
+  PrefaultCost(4, true);
+}
+
+// a map in a file built, closed and opened again, the reopen reads nothing
+// but the pages the gets touch
+void FileTest() {
+  const uint32_t KEY_NUM = 1000000;
+  const char* PATH = "/tmp/FileMap";
+  typedef DirectStorage<uint32_t, uint32_t> Storage;
+  typedef ShmHashMap<uint32_t, uint32_t, Storage, MapHash::IntHasher> Map;
+  unlink(PATH);
+
+  uint64_t begin = GetTimestampMS();
+  {
+    MappedFile file(PATH, 256 * 1024 * 1024);
+    MemoryPool<ItemNode<uint32_t, uint32_t> > pool("pool", KEY_NUM,
+                                                   file.Get());
+    Map hash_map("FileTest", &pool, file.Get(), KEY_NUM / 2);
+    for (uint32_t i = 0; i < KEY_NUM; ++i) hash_map.Insert(i, i);
+    file.Close();
+  }
+  cout << "file build cost: " << GetTimestampMS() - begin << "ms" << endl;
+
+  begin = GetTimestampMS();
+  MappedFile file(PATH, 256 * 1024 * 1024);
+  MemoryPool<ItemNode<uint32_t, uint32_t> > pool("pool", KEY_NUM, file.Get());
+  Map hash_map("FileTest", &pool, file.Get(), KEY_NUM / 2);
+  uint32_t value;
+  for (uint32_t i = 0; i < KEY_NUM; ++i) {
+    if (hash_map.Get(i, value) != 0 || value != i) {
+      cout << "ERROR" << endl;
+      exit(0);
+    }
+  }
+  cout << "file reopen generation: " << file.Generation()
+       << " whole: " << file.Consistent()
+       << " reopen and get cost: " << GetTimestampMS() - begin << "ms"
+       << endl;
+  unlink(PATH);
+}
+
+typedef ShmHashMap<uint32_t, uint32_t, DirectStorage<uint32_t, uint32_t>,
+                   MapHash::IntHasher>
+    IntMap;
+
+void Check(bool ok) {
+  if (!ok) {
+    cout << "ERROR" << endl;
+    exit(0);
+  }
+}
+
+// a map with a pool of node_num nodes on a segment of its own, the segment
+// is removed with it
+template <typename Map = IntMap>
+struct TestMap {
+  TestMap(const char* name, uint32_t node_num, uint32_t bucket_size,
+          const MapOptions& options = MapOptions())
+      : _name(Remove(name)),
+        _segment(create_only, name, 512 * 1024 * 1024),
+        _pool("pool", node_num, &_segment),
+        _map(name, &_pool, &_segment, bucket_size, DEFAULT_MAX_LOAD_FACTOR,
+             options) {}
+
+  ~TestMap() { Remove(_name); }
+
+  // left by a test died in the middle
+  static std::string Remove(const std::string& name) {
+    shared_memory_object::remove(name.c_str());
+    return name;
+  }
+
+  std::string _name;
+  managed_shared_memory _segment;
+  MemoryPool<ItemNode<uint32_t, uint32_t> > _pool;
+  Map _map;
+};
+
+// a HashCode returning the key, strided keys share its low bits
+class StrideHash : public MapHash::HashAdapter<uint32_t, MapHash::VirtualHasher> {
+ public:
+  uint32_t Bucket(uint32_t key, uint32_t bucket_size) {
+    return MapHash::BucketIndex(Hash(key), bucket_size);
+  }
+
+ protected:
+  virtual uint32_t HashCode(const uint32_t& key) { return key; }
+};
+
+template <typename Map>
+void CheckHasher(const std::vector<uint32_t>& keys) {
+  TestMap<Map> test("HasherMap", keys.size(), keys.size() / 2);
+  Map& hash_map = test._map;
+  for (uint32_t key : keys) hash_map.Insert(key, key);
+
+  uint32_t value;
+  for (uint32_t key : keys)
+    Check(hash_map.Get(key, value) == 0 && value == key);
+}
+
+// strided keys read back by every hasher, and spread over the buckets
+// though HashCode leaves their low bits alone
+void HasherTest() {
+  const uint32_t KEY_NUM = 1000000, BUCKET_SIZE = 1 << 20;
+  typedef DirectStorage<uint32_t, uint32_t> Storage;
+
+  std::vector<uint32_t> keys(KEY_NUM);
+  for (uint32_t i = 0; i < KEY_NUM; ++i) keys[i] = i * 1024;
+  std::shuffle(keys.begin(), keys.end(),
+               std::default_random_engine(GetTimestampNs()));
+
+  CheckHasher<MyHashMap>(keys);
+  CheckHasher<ShmHashMap<uint32_t, uint32_t, Storage, MapHash::IntHasher> >(
+      keys);
+  CheckHasher<ShmHashMap<uint32_t, uint32_t, Storage, MapHash::Crc32cHasher> >(
+      keys);
+  CheckHasher<ShmHashMap<uint32_t, uint32_t, Storage, MapHash::WyHasher> >(
+      keys);
+
+  // unmixed, the keys would fall in BUCKET_SIZE / 1024 buckets
+  StrideHash hash;
+  std::vector<bool> used(BUCKET_SIZE);
+  uint32_t bucket_num = 0;
+  for (uint32_t key : keys) {
+    uint32_t bucket = hash.Bucket(key, BUCKET_SIZE);
+    bucket_num += !used[bucket];
+    used[bucket] = true;
+  }
+  Check(bucket_num > KEY_NUM / 2);
+}
+
+// a few keys expire among many long-lived ones, GC by scanning every chain
+// or by the timing wheel
+void WheelTest() {
+  const uint32_t KEY_NUM = 1000000;
+  const uint32_t EXPIRE_NUM = KEY_NUM / 100;
+
+  for (int timing_wheel = 0; timing_wheel < 2; ++timing_wheel) {
+    MapOptions options;
+    options._timing_wheel = timing_wheel;
+    TestMap<> test("WheelMap", KEY_NUM, KEY_NUM / 4, options);
+    IntMap& hash_map = test._map;
+
+    for (uint32_t i = 0; i < KEY_NUM; ++i) hash_map.Insert(i, i, 3600);
+    // expiry shortened, then lengthened again for half of them
+    for (uint32_t i = 0; i < 2 * EXPIRE_NUM; ++i) hash_map.Insert(i, i, 1);
+    for (uint32_t i = 0; i < EXPIRE_NUM; ++i) hash_map.Insert(i, i, 3600);
+
+    // the first GC of a process scans every chain
+    hash_map.GC();
+    sleep(2);
+    for (int round = 0; round < 10; ++round) hash_map.GC();
+
+    Check(hash_map.GetCount() == (int)(KEY_NUM - EXPIRE_NUM));
+  }
+}
+
+// half of the keys expired, one GC call against calls of 1ms each
+void IncrementalGCTest() {
+  const uint32_t KEY_NUM = 1000000;
+
+  for (int incremental = 0; incremental < 2; ++incremental) {
+    TestMap<> test("IncrementalGCMap", KEY_NUM, KEY_NUM / 4);
+    IntMap& hash_map = test._map;
+    for (uint32_t i = 0; i < KEY_NUM; ++i) hash_map.Insert(i, i, i % 2);
+    sleep(2);
+
+    int calls = 0;
+    GCProgress progress;
+    do {
+      hash_map.GC(0, incremental ? 1000 : 0, &progress);
+      calls++;
+    } while (progress._scan_rounds == 0 || progress._garbage != 0);
+
+    // a round over 250k buckets doesn't fit in 1ms
+    Check(!incremental || calls > 1);
+    Check(hash_map.GetCount() == (int)(KEY_NUM / 2));
+  }
+}
+
+// half of the keys expired, collected by GC threads of 1 to 8
+void ParallelGCTest() {
+  const uint32_t KEY_NUM = 1000000;
+
+  for (int thread_num = 1; thread_num <= 8; thread_num *= 2) {
+    TestMap<> test("ParallelGCMap", KEY_NUM, KEY_NUM / 4);
+    IntMap& hash_map = test._map;
+    for (uint32_t i = 0; i < KEY_NUM; ++i) hash_map.Insert(i, i, i % 2);
+    sleep(2);
+
+    GCProgress progress;
+    hash_map.ParallelGC(thread_num, &progress);
+    hash_map.ParallelGC(thread_num, &progress);
+
+    Check(hash_map.GetCount() == (int)(KEY_NUM / 2) && progress._garbage == 0);
+  }
+}
+
+// a quarter of the keys erased and nodes taken from the pool but never
+// linked, as a crash leaves them, recovered by threads of 1 to 8
+void RecoverTest() {
+  const uint32_t KEY_NUM = 1000000;
+  const uint32_t LEAK_NUM = 1000;
+
+  for (int thread_num = 1; thread_num <= 8; thread_num *= 2) {
+    TestMap<> test("RecoverMap", KEY_NUM + LEAK_NUM, KEY_NUM / 4);
+    IntMap& hash_map = test._map;
+    for (uint32_t i = 0; i < KEY_NUM; ++i) hash_map.Insert(i, i);
+    for (uint32_t i = 0; i < KEY_NUM; i += 4) hash_map.Erase(i);
+    for (uint32_t i = 0; i < LEAK_NUM; ++i) test._pool.Allocate();
+
+    Check(hash_map.Recover(thread_num));
+
+    uint32_t value;
+    for (uint32_t i = 0; i < KEY_NUM; ++i) {
+      Check((hash_map.Get(i, value) == RET_OK) == (i % 4 != 0) &&
+            (i % 4 == 0 || value == i));
+    }
+
+    // every node not linked is free again
+    uint32_t free_num = 0;
+    while (test._pool.Allocate() != NULL) free_num++;
+    Check(hash_map.GetCount() == (int)(KEY_NUM / 4 * 3) &&
+          free_num == test._pool.NodeCount() - KEY_NUM / 4 * 3);
+  }
+}
+
+// keys read back with the clock of Map, then half of them given 100ms
+template <typename Map>
+void CheckClock() {
+  const uint32_t KEY_NUM = 1000000;
+
+  TestMap<Map> test("ClockMap", KEY_NUM, KEY_NUM / 4);
+  Map& hash_map = test._map;
+  for (uint32_t i = 0; i < KEY_NUM; ++i) hash_map.InsertMs(i, i, 3600 * 1000);
+
+  uint32_t value;
+  for (uint32_t i = 0; i < KEY_NUM; ++i)
+    Check(hash_map.Get(i, value) == 0 && value == i);
+
+  for (uint32_t i = 1; i < KEY_NUM; i += 2) hash_map.InsertMs(i, i, 100);
+  usleep(200 * 1000);
+  int count = 0;
+  for (uint32_t i = 0; i < KEY_NUM; ++i) count += hash_map.Get(i, value) == 0;
+  Check(count == (int)(KEY_NUM / 2));
+}
+
+void ClockTest() {
+  typedef DirectStorage<uint32_t, uint32_t> Storage;
+
+  CheckClock<IntMap>();
+  CheckClock<ShmHashMap<uint32_t, uint32_t, Storage, MapHash::IntHasher,
+                        MapClock::CoarseClock> >();
+}
+
+// skewed reads of keys ten times the pool mixed with keys read once, a
+// miss inserts the key, return the hits
+uint32_t CacheHits(bool cache_mode, bool admission) {
+  const uint32_t NODE_NUM = 100000;
+  const uint32_t KEY_NUM = NODE_NUM * 10;
+  const uint32_t READ_NUM = KEY_NUM * 4;
+
+  MapOptions options;
+  options._cache_mode = cache_mode;
+  options._admission = admission;
+  TestMap<> test("CacheMap", NODE_NUM, NODE_NUM / 4, options);
+  IntMap& hash_map = test._map;
+
+  std::default_random_engine engine(GetTimestampMS());
+  std::uniform_real_distribution<double> uniform(0, 1);
+  uint32_t hits = 0, value;
+  for (uint32_t i = 0; i < READ_NUM; ++i) {
+    uint32_t key = i % 2 ? KEY_NUM + i : KEY_NUM * pow(uniform(engine), 4);
+    if (hash_map.Get(key, value) == 0) {
+      hits++;
+      continue;
+    }
+
+    // a full cache evicts or rejects, it never fails
+    int ret = hash_map.Insert(key, key);
+    Check(!cache_mode || ret == RET_OK || ret == RET_NOT_ADMITTED);
+  }
+  return hits;
+}
+
+// eviction keeps the hot keys the full map can't take, admission keeps
+// the keys read once from pushing them out
+void CacheTest() {
+  uint32_t none = CacheHits(false, false);
+  uint32_t clock = CacheHits(true, false);
+  uint32_t tinylfu = CacheHits(true, true);
+  Check(none < clock && clock < tinylfu);
+}
+
+// a full cache loaded again, keys in buckets holding nodes go the way of
+// Insert but fail instead of evicting, a range stops at its first failure
+void CacheBulkLoadTest() {
+  const uint32_t NODE_NUM = 100000;
+  const int THREAD_NUM = 4;
+
+  MapOptions options;
+  options._cache_mode = true;
+  TestMap<> test("CacheBulkLoadMap", NODE_NUM, NODE_NUM / 4, options);
+  IntMap& hash_map = test._map;
+  uint32_t full = test._pool.NodeCount();
+  for (uint32_t i = 0; i < full; ++i) hash_map.Insert(i, i);
+
+  std::vector<uint32_t> keys(NODE_NUM * 2), values(NODE_NUM * 2);
+  for (uint32_t i = 0; i < NODE_NUM * 2; ++i) {
+    keys[i] = i;
+    values[i] = i + 1;
+  }
+  int ret = hash_map.BulkLoad(keys.data(), values.data(), keys.size(), 0,
+                              THREAD_NUM);
+  Check(ret == RET_NO_MEMORY && hash_map.GetCount() == (int)full);
+
+  uint32_t value;
+  for (uint32_t i = 0; i < full; ++i)
+    Check(hash_map.Get(i, value) == RET_OK && (value == i || value == i + 1));
+}
+
+// keys inserted while the table doubles eight times, readers check every key
+// inserted already, GC frees each retired table so the next resize starts
+void ResizeTest() {
+  const uint32_t KEY_NUM = 1000000;
+  const int READ_THREAD = 4;
+
+  TestMap<> test("ResizeMap", KEY_NUM, 1024);
+  IntMap& hash_map = test._map;
+  std::atomic<uint32_t> inserted(0);
+  std::atomic<bool> stop(false);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < READ_THREAD; ++t) {
+    threads.push_back(std::thread([&, t]() {
+      std::default_random_engine engine(t);
+      uint32_t value;
+      while (!stop.load(std::memory_order_relaxed)) {
+        uint32_t num = inserted.load(std::memory_order_acquire);
+        if (num == 0) continue;
+
+        uint32_t key = engine() % num;
+        Check(hash_map.Get(key, value) == RET_OK && value == key * 2 + 1);
+      }
+    }));
+  }
+  threads.push_back(std::thread([&]() {
+    while (!stop.load(std::memory_order_relaxed)) {
+      hash_map.GC();
+      usleep(1000);
+    }
+  }));
+
+  for (uint32_t i = 0; i < KEY_NUM; ++i) {
+    Check(hash_map.Insert(i, i * 2 + 1) == RET_OK);
+    inserted.store(i + 1, std::memory_order_release);
+  }
+  stop = true;
+  for (auto& t : threads) t.join();
+
+  uint32_t value;
+  for (uint32_t i = 0; i < KEY_NUM; ++i)
+    Check(hash_map.Get(i, value) == RET_OK && value == i * 2 + 1);
+  Check(hash_map.GetCount() == (int)KEY_NUM);
+}
+
+// erased keys wait for a reader in the middle of reading and are freed
+// once it left, the slot of a thread died reading is skipped
+void ReaderSlotTest() {
+  const uint32_t KEY_NUM = 10000;
+
+  TestMap<> test("ReaderSlotMap", KEY_NUM, KEY_NUM / 4);
+  IntMap& hash_map = test._map;
+  ReaderTable* readers =
+      test._segment.find<ReaderTable>((test._name + READER_TABLE).c_str())
+          .first;
+  for (uint32_t i = 0; i < KEY_NUM; ++i) hash_map.Insert(i, i);
+
+  // nodes left waiting for readers
+  auto erase = [&](uint32_t begin, uint32_t end) {
+    for (uint32_t i = begin; i < end; ++i) Check(hash_map.Erase(i) == RET_OK);
+    GCProgress progress;
+    hash_map.GC(0, 0, &progress);
+    hash_map.GC(0, 0, &progress);
+    return progress._garbage;
+  };
+
+  std::atomic<int> state(0);
+  std::thread reader([&]() {
+    ReaderGuard guard(readers);
+    state = 1;
+    while (state != 2) usleep(1000);
+  });
+  while (state != 1) usleep(1000);
+  Check(erase(0, KEY_NUM / 2) == KEY_NUM / 2);
+
+  state = 2;
+  reader.join();
+  Check(erase(0, 0) == 0);
+
+  std::thread([&]() { readers->Enter(); }).join();
+  Check(erase(KEY_NUM / 2, KEY_NUM) == 0);
+
+  uint32_t free_num = 0;
+  while (test._pool.Allocate() != NULL) free_num++;
+  Check(hash_map.GetCount() == 0 && free_num == test._pool.NodeCount());
+}
+
+// the pool runs out half way through moving the buckets, an insert evicts
+// from the old buckets instead of finishing the migration
+void EvictMigrateTest() {
+  const uint32_t BUCKET_SIZE = 16384;
+
+  MapOptions options;
+  options._cache_mode = true;
+  // resized at 4 keys a bucket, 4 buckets moved per insert after
+  TestMap<> test("EvictMigrateMap", 4 * BUCKET_SIZE + BUCKET_SIZE / 8,
+                 BUCKET_SIZE, options);
+  IntMap& hash_map = test._map;
+  uint32_t full = test._pool.NodeCount();
+  for (uint32_t i = 0; i <= full; ++i) Check(hash_map.Insert(i, i) == RET_OK);
+
+  GCProgress progress;
+  hash_map.GC(1, 0, &progress);
+  Check(progress._migrate_left > BUCKET_SIZE / 4 &&
+        hash_map.GetCount() < (int)full);
+
+  hash_map.GC();
+  uint32_t value, count = 0;
+  for (uint32_t i = 0; i <= full; ++i) {
+    if (hash_map.Get(i, value) != RET_OK) continue;
+    Check(value == i);
+    count++;
+  }
+  Check(hash_map.Get(full, value) == RET_OK &&
+        count == (uint32_t)hash_map.GetCount());
+}
+#endif
+
+#ifdef STRING_TEST
+// one key rewritten with values of every inline length, readers must never
+// see a value mixed of two
+void UpdateThreadsTest() {
+  const int READ_THREAD = 4, UPDATE_NUM = 200000;
+
+  shared_memory_object::remove("UpdateMap");
+  boost::interprocess::managed_shared_memory managedSharedMemory(
+      create_only, "UpdateMap", 512 * 1024 * 1024);
+  MemoryPool<MyNode> pool("pool", UPDATE_NUM, &managedSharedMemory);
+  MyHashMap hash_map("UpdateTest", &pool, &managedSharedMemory, 1024);
+  hash_map.Insert("key", "b");
+
+  std::atomic<bool> stop(false);
+  std::thread read[READ_THREAD];
+  for (int i = 0; i < READ_THREAD; ++i) {
+    read[i] = std::thread([&]() {
+      string value;
+      while (!stop.load(std::memory_order_relaxed)) {
+        if (hash_map.Get("key", value) != 0 || value.empty() ||
+            value != string(value.size(), 'a' + value.size() % 26)) {
+          cout << "ERROR" << endl;
+          exit(0);
+        }
+      }
+    });
+  }
+
+  for (int i = 0; i < UPDATE_NUM; ++i) {
+    uint32_t size = 1 + i % 64;
+    hash_map.Insert("key", string(size, 'a' + size % 26));
+    if (i % 1000 == 0) hash_map.GC();
+  }
+
+  stop = true;
+  for (int i = 0; i < READ_THREAD; ++i) read[i].join();
+  shared_memory_object::remove("UpdateMap");
+}
+
+// writers racing on one key must leave a single live node of it
+void SameKeyThreadsTest() {
+  const int WRITE_THREAD = 4, UPDATE_NUM = 100000;
+
+  shared_memory_object::remove("SameKeyMap");
+  boost::interprocess::managed_shared_memory managedSharedMemory(
+      create_only, "SameKeyMap", 512 * 1024 * 1024);
+  MemoryPool<MyNode> pool("pool", UPDATE_NUM, &managedSharedMemory);
+  MyHashMap hash_map("SameKeyTest", &pool, &managedSharedMemory, 1024);
+
+  std::thread write[WRITE_THREAD];
+  for (int i = 0; i < WRITE_THREAD; ++i) {
+    write[i] = std::thread([&hash_map, i]() {
+      for (int j = 0; j < UPDATE_NUM; ++j) {
+        uint32_t size = 1 + (i + j) % 64;
+        hash_map.Insert("key", string(size, 'a' + size % 26));
+        if (j % 1000 == 0) hash_map.GC();
+      }
+    });
+  }
+  for (int i = 0; i < WRITE_THREAD; ++i) write[i].join();
+
+  hash_map.GC();
+  hash_map.GC();
+  std::vector<string> keys;
+  hash_map.GetAllKeys(keys);
+  string value;
+  if (hash_map.GetCount() != 1 || keys.size() != 1 ||
+      hash_map.Get("key", value) != 0) {
+    cout << "ERROR" << endl;
+    exit(0);
+  }
+  shared_memory_object::remove("SameKeyMap");
+}
+#endif
+
 int main() {
   cout << MAX_UIN << endl;
 
+#ifdef STRING_TEST
+  SimpleTest();
+
+  UpdateThreadsTest();
+
+  SameKeyThreadsTest();
+#else
+  MagazineTest();
+
+  MagazineDrainTest();
+
+  PrefaultTest();
+
+  FileTest();
+
+  MultiGetTest();
+
+  BulkLoadTest();
+
+  HasherTest();
+
+  WheelTest();
+
+  IncrementalGCTest();
+
+  ParallelGCTest();
+
+  RecoverTest();
+
+  ClockTest();
+
+  CacheTest();
+
+  CacheBulkLoadTest();
+
+  ResizeTest();
+
+  ReaderSlotTest();
+
+  EvictMigrateTest();
+#endif
+
   MultipleThreadsTest();
 
   return 0;
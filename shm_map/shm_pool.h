@@ -2,15 +2,25 @@
 #define SHM_POOL_H
 
 #include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <any>
 #include <atomic>
+#include <boost/interprocess/managed_mapped_file.hpp>
 #include <boost/interprocess/managed_shared_memory.hpp>
 #include <boost/interprocess/offset_ptr.hpp>
-#include <boost/unordered_set.hpp>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
+#include "../common/numa.h"
+
 namespace ShmPool {
 
 template <typename Obj>
@@ -23,9 +33,143 @@ struct MemoryNode {
 #define NodeSize sizeof(Node)
 #define OFFSET_NULL 1
 
+// queued offsets carry the lap of the read index they are for in the high
+// bits, so a reader a lap behind never takes the next lap's offset
+#define OFFSET_MASK ((1ULL << 48) - 1)
+#define LAP_SHIFT 48
+
 const std::string QUEUE = "_queue";
+const std::string MAGAZINE = "_magazine";
+
+const uint32_t MAGAZINE_SLOT_SIZE = 256;  // threads with their own cache
+const uint32_t MAGAZINE_CAPACITY = 64;    // free nodes cached by a thread
+const uint32_t MAGAZINE_BATCH = 32;       // nodes moved from/to the ring
+
 using namespace boost::interprocess;
 
+// owner of a lock or slot in shared memory, pid in high 32 bits, tid in low
+inline uint64_t CurrentOwner() {
+  static thread_local uint64_t owner =
+      ((uint64_t)getpid() << 32) | (uint32_t)syscall(SYS_gettid);
+  return owner;
+}
+
+inline bool OwnerAlive(uint64_t owner) {
+  pid_t pid = owner >> 32, tid = owner & 0xffffffff;
+  return syscall(SYS_tgkill, pid, tid, 0) == 0 || errno != ESRCH;
+}
+
+// the segment pools and maps live in, a managed_shared_memory or a
+// managed_mapped_file, both have the same segment manager and give handles
+// as offsets from the start of the mapping, so a map is the same in either
+class Segment {
+ public:
+  typedef managed_shared_memory::segment_manager Manager;
+  static_assert(
+      std::is_same<Manager, managed_mapped_file::segment_manager>::value,
+      "shared memory and mapped files share the segment manager");
+
+  Segment() : _manager(NULL), _base(NULL) {}
+
+  Segment(managed_shared_memory *segment)
+      : _manager(segment != NULL ? segment->get_segment_manager() : NULL),
+        _base(segment != NULL ? (char *)segment->get_address() : NULL) {}
+
+  Segment(managed_mapped_file *segment)
+      : _manager(segment != NULL ? segment->get_segment_manager() : NULL),
+        _base(segment != NULL ? (char *)segment->get_address() : NULL) {}
+
+  bool Valid() const { return _manager != NULL; }
+
+  Manager *GetManager() { return _manager; }
+
+  // the calls of boost the pools and maps use
+  template <typename T>
+  auto find_or_construct(const char *name) {
+    return _manager->template find_or_construct<T>(name);
+  }
+
+  template <typename T>
+  std::pair<T *, std::size_t> find(const char *name) {
+    return _manager->template find<T>(name);
+  }
+
+  template <typename T>
+  bool destroy(const char *name) {
+    return _manager->template destroy<T>(name);
+  }
+
+  void *allocate(std::size_t size) { return _manager->allocate(size); }
+
+  void *allocate(std::size_t size, const std::nothrow_t &tag) {
+    return _manager->allocate(size, tag);
+  }
+
+  void deallocate(void *ptr) { _manager->deallocate(ptr); }
+
+  uint64_t get_handle_from_address(const void *ptr) const {
+    return (const char *)ptr - _base;
+  }
+
+  void *get_address_from_handle(uint64_t handle) const {
+    return _base + handle;
+  }
+
+ private:
+  Manager *_manager;
+  char *_base;
+};
+
+enum LockRet {
+  LOCK_FAILED = 0,
+  LOCK_OK = 1,
+  LOCK_RECOVERED = 2,  // taken from a dead owner, guarded data may be broken
+};
+
+// spin lock which can be taken back when the owner died
+struct OwnerLock {
+  OwnerLock() { _owner = 0; }
+
+  int TryLock() {
+    uint64_t expected = 0, owner = CurrentOwner();
+    if (_owner.compare_exchange_strong(expected, owner,
+                                       std::memory_order_acq_rel))
+      return LOCK_OK;
+
+    if (expected != owner && !OwnerAlive(expected) &&
+        _owner.compare_exchange_strong(expected, owner,
+                                       std::memory_order_acq_rel))
+      return LOCK_RECOVERED;
+
+    return LOCK_FAILED;
+  }
+
+  void Unlock() { _owner.store(0, std::memory_order_release); }
+
+  std::atomic<uint64_t> _owner;
+};
+
+// free node offsets cached by one thread, _count and _offsets are touched
+// under _lock, which the owner takes for each Allocate and Free and a
+// thread finding the ring empty takes to drain the magazine
+struct Magazine {
+  std::atomic<uint64_t> _owner;  // pid << 32 | tid, 0 - free
+  OwnerLock _lock;
+  uint32_t _count;
+  uint64_t _offsets[MAGAZINE_CAPACITY];
+};
+
+struct MagazineTable {
+  MagazineTable() {
+    for (uint32_t i = 0; i < MAGAZINE_SLOT_SIZE; ++i) {
+      _magazines[i]._owner = 0;
+      _magazines[i]._count = 0;
+    }
+  }
+
+  Magazine _magazines[MAGAZINE_SLOT_SIZE];
+};
+
 struct MemoryMeta {
   MemoryMeta(uint32_t node_size, uint32_t obj_size) {
     _obj_size = obj_size;
@@ -47,40 +191,101 @@ struct MemoryMeta {
   std::atomic<uint64_t> _read_index;
 };
 
+// live nodes of a pool marked for Recover, bit i for node i, Mark may be
+// called by many threads at once
+class NodeBitmap {
+ public:
+  explicit NodeBitmap(uint32_t node_size)
+      : _size(node_size), _words((node_size + 63) / 64, 0) {}
+
+  void Mark(uint32_t index) {
+    __atomic_fetch_or(&_words[index / 64], 1ULL << (index % 64),
+                      __ATOMIC_RELAXED);
+  }
+
+  bool Test(uint32_t index) const {
+    return (_words[index / 64] >> (index % 64)) & 1;
+  }
+
+  // marked in [begin, end), begin is a multiple of 64
+  uint32_t Count(uint32_t begin, uint32_t end) const {
+    uint32_t count = 0;
+    for (uint32_t i = begin; i < end; i += 64) {
+      uint64_t word = _words[i / 64];
+      if (end - i < 64) word &= (1ULL << (end - i)) - 1;
+      count += __builtin_popcountll(word);
+    }
+    return count;
+  }
+
+  uint32_t Size() const { return _size; }
+
+ private:
+  uint32_t _size;
+  std::vector<uint64_t> _words;
+};
+
 template <typename Obj>
 class MemoryPool {
  public:
   MemoryPool() {}
+  // magazine, cache free nodes per thread to avoid the shared indexes,
+  // up to MAGAZINE_CAPACITY nodes a thread are not seen by others until
+  // the ring runs out and they are drained,
+  // numa_node is a node of MapNuma the nodes and the free ring are placed
+  // on when the pool is created, the default of the kernel on a machine of
+  // one node, init_threads threads initialize disjoint ranges of nodes so
+  // a big pool isn't faulted in by one thread
   MemoryPool(std::string name, uint32_t node_size,
-             managed_shared_memory *segment) {
-    assert(segment != NULL);
+             Segment segment, bool magazine = false,
+             int numa_node = MapNuma::NODE_ANY, int init_threads = 1) {
+    assert(segment.Valid());
 
     // two nodes reserved
     node_size += 2;
 
     _node_size = node_size;
     _segment = segment;
-    _meta = _segment->find_or_construct<MemoryMeta>(name.c_str())(node_size,
+    _meta = _segment.find_or_construct<MemoryMeta>(name.c_str())(node_size,
                                                                   NodeSize);
 
     assert(_meta->_node_size == node_size);
     assert(_meta->_obj_size == NodeSize);
 
-    _free_queue = _segment->find_or_construct<uint64_t>(
+    _free_queue = _segment.find_or_construct<uint64_t>(
         (name + QUEUE).c_str())[node_size](OFFSET_NULL);
     if (_meta->_data == 0) {
-      _meta->_data = _segment->allocate(node_size * NodeSize);
+      _meta->_data = _segment.allocate(node_size * NodeSize);
       _data = _meta->_data.get();
 
-      // initialize
-      memset(_data, 0, node_size * NodeSize);
+      // placed before the first touch, which is done on the node
+      MapNuma::Place(_data, (size_t)node_size * NodeSize, numa_node);
+      MapNuma::Place(_free_queue, (size_t)node_size * sizeof(uint64_t),
+                     numa_node);
 
-      for (int i = 0; i < node_size; ++i) {
-        Node *node = (Node *)(_data + NodeSize * i);
-        node->_used = false;
+      // initialize, threads started on the node inherit its cpus
+      auto init = [&](uint32_t begin, uint32_t end) {
+        memset(_data + NodeSize * begin, 0, (size_t)(end - begin) * NodeSize);
 
-        _free_queue[i] = (NodeSize * i);
-      }
+        for (uint32_t i = begin; i < end; ++i) {
+          Node *node = (Node *)(_data + NodeSize * i);
+          node->_used = false;
+
+          _free_queue[i] = (NodeSize * i);
+        }
+      };
+      MapNuma::RunOnNode(numa_node, [&] {
+        if (init_threads < 1) init_threads = 1;
+        uint32_t range = (node_size + init_threads - 1) / init_threads;
+        std::vector<std::thread> threads;
+        for (int t = 1; t < init_threads; ++t) {
+          uint32_t begin = std::min<uint64_t>(node_size, (uint64_t)t * range);
+          uint32_t end = std::min<uint64_t>(node_size, (uint64_t)begin + range);
+          threads.push_back(std::thread(init, begin, end));
+        }
+        init(0, std::min(node_size, range));
+        for (auto &t : threads) t.join();
+      });
 
       _meta->_read_index = 0;
       _meta->_write_index = 0;
@@ -90,22 +295,56 @@ class MemoryPool {
 
     _write_index_ptr = &_meta->_write_index;
     _read_index_ptr = &_meta->_read_index;
+
+    _magazine_table = NULL;
+    if (magazine) {
+      _magazine_table = _segment.find_or_construct<MagazineTable>(
+          (name + MAGAZINE).c_str())();
+    }
   }
 
   Obj *Allocate() {
+    // a magazine being drained is left alone, the ring serves meanwhile
+    Magazine *magazine = LocalMagazine();
+    if (magazine != NULL && magazine->_lock.TryLock() != LOCK_FAILED) {
+      if (magazine->_count == 0)
+        magazine->_count = PopOrDrain(magazine->_offsets, MAGAZINE_BATCH);
+      if (magazine->_count == 0) {
+        magazine->_lock.Unlock();
+        return NULL;
+      }
+
+      uint64_t offset = magazine->_offsets[--magazine->_count];
+      magazine->_lock.Unlock();
+      Node *node = GetNodeByOffset(offset);
+      node->_used = true;
+      return &node->_data;
+    }
+
     // TIP: there is risk uint64 overflow causing index error,
     // however it takes nearly 2W years if allocating at 3kw/qps
-    uint64_t index =
-        _read_index_ptr->fetch_add(1, std::memory_order_acq_rel) % _node_size;
-    if (_free_queue[index] == OFFSET_NULL) return NULL;
-
-    Node *node = GetNodeByOffset(_free_queue[index]);
-    _free_queue[index] = OFFSET_NULL;
+    uint64_t offset;
+    if (PopOrDrain(&offset, 1) == 0) return NULL;
 
+    Node *node = GetNodeByOffset(offset);
     node->_used = true;
     return &node->_data;
   }
 
+  // take up to n nodes with one update of the read index,
+  // return the number taken
+  uint32_t AllocateBatch(Obj **objs, uint32_t n) {
+    std::vector<uint64_t> offsets(n);
+    uint32_t take = PopOrDrain(offsets.data(), n);
+
+    for (uint32_t i = 0; i < take; ++i) {
+      Node *node = GetNodeByOffset(offsets[i]);
+      node->_used = true;
+      objs[i] = &node->_data;
+    }
+    return take;
+  }
+
   void Free(Obj *ptr) {
     // TODO: resume if crash when free
     Node *node = GetNodeByObj(ptr);
@@ -113,12 +352,23 @@ class MemoryPool {
 
     node->_used = false;
     uint64_t node_offset = GetOffsetByNode(node);
-    int index =
-        _write_index_ptr->fetch_add(1, std::memory_order_acq_rel) % _node_size;
-    // check double free
-    assert(_write_index_ptr->load(std::memory_order_consume) <=
-           _read_index_ptr->load(std::memory_order_consume));
-    _free_queue[index] = node_offset;
+
+    Magazine *magazine = LocalMagazine();
+    if (magazine != NULL && magazine->_lock.TryLock() != LOCK_FAILED) {
+      if (magazine->_count == MAGAZINE_CAPACITY) {
+        magazine->_count -= MAGAZINE_BATCH;
+        PushOffsets(&magazine->_offsets[magazine->_count], MAGAZINE_BATCH);
+      }
+
+      // count is moved after the store, a crash leaks the node until
+      // Recover
+      magazine->_offsets[magazine->_count] = node_offset;
+      magazine->_count++;
+      magazine->_lock.Unlock();
+      return;
+    }
+
+    PushOffsets(&node_offset, 1);
   }
 
   Obj *GetObjByOffset(uint64_t offset) {
@@ -131,33 +381,229 @@ class MemoryPool {
 
   uint64_t GetOffsetByObj(Obj *ptr) { return (char *)ptr - (char *)_data; }
 
-  // only check for restart
-  void SyncMemory(boost::unordered_set<Obj *> &obj_set) {
-    void *check_ptr = _data;
+  // nodes the pool was created with
+  uint32_t Capacity() { return _meta->_node_size - 2; }
+
+  // warm the node up before GetObjByOffset touches it
+  void Prefetch(uint64_t offset) {
+    if (offset != OFFSET_NULL) __builtin_prefetch((char *)_data + offset);
+  }
+
+  // give nodes cached by dead threads back to the ring, with live those
+  // cached by living threads as well, magazines in use right now and the
+  // one of this thread are skipped
+  void ReclaimMagazines(bool live = false) {
+    if (_magazine_table == NULL) return;
+
+    for (uint32_t i = 0; i < MAGAZINE_SLOT_SIZE; ++i) {
+      Magazine &magazine = _magazine_table->_magazines[i];
+      uint64_t owner = magazine._owner.load(std::memory_order_acquire);
+      if (owner == 0 || (!live && OwnerAlive(owner)) ||
+          magazine._lock.TryLock() == LOCK_FAILED)
+        continue;
+
+      // count is cleared first, a crash leaks the nodes until Recover
+      uint32_t count = magazine._count;
+      magazine._count = 0;
+      PushOffsets(magazine._offsets, count);
+
+      // the slot of a dead thread is free again, unless taken over
+      // meanwhile
+      if (!OwnerAlive(owner))
+        magazine._owner.compare_exchange_strong(owner, 0,
+                                                std::memory_order_acq_rel);
+      magazine._lock.Unlock();
+    }
+  }
 
-    boost::unordered_set<Node *> free_set;
-    uint64_t index = _read_index_ptr->load(std::memory_order_consume),
-             count = 0;
-    while (_free_queue[index % _node_size] != OFFSET_NULL &&
-           count++ < _node_size) {
-      free_set.insert(GetNodeByOffset(_free_queue[index++ % _node_size]));
+  // nodes the pool holds, the two reserved included, the size of a
+  // NodeBitmap of the pool
+  uint32_t NodeCount() { return _node_size; }
+
+  // index of the node of an offset given by GetOffsetByObj
+  uint32_t NodeIndex(uint64_t offset) { return offset / NodeSize; }
+
+  // restart after a crash, no process may use the pool meanwhile, the
+  // nodes marked in live are kept and every other one is free, the free
+  // ring is rebuilt in one sweep of thread_num threads over disjoint node
+  // ranges, release(Obj *) is called for nodes in use but not marked,
+  // magazines are emptied, return the number of free nodes
+  template <typename Release>
+  uint32_t Recover(const NodeBitmap &live, int thread_num, Release &&release) {
+    assert(live.Size() >= _node_size);
+
+    if (_magazine_table != NULL) {
+      for (uint32_t i = 0; i < MAGAZINE_SLOT_SIZE; ++i) {
+        _magazine_table->_magazines[i]._count = 0;
+        _magazine_table->_magazines[i]._owner = 0;
+        _magazine_table->_magazines[i]._lock.Unlock();
+      }
     }
 
-    for (int i = 0; i < _node_size; ++i) {
-      Node *node = (Node *)(_data + NodeSize * i);
-      if (node->_used) {
-        if (obj_set.find(&node->_data) == obj_set.end()) {
-          Free(&node->_data);
+    /* ranges of whole bitmap words, free nodes of range t fill the ring
+       from read + bases[t], slots before read are taken, the laps of the
+       ring start over:
+         read = _node_size - free nodes, write = 0
+    */
+    if (thread_num < 1) thread_num = 1;
+    uint32_t words = (_node_size + 63) / 64;
+    uint32_t range = (words + thread_num - 1) / thread_num * 64;
+    std::vector<uint64_t> bases(thread_num + 1, 0);
+    for (int t = 0; t < thread_num; ++t) {
+      uint32_t begin = std::min<uint64_t>(_node_size, (uint64_t)t * range);
+      uint32_t end = std::min<uint64_t>(_node_size, (uint64_t)begin + range);
+      bases[t + 1] = bases[t] + (end - begin) - live.Count(begin, end);
+    }
+    uint64_t read = _node_size - bases[thread_num];
+
+    auto sweep = [&](int t) {
+      uint32_t begin = std::min<uint64_t>(_node_size, (uint64_t)t * range);
+      uint32_t end = std::min<uint64_t>(_node_size, (uint64_t)begin + range);
+      uint64_t index = read + bases[t];
+
+      for (uint32_t i = begin; i < end; ++i) {
+        Node *node = (Node *)(_data + NodeSize * i);
+        if (live.Test(i)) {
+          node->_used = true;
+          continue;
         }
-      } else {
-        if (free_set.find(node) == free_set.end()) {
-          Free(&node->_data);
+
+        if (node->_used) {
+          release(&node->_data);
+          node->_used = false;
         }
+        _free_queue[index++] = NodeSize * i;
       }
-    }
+
+      for (uint64_t i = begin; i < std::min<uint64_t>(end, read); ++i)
+        _free_queue[i] = OFFSET_NULL;
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < thread_num; ++t)
+      threads.push_back(std::thread(sweep, t));
+    sweep(0);
+    for (auto &t : threads) t.join();
+
+    _read_index_ptr->store(read, std::memory_order_release);
+    _write_index_ptr->store(0, std::memory_order_release);
+    return bases[thread_num];
   }
 
  private:
+  // the ring is empty, nodes may be left in magazines of dead or living
+  // threads, which are drained before giving up
+  uint32_t PopOrDrain(uint64_t *offsets, uint32_t n) {
+    uint32_t take = PopOffsets(offsets, n);
+    if (take != 0 || _magazine_table == NULL) return take;
+
+    ReclaimMagazines(true);
+    return PopOffsets(offsets, n);
+  }
+
+  // take up to n free offsets from the ring with one update of the read
+  // index, return the number taken
+  uint32_t PopOffsets(uint64_t *offsets, uint32_t n) {
+    uint64_t read = _read_index_ptr->load(std::memory_order_acquire), take;
+    do {
+      int64_t used =
+          read - _write_index_ptr->load(std::memory_order_acquire);
+      take = used >= _node_size ? 0 : std::min<uint64_t>(n, _node_size - used);
+      if (take == 0) return 0;
+    } while (!_read_index_ptr->compare_exchange_weak(
+        read, read + take, std::memory_order_acq_rel));
+
+    for (uint64_t i = 0; i < take; ++i) {
+      uint64_t *slot = &_free_queue[(read + i) % _node_size];
+      uint64_t lap = (read + i) / _node_size << LAP_SHIFT, value;
+
+      // write index is moved before the offset is stored, so wait
+      while ((value = __atomic_load_n(slot, __ATOMIC_ACQUIRE)) == OFFSET_NULL ||
+             (value & ~OFFSET_MASK) != lap) {
+        sched_yield();
+      }
+
+      offsets[i] = value & OFFSET_MASK;
+      __atomic_store_n(slot, OFFSET_NULL, __ATOMIC_RELEASE);
+    }
+    return take;
+  }
+
+  // give n free offsets back to the ring with one update of the write index
+  void PushOffsets(const uint64_t *offsets, uint32_t n) {
+    if (n == 0) return;
+
+    uint64_t write = _write_index_ptr->fetch_add(n, std::memory_order_acq_rel);
+    // check double free
+    assert(write + n <= _read_index_ptr->load(std::memory_order_consume));
+
+    for (uint32_t i = 0; i < n; ++i) {
+      uint64_t *slot = &_free_queue[(write + i) % _node_size];
+      uint64_t lap = (write + i + _node_size) / _node_size << LAP_SHIFT;
+
+      // a reader of the last lap may not have taken its offset yet
+      while (__atomic_load_n(slot, __ATOMIC_ACQUIRE) != OFFSET_NULL)
+        sched_yield();
+
+      __atomic_store_n(slot, offsets[i] | lap, __ATOMIC_RELEASE);
+    }
+  }
+
+  Magazine *LocalMagazine() {
+    if (_magazine_table == NULL) return NULL;
+
+    // magazines owned by this thread, one for each attached pool
+    static thread_local std::vector<std::pair<MagazineTable *, Magazine *>>
+        local_magazines;
+
+    uint64_t owner = CurrentOwner();
+    for (auto &local : local_magazines) {
+      if (local.first == _magazine_table) {
+        // NULL if no magazine was left, the thread keeps using the ring
+        if (local.second == NULL ||
+            local.second->_owner.load(std::memory_order_relaxed) == owner)
+          return local.second;
+
+        // segment was remapped at the same address
+        local.second = AcquireMagazine(owner);
+        return local.second;
+      }
+    }
+
+    local_magazines.push_back(
+        std::make_pair(_magazine_table, AcquireMagazine(owner)));
+    return local_magazines.back().second;
+  }
+
+  Magazine *AcquireMagazine(uint64_t owner) {
+    uint32_t start = (owner * 0x9E3779B97F4A7C15ULL) >> 32;
+
+    // free magazine or the one left by a dead thread with the same tid
+    for (uint32_t i = 0; i < MAGAZINE_SLOT_SIZE; ++i) {
+      Magazine &magazine =
+          _magazine_table->_magazines[(start + i) % MAGAZINE_SLOT_SIZE];
+      uint64_t expected = 0;
+      if (magazine._owner.load(std::memory_order_relaxed) == owner ||
+          magazine._owner.compare_exchange_strong(expected, owner,
+                                                  std::memory_order_acq_rel))
+        return &magazine;
+    }
+
+    // take over a magazine whose owner died, cached nodes come with it
+    for (uint32_t i = 0; i < MAGAZINE_SLOT_SIZE; ++i) {
+      Magazine &magazine =
+          _magazine_table->_magazines[(start + i) % MAGAZINE_SLOT_SIZE];
+      uint64_t expected = magazine._owner.load(std::memory_order_acquire);
+      if (!OwnerAlive(expected) &&
+          magazine._owner.compare_exchange_strong(expected, owner,
+                                                  std::memory_order_acq_rel))
+        return &magazine;
+    }
+
+    // all magazines are in use by living threads, go to the ring
+    return NULL;
+  }
+
   Node *GetNodeByOffset(uint64_t offset) {
     offset = (offset / NodeSize) * NodeSize;
     return (Node *)(_data + offset);
@@ -176,7 +622,7 @@ class MemoryPool {
   }
 
   MemoryMeta *_meta;
-  managed_shared_memory *_segment;
+  Segment _segment;
 
   void *_data;
 
@@ -185,6 +631,8 @@ class MemoryPool {
   uint64_t *_free_queue;
   std::atomic<uint64_t> *_write_index_ptr;
   std::atomic<uint64_t> *_read_index_ptr;
+
+  MagazineTable *_magazine_table;
 };
 
 #undef Node
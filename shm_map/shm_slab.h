@@ -0,0 +1,208 @@
+#ifndef SHM_SLAB_H
+#define SHM_SLAB_H
+
+#include <assert.h>
+#include <sched.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <string>
+
+#include "./shm_pool.h"
+
+namespace ShmPool {
+
+/*
+  size-class allocator for variable-length blobs in shared memory:
+    - 16B to 64KB, 16B steps up to 64B, then 4 classes per power of two,
+      so at most 20% of a blob is wasted
+    - blobs are referenced by offsets from the segment base, valid in every
+      process mapping the segment
+    - every class keeps a lock-free stack of free blobs, the next offset is
+      stored in the free blob itself
+    - memory is carved from the segment in chunks and never given back
+    - Free takes the size given to Allocate, blobs have no header
+*/
+
+const std::string SLAB_META = "_slab_meta";
+
+const uint32_t SLAB_MIN_SIZE = 16;
+const uint32_t SLAB_MAX_SIZE = 64 * 1024;
+const uint32_t SLAB_CLASS_NUM = 44;
+const uint32_t SLAB_CHUNK_SIZE = 64 * 1024;  // at least, carved at a time
+const uint32_t SLAB_CHUNK_BLOBS = 4;         // at least, carved at a time
+
+// free list head, offset in low bits, ABA tag in high bits
+const uint32_t SLAB_OFFSET_BITS = 40;
+const uint64_t SLAB_OFFSET_MASK = (1ULL << SLAB_OFFSET_BITS) - 1;
+
+inline uint32_t SlabClass(uint32_t size) {
+  if (size <= 64) return size == 0 ? 0 : (size - 1) / 16;
+
+  uint32_t shift = 31 - __builtin_clz(size - 1);
+  return (shift - 5) * 4 + ((size - 1) >> (shift - 2)) - 4;
+}
+
+inline uint32_t SlabClassSize(uint32_t index) {
+  if (index < 4) return SLAB_MIN_SIZE * (index + 1);
+
+  uint32_t shift = 6 + (index - 4) / 4;
+  return (1u << shift) + (1u << (shift - 2)) * ((index - 4) % 4 + 1);
+}
+
+struct SlabClassMeta {
+  uint32_t _size;
+  std::atomic<uint64_t> _free_head;
+  std::atomic<uint64_t> _blob_count;  // carved from the segment
+  std::atomic<uint64_t> _used_count;
+  OwnerLock _grow_lock;
+};
+
+struct SlabMeta {
+  SlabMeta() {
+    for (uint32_t i = 0; i < SLAB_CLASS_NUM; ++i) {
+      _classes[i]._size = SlabClassSize(i);
+      _classes[i]._free_head = OFFSET_NULL;
+      _classes[i]._blob_count = 0;
+      _classes[i]._used_count = 0;
+    }
+  }
+
+  SlabClassMeta _classes[SLAB_CLASS_NUM];
+};
+
+class SlabPool {
+ public:
+  SlabPool() {}
+  SlabPool(std::string name, Segment segment) {
+    assert(segment.Valid());
+
+    _segment = segment;
+    _meta =
+        _segment.find_or_construct<SlabMeta>((name + SLAB_META).c_str())();
+  }
+
+  // OFFSET_NULL if size is too large or the segment is full
+  uint64_t Allocate(uint32_t size) {
+    if (size > SLAB_MAX_SIZE) return OFFSET_NULL;
+
+    SlabClassMeta &meta = _meta->_classes[SlabClass(size)];
+    while (true) {
+      uint64_t offset = Pop(meta);
+      if (offset != OFFSET_NULL) {
+        meta._used_count.fetch_add(1, std::memory_order_relaxed);
+        return offset;
+      }
+
+      int ret = meta._grow_lock.TryLock();
+      if (ret == LOCK_FAILED) {
+        // others are carving a chunk
+        sched_yield();
+        continue;
+      }
+
+      // freed while waiting for the lock
+      offset = Pop(meta);
+      if (offset == OFFSET_NULL) offset = Grow(meta);
+      meta._grow_lock.Unlock();
+
+      if (offset != OFFSET_NULL)
+        meta._used_count.fetch_add(1, std::memory_order_relaxed);
+      return offset;
+    }
+  }
+
+  // size must be the one given to Allocate
+  void Free(uint64_t offset, uint32_t size) {
+    if (offset == OFFSET_NULL) return;
+
+    SlabClassMeta &meta = _meta->_classes[SlabClass(size)];
+    meta._used_count.fetch_sub(1, std::memory_order_relaxed);
+    Push(meta, offset, offset);
+  }
+
+  void *GetPtr(uint64_t offset) {
+    if (offset == OFFSET_NULL) return NULL;
+    return _segment.get_address_from_handle(offset);
+  }
+
+  uint64_t GetOffset(const void *ptr) {
+    if (ptr == NULL) return OFFSET_NULL;
+    return _segment.get_handle_from_address(ptr);
+  }
+
+  // bytes held by blobs in use, and bytes carved from the segment
+  void GetStat(uint64_t &used_bytes, uint64_t &total_bytes) {
+    used_bytes = total_bytes = 0;
+    for (uint32_t i = 0; i < SLAB_CLASS_NUM; ++i) {
+      SlabClassMeta &meta = _meta->_classes[i];
+      used_bytes += meta._used_count.load(std::memory_order_relaxed) *
+                    meta._size;
+      total_bytes += meta._blob_count.load(std::memory_order_relaxed) *
+                     meta._size;
+    }
+  }
+
+ private:
+  uint64_t &NextOf(uint64_t offset) {
+    return *(uint64_t *)_segment.get_address_from_handle(offset);
+  }
+
+  uint64_t Pop(SlabClassMeta &meta) {
+    uint64_t head = meta._free_head.load(std::memory_order_acquire);
+    while (true) {
+      uint64_t offset = head & SLAB_OFFSET_MASK;
+      if (offset == OFFSET_NULL) return OFFSET_NULL;
+
+      // blob may be taken and written by others, the tag fails the cas then
+      uint64_t next = __atomic_load_n(&NextOf(offset), __ATOMIC_RELAXED);
+      uint64_t tag = (head >> SLAB_OFFSET_BITS) + 1;
+      if (meta._free_head.compare_exchange_weak(
+              head, (tag << SLAB_OFFSET_BITS) | next,
+              std::memory_order_acq_rel))
+        return offset;
+    }
+  }
+
+  // push the chain first -> ... -> last
+  void Push(SlabClassMeta &meta, uint64_t first, uint64_t last) {
+    uint64_t head = meta._free_head.load(std::memory_order_acquire);
+    while (true) {
+      __atomic_store_n(&NextOf(last), head & SLAB_OFFSET_MASK,
+                       __ATOMIC_RELAXED);
+      uint64_t tag = (head >> SLAB_OFFSET_BITS) + 1;
+      if (meta._free_head.compare_exchange_weak(
+              head, (tag << SLAB_OFFSET_BITS) | first,
+              std::memory_order_acq_rel))
+        return;
+    }
+  }
+
+  // carve a chunk, keep the first blob and free the others,
+  // caller holds the grow lock
+  uint64_t Grow(SlabClassMeta &meta) {
+    uint32_t count =
+        std::max(SLAB_CHUNK_SIZE / meta._size, SLAB_CHUNK_BLOBS);
+    char *chunk = (char *)_segment.allocate(count * meta._size, std::nothrow);
+    if (chunk == NULL) return OFFSET_NULL;
+
+    uint64_t first = GetOffset(chunk);
+    assert(first + count * meta._size <= SLAB_OFFSET_MASK);
+
+    for (uint32_t i = 1; i + 1 < count; ++i)
+      NextOf(first + i * meta._size) = first + (i + 1) * meta._size;
+
+    meta._blob_count.fetch_add(count, std::memory_order_relaxed);
+    if (count > 1)
+      Push(meta, first + meta._size, first + (count - 1) * meta._size);
+    return first;
+  }
+
+  SlabMeta *_meta;
+  Segment _segment;
+};
+
+}  // namespace ShmPool
+#endif  // SHM_SLAB_H
@@ -0,0 +1,92 @@
+#include "./shm_slab.h"
+
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace boost::interprocess;
+using namespace ShmPool;
+
+const int THREAD_NUM = 4;
+const int BLOB_NUM = 20000;
+const int ROUND = 4;
+
+struct Blob {
+  uint64_t offset;
+  uint32_t size;
+};
+
+bool Check(SlabPool &pool, const Blob &blob) {
+  unsigned char *ptr = (unsigned char *)pool.GetPtr(blob.offset);
+  for (uint32_t i = 0; i < blob.size; ++i) {
+    if (ptr[i] != (unsigned char)(blob.offset + i)) return false;
+  }
+  return true;
+}
+
+void Fill(SlabPool &pool, const Blob &blob) {
+  unsigned char *ptr = (unsigned char *)pool.GetPtr(blob.offset);
+  for (uint32_t i = 0; i < blob.size; ++i)
+    ptr[i] = (unsigned char)(blob.offset + i);
+}
+
+int main() {
+  for (uint32_t size = 0; size <= SLAB_MAX_SIZE; ++size) {
+    uint32_t index = SlabClass(size);
+    if (SlabClassSize(index) < size ||
+        (index > 0 && SlabClassSize(index - 1) >= size)) {
+      cout << "ERROR class of " << size << endl;
+      return 0;
+    }
+  }
+
+  shared_memory_object::remove("MySlabMemory");
+  managed_shared_memory segment(create_only, "MySlabMemory",
+                                1024 * 1024 * 1024);
+  SlabPool pool("slab", &segment);
+
+  vector<thread> threads;
+  for (int t = 0; t < THREAD_NUM; ++t) {
+    threads.push_back(thread([&pool, t]() {
+      default_random_engine engine(t);
+      vector<Blob> blobs(BLOB_NUM);
+
+      for (int r = 0; r < ROUND; ++r) {
+        for (auto &blob : blobs) {
+          // mostly small blobs, a few large ones
+          blob.size = engine() % 8 ? engine() % 256 : engine() % SLAB_MAX_SIZE;
+          blob.offset = pool.Allocate(blob.size);
+          Fill(pool, blob);
+        }
+
+        for (auto &blob : blobs) {
+          if (!Check(pool, blob)) {
+            cout << "ERROR blob " << blob.offset << endl;
+            exit(0);
+          }
+          pool.Free(blob.offset, blob.size);
+        }
+      }
+    }));
+  }
+  for (auto &t : threads) t.join();
+
+  // memory freed by others is reused
+  vector<Blob> blobs(BLOB_NUM);
+  uint64_t requested = 0, used_bytes, total_bytes;
+  for (auto &blob : blobs) {
+    blob.size = 16 + rand() % 1024;
+    blob.offset = pool.Allocate(blob.size);
+    requested += blob.size;
+  }
+  pool.GetStat(used_bytes, total_bytes);
+
+  cout << "requested: " << requested << " used: " << used_bytes
+       << " carved: " << total_bytes << endl;
+
+  shared_memory_object::remove("MySlabMemory");
+  return 0;
+}
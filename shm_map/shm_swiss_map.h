@@ -0,0 +1,524 @@
+#ifndef SHM_SWISS_MAP_H
+#define SHM_SWISS_MAP_H
+
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <type_traits>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "../common/clock.h"
+#include "../common/hash.h"
+#include "./shm_map.h"
+
+namespace ShmMap {
+
+/*
+  open addressing engine for shared memory:
+    - slots are grouped by GROUP_WIDTH, every slot has one control byte
+    - control byte keeps 7 bits of hash (H2) if the slot is full, so a group
+      is probed by one SSE2 compare instead of walking a chain
+    - groups are probed in triangular order, every group counts the keys
+      passed it to a later group (overflow), lookup stops at the first group
+      with no overflow
+    - GC turns an expired slot empty at once and takes its key off the
+      overflow of the groups before it, no tombstone is left, so probes stay
+      short however many keys come and go
+    - slot content is guarded by a version (seqlock), readers never write
+    - Hasher and Clock are the policies of ShmHashMap, expiries are
+      milliseconds of the clock page shared with the maps of the segment
+*/
+
+const std::string SWISS_META = "_swiss_meta";
+const std::string SWISS_CTRL = "_swiss_ctrl";
+const std::string SWISS_SLOT = "_swiss_slot";
+
+const uint32_t GROUP_WIDTH = 16;
+
+const uint8_t CTRL_EMPTY = 0x80;
+const uint8_t CTRL_BUSY = 0xFF;  // claimed by a writer, not published yet
+
+struct SwissMeta {
+  SwissMeta(uint32_t group_size) {
+    _group_size = group_size;
+    _count = 0;
+    _gc_timestamp = 0;
+  }
+
+  uint32_t _group_size;
+  std::atomic<uint32_t> _count;
+  std::atomic<int64_t> _gc_timestamp;  // milliseconds
+};
+
+struct SwissGroup {
+  uint8_t _ctrl[GROUP_WIDTH];
+  uint32_t _overflow;  // keys placed beyond this group by probing
+
+  SwissGroup() {
+    memset(_ctrl, CTRL_EMPTY, sizeof(_ctrl));
+    _overflow = 0;
+  }
+
+  // bit i is set if _ctrl[i] == tag
+  uint32_t Match(uint8_t tag) const {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)_ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < GROUP_WIDTH; ++i)
+      if (__atomic_load_n(&_ctrl[i], __ATOMIC_RELAXED) == tag) mask |= 1u << i;
+    return mask;
+#endif
+  }
+
+  uint32_t MatchEmpty() const { return Match(CTRL_EMPTY); }
+
+  // full slots have the highest bit clear
+  uint32_t MatchFull() const {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)_ctrl);
+    return ~_mm_movemask_epi8(ctrl) & 0xFFFF;
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < GROUP_WIDTH; ++i)
+      if (!(__atomic_load_n(&_ctrl[i], __ATOMIC_RELAXED) & 0x80))
+        mask |= 1u << i;
+    return mask;
+#endif
+  }
+
+  uint8_t Load(uint32_t i) const {
+    return __atomic_load_n(&_ctrl[i], __ATOMIC_ACQUIRE);
+  }
+
+  void Store(uint32_t i, uint8_t ctrl) {
+    __atomic_store_n(&_ctrl[i], ctrl, __ATOMIC_RELEASE);
+  }
+
+  bool Claim(uint32_t i, uint8_t expected) {
+    return __atomic_compare_exchange_n(&_ctrl[i], &expected, CTRL_BUSY, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  }
+
+  bool Overflowed() const {
+    return __atomic_load_n(&_overflow, __ATOMIC_ACQUIRE) != 0;
+  }
+
+  void AddOverflow(int32_t delta) {
+    __atomic_fetch_add(&_overflow, delta, __ATOMIC_ACQ_REL);
+  }
+};
+
+template <typename Key, typename Value>
+struct SwissSlot {
+  std::atomic<uint32_t> _version;  // odd - writing
+  volatile int64_t _expire;  // milliseconds of the clock, 0 for never
+  Key _key;
+  Value _value;
+
+  SwissSlot() {
+    _version = 0;
+    _expire = 0;
+  }
+};
+
+#define Slot SwissSlot<Key, Value>
+
+// Hasher is one of MapHash, the default calls the virtual HashCode,
+// Clock is one of MapClock, CoarseClock reads the clock page of the segment
+template <typename Key, typename Value,
+          typename Hasher = MapHash::VirtualHasher,
+          typename Clock = MapClock::SystemClock>
+class ShmSwissMap : public MapHash::HashAdapter<Key, Hasher> {
+  static_assert(std::is_trivially_copyable<Key>::value &&
+                    std::is_trivially_copyable<Value>::value,
+                "slots are copied optimistically, Key/Value must be POD");
+
+ public:
+  // capacity is only used when the map is created, reattach keeps the
+  // capacity stored in the segment, shared memory or a MappedFile
+  explicit ShmSwissMap(std::string name, ShmPool::Segment segment,
+                       uint32_t capacity = DEBFAULT_BUCKET_SIZE);
+
+  virtual ~ShmSwissMap();
+
+  // expire in seconds, 0 for never
+  int Insert(const Key &key, const Value &value, int expire = 0);
+
+  // expire in milliseconds
+  int InsertMs(const Key &key, const Value &value, int64_t expire_ms);
+
+  int Get(const Key &key, Value &value);
+
+  int GetCount();
+
+  int GetAllValues(std::vector<Value> &values);
+
+  int GetAllKeys(std::vector<Key> &keys);
+
+  void GC();
+
+ protected:
+  using MapHash::HashAdapter<Key, Hasher>::Hash;
+
+ private:
+  enum ReadRet {
+    READ_MISMATCH = 0,
+    READ_MATCH = 1,
+    READ_EXPIRED = 2,
+  };
+
+  void Scan();
+
+  // Hash spread over 64 bits
+  uint64_t ProbeHash(const Key &key);
+
+  int64_t FindSlot(const Key &key, uint64_t hash);
+
+  int ReadSlot(uint64_t pos, const Key &key, Value *value);
+
+  int ClaimSlot(uint64_t hash, uint64_t *pos);
+
+  // add delta to the overflow of the first steps groups probed for hash
+  void AddOverflow(uint64_t hash, uint32_t steps, int32_t delta);
+
+  bool LockSlot(Slot &slot, uint32_t *version);
+
+  bool IsExpired(int64_t expire) {
+    return expire != 0 && expire < _clock.NowMs();
+  }
+
+  SwissMeta *_meta;
+  SwissGroup *_groups;
+  Slot *_slots;
+
+  uint32_t _group_mask;
+  uint32_t _max_count;
+
+  Clock _clock;
+
+  ShmPool::Segment _segment;
+  std::string _name;
+};
+
+// implements
+template <typename Key, typename Value, typename Hasher, typename Clock>
+ShmSwissMap<Key, Value, Hasher, Clock>::ShmSwissMap(
+    std::string name, ShmPool::Segment segment, uint32_t capacity) {
+  if (capacity == 0) capacity = DEBFAULT_BUCKET_SIZE;
+
+  // keep load factor under 7/8, group size is power of 2
+  uint64_t need = ((uint64_t)capacity * 8 / 7 + GROUP_WIDTH - 1) / GROUP_WIDTH;
+  uint32_t group_size = 1;
+  while (group_size < need) group_size <<= 1;
+
+  _segment = segment;
+  _name = name;
+
+  _meta = _segment.find_or_construct<SwissMeta>((name + SWISS_META).c_str())(
+      group_size);
+  group_size = _meta->_group_size;
+
+  _groups = _segment.find_or_construct<SwissGroup>(
+      (name + SWISS_CTRL).c_str())[group_size]();
+  _slots = _segment.find_or_construct<Slot>(
+      (name + SWISS_SLOT).c_str())[group_size * GROUP_WIDTH]();
+
+  _group_mask = group_size - 1;
+  _max_count = (uint64_t)group_size * GROUP_WIDTH * 7 / 8;
+
+  _clock.Attach(_segment.find_or_construct<MapClock::ClockPage>(
+      CLOCK_PAGE.c_str())());
+}
+
+template <typename Key, typename Value, typename Hasher, typename Clock>
+ShmSwissMap<Key, Value, Hasher, Clock>::~ShmSwissMap() {}
+
+template <typename Key, typename Value, typename Hasher, typename Clock>
+uint64_t ShmSwissMap<Key, Value, Hasher, Clock>::ProbeHash(const Key &key) {
+  // H2 takes the low 7 bits and H1 the rest, so weak hash codes still
+  // fill the control bytes
+  uint64_t hash = (uint64_t)Hash(key) * 0x9E3779B97F4A7C15ULL;
+  return hash ^ (hash >> 32);
+}
+
+template <typename Key, typename Value, typename Hasher, typename Clock>
+int ShmSwissMap<Key, Value, Hasher, Clock>::ReadSlot(uint64_t pos,
+                                                     const Key &key,
+                                                     Value *value) {
+  Slot &slot = _slots[pos];
+
+  while (true) {
+    uint32_t version = slot._version.load(std::memory_order_acquire);
+    if (version & 1) continue;  // writing occur, so wait
+
+    bool match = slot._key == key;
+    int64_t expire = slot._expire;
+    if (match && value != NULL) *value = slot._value;
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot._version.load(std::memory_order_relaxed) != version) continue;
+
+    if (!match) return READ_MISMATCH;
+    return IsExpired(expire) ? READ_EXPIRED : READ_MATCH;
+  }
+}
+
+template <typename Key, typename Value, typename Hasher, typename Clock>
+int64_t ShmSwissMap<Key, Value, Hasher, Clock>::FindSlot(const Key &key,
+                                                         uint64_t hash) {
+  uint8_t h2 = hash & 0x7F;
+  uint32_t group = (hash >> 7) & _group_mask;
+
+  for (uint32_t step = 0; step <= _group_mask; ++step) {
+    SwissGroup &g = _groups[group];
+
+    uint32_t match = g.Match(h2);
+    while (match) {
+      uint32_t i = __builtin_ctz(match);
+      uint64_t pos = (uint64_t)group * GROUP_WIDTH + i;
+      if (ReadSlot(pos, key, NULL) != READ_MISMATCH) return pos;
+      match &= match - 1;
+    }
+
+    if (!g.Overflowed()) return -1;
+    group = (group + step + 1) & _group_mask;
+  }
+
+  return -1;
+}
+
+template <typename Key, typename Value, typename Hasher, typename Clock>
+int ShmSwissMap<Key, Value, Hasher, Clock>::ClaimSlot(uint64_t hash,
+                                                      uint64_t *pos) {
+  if (_meta->_count.load(std::memory_order_acquire) >= _max_count)
+    return RET_NO_MEMORY;
+
+  /* steps:
+      1. claim an empty slot of the group, done
+      2. the group is full, count the key as its overflow before moving on,
+         a reader meeting the key later must not stop at this group
+      3. nothing claimed in the whole table, take the counts back
+  */
+  uint32_t group = (hash >> 7) & _group_mask;
+  for (uint32_t step = 0; step <= _group_mask; ++step) {
+    SwissGroup &g = _groups[group];
+
+    uint32_t match = g.MatchEmpty();
+    while (match) {
+      uint32_t i = __builtin_ctz(match);
+      if (g.Claim(i, CTRL_EMPTY)) {
+        *pos = (uint64_t)group * GROUP_WIDTH + i;
+        return RET_OK;
+      }
+      match &= match - 1;
+    }
+
+    g.AddOverflow(1);
+    group = (group + step + 1) & _group_mask;
+  }
+
+  AddOverflow(hash, _group_mask + 1, -1);
+  return RET_NO_MEMORY;
+}
+
+template <typename Key, typename Value, typename Hasher, typename Clock>
+void ShmSwissMap<Key, Value, Hasher, Clock>::AddOverflow(uint64_t hash,
+                                                         uint32_t steps,
+                                                         int32_t delta) {
+  uint32_t group = (hash >> 7) & _group_mask;
+  for (uint32_t step = 0; step < steps; ++step) {
+    _groups[group].AddOverflow(delta);
+    group = (group + step + 1) & _group_mask;
+  }
+}
+
+template <typename Key, typename Value, typename Hasher, typename Clock>
+bool ShmSwissMap<Key, Value, Hasher, Clock>::LockSlot(Slot &slot,
+                                                      uint32_t *version) {
+  uint32_t current = slot._version.load(std::memory_order_acquire);
+  if (current & 1) return false;
+  if (!slot._version.compare_exchange_strong(current, current + 1,
+                                             std::memory_order_acq_rel))
+    return false;
+
+  *version = current + 1;
+  return true;
+}
+
+template <typename Key, typename Value, typename Hasher, typename Clock>
+int ShmSwissMap<Key, Value, Hasher, Clock>::Insert(const Key &key,
+                                                   const Value &value,
+                                                   int expire) {
+  return InsertMs(key, value, expire * 1000LL);
+}
+
+template <typename Key, typename Value, typename Hasher, typename Clock>
+int ShmSwissMap<Key, Value, Hasher, Clock>::InsertMs(const Key &key,
+                                                     const Value &value,
+                                                     int64_t expire_ms) {
+  int64_t expire_at = expire_ms != 0 ? _clock.NowMs() + expire_ms : 0;
+  uint64_t hash = ProbeHash(key);
+  uint8_t h2 = hash & 0x7F;
+
+  while (true) {
+    int64_t found = FindSlot(key, hash);
+
+    if (found >= 0) {
+      Slot &slot = _slots[found];
+      SwissGroup &g = _groups[found / GROUP_WIDTH];
+      uint32_t version = 0;
+
+      // lock the slot first
+      if (!LockSlot(slot, &version)) continue;
+
+      // slot may be collected and reused before locked
+      if (g.Load(found % GROUP_WIDTH) != h2 || !(slot._key == key)) {
+        slot._version.store(version + 1, std::memory_order_release);
+        continue;
+      }
+
+      slot._value = value;
+      slot._expire = expire_at;
+      slot._version.store(version + 1, std::memory_order_release);
+      return RET_OK;
+    }
+
+    // like ShmHashMap, two first inserts of one key may both add a slot
+    uint64_t pos = 0;
+    if (ClaimSlot(hash, &pos) != RET_OK) return RET_NO_MEMORY;
+
+    // claimed slot is invisible for others, version lock never fails
+    Slot &slot = _slots[pos];
+    uint32_t version = slot._version.load(std::memory_order_acquire) + 1;
+    slot._version.store(version, std::memory_order_release);
+
+    slot._key = key;
+    slot._value = value;
+    slot._expire = expire_at;
+
+    slot._version.store(version + 1, std::memory_order_release);
+    _groups[pos / GROUP_WIDTH].Store(pos % GROUP_WIDTH, h2);
+    _meta->_count.fetch_add(1, std::memory_order_acq_rel);
+    return RET_OK;
+  }
+}
+
+template <typename Key, typename Value, typename Hasher, typename Clock>
+int ShmSwissMap<Key, Value, Hasher, Clock>::Get(const Key &key, Value &value) {
+  uint64_t hash = ProbeHash(key);
+  uint8_t h2 = hash & 0x7F;
+  uint32_t group = (hash >> 7) & _group_mask;
+
+  for (uint32_t step = 0; step <= _group_mask; ++step) {
+    SwissGroup &g = _groups[group];
+
+    uint32_t match = g.Match(h2);
+    while (match) {
+      uint32_t i = __builtin_ctz(match);
+      int ret = ReadSlot((uint64_t)group * GROUP_WIDTH + i, key, &value);
+      if (ret == READ_MATCH) return RET_OK;
+      if (ret == READ_EXPIRED) return RET_NOT_FOUND;
+      match &= match - 1;
+    }
+
+    if (!g.Overflowed()) break;
+    group = (group + step + 1) & _group_mask;
+  }
+
+  return RET_NOT_FOUND;
+}
+
+template <typename Key, typename Value, typename Hasher, typename Clock>
+int ShmSwissMap<Key, Value, Hasher, Clock>::GetCount() {
+  return _meta->_count.load(std::memory_order_consume);
+}
+
+template <typename Key, typename Value, typename Hasher, typename Clock>
+int ShmSwissMap<Key, Value, Hasher, Clock>::GetAllValues(
+    std::vector<Value> &values) {
+  for (uint32_t group = 0; group <= _group_mask; ++group) {
+    uint32_t full = _groups[group].MatchFull();
+    while (full) {
+      Slot &slot = _slots[(uint64_t)group * GROUP_WIDTH + __builtin_ctz(full)];
+      values.push_back(slot._value);
+      full &= full - 1;
+    }
+  }
+
+  return RET_OK;
+}
+
+template <typename Key, typename Value, typename Hasher, typename Clock>
+int ShmSwissMap<Key, Value, Hasher, Clock>::GetAllKeys(std::vector<Key> &keys) {
+  for (uint32_t group = 0; group <= _group_mask; ++group) {
+    uint32_t full = _groups[group].MatchFull();
+    while (full) {
+      Slot &slot = _slots[(uint64_t)group * GROUP_WIDTH + __builtin_ctz(full)];
+      keys.push_back(slot._key);
+      full &= full - 1;
+    }
+  }
+
+  return RET_OK;
+}
+
+template <typename Key, typename Value, typename Hasher, typename Clock>
+void ShmSwissMap<Key, Value, Hasher, Clock>::GC() {
+  /* slots are reused in place, readers detect reuse by version,
+     so an expired slot is turned empty at once
+  */
+
+  const int64_t BREAK_MS = 2000;
+  int64_t last_timestamp = _meta->_gc_timestamp.load(std::memory_order_acquire);
+
+  int64_t now = _clock.NowMs();
+  if (last_timestamp + BREAK_MS < now &&
+      _meta->_gc_timestamp.compare_exchange_weak(last_timestamp, now,
+                                                 std::memory_order_release)) {
+    Scan();
+  }
+}
+
+template <typename Key, typename Value, typename Hasher, typename Clock>
+void ShmSwissMap<Key, Value, Hasher, Clock>::Scan() {
+  for (uint32_t group = 0; group <= _group_mask; ++group) {
+    SwissGroup &g = _groups[group];
+
+    uint32_t full = g.MatchFull();
+    while (full) {
+      uint32_t i = __builtin_ctz(full);
+      full &= full - 1;
+
+      Slot &slot = _slots[(uint64_t)group * GROUP_WIDTH + i];
+      if (!IsExpired(slot._expire)) continue;
+
+      uint32_t version = 0;
+      if (!LockSlot(slot, &version)) continue;
+
+      // recheck after locked, writer may refresh the expire time
+      if ((g.Load(i) & 0x80) == 0 && IsExpired(slot._expire)) {
+        // the key passed the groups from its home to this one
+        uint64_t hash = ProbeHash(slot._key);
+        uint32_t home = (hash >> 7) & _group_mask, steps = 0;
+        while (home != group) home = (home + ++steps) & _group_mask;
+
+        g.Store(i, CTRL_EMPTY);
+        AddOverflow(hash, steps, -1);
+        _meta->_count.fetch_sub(1, std::memory_order_acq_rel);
+      }
+      slot._version.store(version + 1, std::memory_order_release);
+    }
+  }
+}
+#undef Slot
+}  // namespace ShmMap
+
+#endif  // SHM_SWISS_MAP_H
@@ -0,0 +1,271 @@
+#include "./shm_swiss_map.h"
+
+#include "./shm_file.h"
+
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <thread>
+
+using namespace std;
+using namespace ShmMap;
+
+class MyHashMap : public ShmSwissMap<uint32_t, uint32_t> {
+ public:
+  MyHashMap(std::string name, ShmPool::Segment segment, uint32_t size)
+      : ShmSwissMap<uint32_t, uint32_t>(name, segment, size) {}
+  virtual ~MyHashMap() = default;
+
+ protected:
+  virtual uint32_t HashCode(const uint32_t& key) {
+    return key + key % 100 + (key / 100) % 35;
+  }
+};
+
+const uint32_t MAX_UIN = 0xffffffff;
+
+const uint64_t GetTimestampNs() {
+  struct timespec tn;
+  clock_gettime(CLOCK_REALTIME, &tn);
+
+  return tn.tv_nsec;
+}
+
+const uint64_t GetRandomByMs() {
+  std::default_random_engine engine;
+  engine.seed(GetTimestampNs());
+  return engine();
+}
+
+void SimpleTest() {
+  shared_memory_object::remove("MySwissSimple");
+  boost::interprocess::managed_shared_memory managedSharedMemory(
+      create_only, "MySwissSimple", 64 * 1024 * 1024);
+
+  MyHashMap hash_map("SimpleTest", &managedSharedMemory, 2048);
+
+  uint32_t key1 = 2333, key2 = 6666, key3 = 666;
+  uint32_t value = 0, ret = 0;
+
+  hash_map.Insert(key1, key1);
+  hash_map.Insert(key2, key2);
+
+  ret = hash_map.Get(key1, value);
+  cout << ret << " " << value << endl;
+
+  ret = hash_map.Get(key2, value);
+  cout << ret << " " << value << endl;
+
+  ret = hash_map.Get(key3, value);
+  cout << ret << " " << value << endl;
+
+  cout << "count: " << hash_map.GetCount() << endl;
+
+  // reattach by name, capacity is taken from shared memory
+  MyHashMap attach_map("SimpleTest", &managedSharedMemory, 0);
+  ret = attach_map.Get(key2, value);
+  cout << "reattach: " << ret << " " << value << endl;
+  shared_memory_object::remove("MySwissSimple");
+}
+
+// Hasher and Clock policies, half of the keys given 100ms
+void ExpireTest() {
+  typedef ShmSwissMap<uint32_t, uint32_t, MapHash::IntHasher,
+                      MapClock::CoarseClock>
+      IntMap;
+  const uint32_t KEY_NUM = 100000;
+
+  shared_memory_object::remove("MySwissExpire");
+  managed_shared_memory segment(create_only, "MySwissExpire",
+                                64 * 1024 * 1024);
+  IntMap hash_map("ExpireTest", &segment, KEY_NUM);
+
+  for (uint32_t i = 0; i < KEY_NUM; ++i) hash_map.InsertMs(i, i, 3600 * 1000);
+  for (uint32_t i = 1; i < KEY_NUM; i += 2) hash_map.InsertMs(i, i, 100);
+  usleep(200 * 1000);
+
+  uint32_t value = 0, count = 0;
+  for (uint32_t i = 0; i < KEY_NUM; ++i) {
+    if (hash_map.Get(i, value) != 0) continue;
+    if (value != i || i % 2 != 0) {
+      cout << "ERROR" << endl;
+      exit(0);
+    }
+    ++count;
+  }
+
+  hash_map.GC();
+  if (count != KEY_NUM / 2 || hash_map.GetCount() != (int)(KEY_NUM / 2)) {
+    cout << "ERROR" << endl;
+    exit(0);
+  }
+  shared_memory_object::remove("MySwissExpire");
+}
+
+// milliseconds of key_num misses from base
+uint64_t MissMs(ShmSwissMap<uint32_t, uint32_t, MapHash::IntHasher>& hash_map,
+                uint32_t base, uint32_t key_num) {
+  auto begin = std::chrono::steady_clock::now();
+  uint32_t value = 0, hits = 0;
+  for (uint32_t i = 0; i < key_num; ++i) hits += hash_map.Get(base + i, value) == 0;
+  if (hits != 0) {
+    cout << "ERROR" << endl;
+    exit(0);
+  }
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - begin)
+      .count();
+}
+
+// the table filled with short lived keys and collected a few rounds, every
+// group has been full, misses must still stop near the home group
+void ChurnTest() {
+  typedef ShmSwissMap<uint32_t, uint32_t, MapHash::IntHasher> IntMap;
+  const uint32_t KEY_NUM = 100000, ROUND_NUM = 4, MISS_NUM = 1000000;
+
+  shared_memory_object::remove("MySwissChurn");
+  managed_shared_memory segment(create_only, "MySwissChurn",
+                                64 * 1024 * 1024);
+  IntMap hash_map("ChurnTest", &segment, KEY_NUM);
+
+  uint64_t before = MissMs(hash_map, 0xF0000000, MISS_NUM);
+
+  uint32_t key = 0;
+  for (uint32_t round = 0; round < ROUND_NUM; ++round) {
+    while (hash_map.InsertMs(key, key, 100) == 0) ++key;
+
+    // GC runs once per 2 seconds
+    usleep(2100 * 1000);
+    hash_map.GC();
+    if (hash_map.GetCount() != 0) {
+      cout << "ERROR" << endl;
+      exit(0);
+    }
+  }
+
+  uint64_t after = MissMs(hash_map, 0xF0000000, MISS_NUM);
+  if (after > before * 4 + 10) {
+    cout << "ERROR " << before << "ms " << after << "ms" << endl;
+    exit(0);
+  }
+  shared_memory_object::remove("MySwissChurn");
+}
+
+// a map built in a file, closed and opened again
+void FileTest() {
+  typedef ShmSwissMap<uint32_t, uint32_t, MapHash::IntHasher> IntMap;
+  const uint32_t KEY_NUM = 100000;
+  const char* PATH = "/tmp/SwissFileMap";
+  unlink(PATH);
+
+  {
+    ShmPool::MappedFile file(PATH, 64 * 1024 * 1024);
+    IntMap hash_map("FileTest", file.Get(), KEY_NUM);
+    for (uint32_t i = 0; i < KEY_NUM; ++i) hash_map.Insert(i, i);
+    file.Close();
+  }
+
+  ShmPool::MappedFile file(PATH, 64 * 1024 * 1024);
+  IntMap hash_map("FileTest", file.Get(), 0);
+  uint32_t value = 0;
+  for (uint32_t i = 0; i < KEY_NUM; ++i) {
+    if (hash_map.Get(i, value) != 0 || value != i) {
+      cout << "ERROR" << endl;
+      exit(0);
+    }
+  }
+  if (hash_map.GetCount() != (int)KEY_NUM) {
+    cout << "ERROR" << endl;
+    exit(0);
+  }
+  unlink(PATH);
+}
+
+void InsertThreads(MyHashMap& hash_map, int index) {
+  int INSERT_NUM = 100000;
+
+  for (int i = 0; i < INSERT_NUM; ++i) {
+    uint32_t key = INSERT_NUM * index + i;
+    hash_map.Insert(key, key, 3);
+  }
+}
+
+void ReadThreads(MyHashMap& hash_map, int index) {
+  int READ_NUM = 1000000;
+  for (int i = 0; i < READ_NUM; ++i) {
+    uint32_t key = GetRandomByMs() % MAX_UIN, value = 0;
+
+    int ret = hash_map.Get(key, value);
+    if (ret == 0 && key != value) {
+      cout << "ERROR" << endl;
+      exit(0);
+    }
+  }
+}
+
+void GCThread(MyHashMap& hash_map) {
+  while (true) {
+    hash_map.GC();
+    sleep(1);
+  }
+}
+
+void CalcThread(MyHashMap& hash_map) {
+  while (true) {
+    cout << hash_map.GetCount() << endl;
+    sleep(1);
+  }
+}
+
+void MultipleThreadsTest() {
+  shared_memory_object::remove("MySwissMultiple");
+  boost::interprocess::managed_shared_memory managedSharedMemory(
+      create_only, "MySwissMultiple", 1024 * 1024 * 1024);
+
+  MyHashMap hash_map("MultipleTest", &managedSharedMemory, 4000000);
+
+  int READ_THREAD = 20;
+  int WRITE_THREAD = 20;
+
+  std::thread read[READ_THREAD];
+  std::thread write[WRITE_THREAD];
+
+  for (int i = 0; i < READ_THREAD; ++i) {
+    read[i] = std::thread(std::bind(&ReadThreads, std::ref(hash_map), i));
+  }
+
+  for (int i = 0; i < WRITE_THREAD; ++i) {
+    write[i] = std::thread(std::bind(&InsertThreads, std::ref(hash_map), i));
+  }
+
+  thread gc = std::thread(std::bind(&GCThread, std::ref(hash_map)));
+  gc.detach();
+
+  thread calc = std::thread(std::bind(&CalcThread, std::ref(hash_map)));
+  calc.detach();
+
+  for (int i = 0; i < READ_THREAD; ++i) {
+    read[i].join();
+  }
+
+  for (int i = 0; i < WRITE_THREAD; ++i) {
+    write[i].join();
+  }
+  sleep(8);
+  shared_memory_object::remove("MySwissMultiple");
+}
+
+int main() {
+  SimpleTest();
+
+  ExpireTest();
+
+  ChurnTest();
+
+  FileTest();
+
+  MultipleThreadsTest();
+
+  return 0;
+}
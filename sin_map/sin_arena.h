@@ -0,0 +1,284 @@
+#ifndef SIN_ARENA_H
+#define SIN_ARENA_H
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <set>
+#include <utility>
+#include <vector>
+
+namespace SinMap {
+
+/*
+  allocator policies of SinHashMap nodes:
+    - VirtualAllocator, the map calls its virtual Allocate and Free
+    - ArenaAllocator, a NodeArena owned by the map
+
+  NodeArena:
+    - nodes are carved from blocks taken from the heap, blocks are given
+      back when the arena is destroyed
+    - every thread has a cache, Allocate and Free touch no shared memory
+      but when the cache is empty or full
+    - nodes freed by one thread, GC in most cases, are handed to the others
+      through a shared stack, a cache takes the whole stack at once
+    - fresh nodes are carved from the block of the cache in order, nodes
+      a thread allocates back to back, e.g. the copies of a chain moved by
+      resize, sit next to each other unless freed nodes are reused
+*/
+
+const uint32_t ARENA_BLOCK_NODES = 4096;  // nodes taken from the heap at once
+const uint32_t ARENA_CACHE_NODES = 256;  // free nodes kept by a thread
+
+// ids of live arenas, an exiting thread can't touch a destroyed one
+struct ArenaRegistry {
+  static ArenaRegistry &Instance() {
+    static ArenaRegistry registry;
+    return registry;
+  }
+
+  bool Alive(uint64_t id) { return _ids.count(id) != 0; }
+
+  std::mutex _lock;
+  std::set<uint64_t> _ids;
+  uint64_t _next_id = 0;
+};
+
+template <typename Node>
+class NodeArena {
+ public:
+  NodeArena() {
+    _free_list = NULL;
+    _blocks = NULL;
+    _caches = NULL;
+
+    ArenaRegistry &registry = ArenaRegistry::Instance();
+    std::lock_guard<std::mutex> lock(registry._lock);
+    _id = ++registry._next_id;
+    registry._ids.insert(_id);
+  }
+
+  ~NodeArena() {
+    {
+      // threads exiting from now on leave the caches alone
+      ArenaRegistry &registry = ArenaRegistry::Instance();
+      std::lock_guard<std::mutex> lock(registry._lock);
+      registry._ids.erase(_id);
+    }
+
+    for (Cache *p = _caches.load(std::memory_order_acquire); p != NULL;) {
+      Cache *next = p->_next;
+      delete p;
+      p = next;
+    }
+
+    for (Block *p = _blocks.load(std::memory_order_acquire); p != NULL;) {
+      Block *next = p->_next;
+      delete p;
+      p = next;
+    }
+  }
+
+  // memory of a node, not constructed, throws bad_alloc as new does
+  Node *Allocate() {
+    Cache *cache = LocalCache();
+    if (cache->_free_list != NULL) {
+      FreeNode *node = cache->_free_list;
+      cache->_free_list = node->_next;
+      cache->_free_count--;
+      return (Node *)node;
+    }
+
+    // nodes freed by other threads
+    if (cache->_reuse_list == NULL)
+      cache->_reuse_list = _free_list.exchange(NULL, std::memory_order_acquire);
+    if (cache->_reuse_list != NULL) {
+      FreeNode *node = cache->_reuse_list;
+      cache->_reuse_list = node->_next;
+      return (Node *)node;
+    }
+
+    if (cache->_begin == cache->_end) Grow(cache);
+    return (Node *)(cache->_begin++);
+  }
+
+  // node must be destructed
+  void Free(Node *node) {
+    if (node == NULL) return;
+
+    Cache *cache = LocalCache();
+    FreeNode *free_node = (FreeNode *)node;
+    free_node->_next = cache->_free_list;
+    cache->_free_list = free_node;
+    if (++cache->_free_count < ARENA_CACHE_NODES) return;
+
+    // keep half, hand the others over
+    FreeNode *last = cache->_free_list;
+    for (uint32_t i = 1; i < ARENA_CACHE_NODES / 2; ++i) last = last->_next;
+    FreeNode *first = cache->_free_list;
+    cache->_free_list = last->_next;
+    cache->_free_count -= ARENA_CACHE_NODES / 2;
+
+    FreeNode *head = _free_list.load(std::memory_order_relaxed);
+    do {
+      last->_next = head;
+    } while (!_free_list.compare_exchange_weak(head, first,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed));
+  }
+
+ private:
+  struct Slot {
+    alignas(Node) char _data[sizeof(Node)];
+  };
+
+  struct FreeNode {
+    FreeNode *_next;
+  };
+
+  static_assert(sizeof(Slot) >= sizeof(FreeNode), "node too small");
+
+  struct Block {
+    Block *_next;
+    Slot _slots[ARENA_BLOCK_NODES];
+  };
+
+  struct Cache {
+    Cache() {
+      _in_use = true;
+      _next = NULL;
+      _free_list = NULL;
+      _free_count = 0;
+      _reuse_list = NULL;
+      _begin = _end = NULL;
+    }
+
+    std::atomic<bool> _in_use;
+    Cache *_next;
+
+    // touched by the owner thread only
+    FreeNode *_free_list;  // freed by the owner
+    uint32_t _free_count;
+    FreeNode *_reuse_list;  // taken from the shared stack
+    Slot *_begin;  // rest of the block, not carved yet
+    Slot *_end;
+  };
+
+  // caches held by this thread, released when it exits
+  struct LocalCaches {
+    ~LocalCaches() {
+      ArenaRegistry &registry = ArenaRegistry::Instance();
+      std::lock_guard<std::mutex> lock(registry._lock);
+      for (auto &local : _caches) {
+        if (registry.Alive(local.first))
+          local.second->_in_use.store(false, std::memory_order_release);
+      }
+    }
+
+    std::vector<std::pair<uint64_t, Cache *>> _caches;
+  };
+
+  Cache *LocalCache() {
+    static thread_local LocalCaches local_caches;
+
+    for (auto &local : local_caches._caches) {
+      if (local.first == _id) return local.second;
+    }
+
+    {
+      // first use by this thread, forget arenas destroyed meanwhile
+      ArenaRegistry &registry = ArenaRegistry::Instance();
+      std::lock_guard<std::mutex> lock(registry._lock);
+      auto &caches = local_caches._caches;
+      caches.erase(std::remove_if(caches.begin(), caches.end(),
+                                  [&registry](std::pair<uint64_t, Cache *> &p) {
+                                    return !registry.Alive(p.first);
+                                  }),
+                   caches.end());
+    }
+
+    local_caches._caches.push_back(std::make_pair(_id, AcquireCache()));
+    return local_caches._caches.back().second;
+  }
+
+  Cache *AcquireCache() {
+    // reuse a cache left by an exited thread, with the nodes it keeps
+    for (Cache *p = _caches.load(std::memory_order_acquire); p != NULL;
+         p = p->_next) {
+      bool expected = false;
+      if (!p->_in_use.load(std::memory_order_relaxed) &&
+          p->_in_use.compare_exchange_strong(expected, true,
+                                             std::memory_order_acq_rel))
+        return p;
+    }
+
+    Cache *cache = new Cache;
+    Cache *head = _caches.load(std::memory_order_relaxed);
+    do {
+      cache->_next = head;
+    } while (!_caches.compare_exchange_weak(head, cache,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed));
+    return cache;
+  }
+
+  void Grow(Cache *cache) {
+    Block *block = new Block;
+
+    Block *head = _blocks.load(std::memory_order_relaxed);
+    do {
+      block->_next = head;
+    } while (!_blocks.compare_exchange_weak(head, block,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed));
+
+    cache->_begin = block->_slots;
+    cache->_end = block->_slots + ARENA_BLOCK_NODES;
+  }
+
+  uint64_t _id;
+  std::atomic<FreeNode *> _free_list;
+  std::atomic<Block *> _blocks;
+  std::atomic<Cache *> _caches;
+};
+
+struct VirtualAllocator {};
+
+struct ArenaAllocator {
+  template <typename Node>
+  using Rebind = NodeArena<Node>;
+};
+
+// AllocateNode and FreeNode of the map, with VirtualAllocator they are the
+// virtual Allocate and Free
+template <typename Node, typename Allocator>
+class AllocatorAdapter {
+ protected:
+  Node *AllocateNode() { return _allocator.Allocate(); }
+
+  void FreeNode(Node *node) { _allocator.Free(node); }
+
+ private:
+  typename Allocator::template Rebind<Node> _allocator;
+};
+
+template <typename Node>
+class AllocatorAdapter<Node, VirtualAllocator> {
+ public:
+  virtual ~AllocatorAdapter() = default;
+
+ protected:
+  Node *AllocateNode() { return (Node *)Allocate(sizeof(Node)); }
+
+  void FreeNode(Node *node) { Free(node); }
+
+  virtual void *Allocate(int size) = 0;
+
+  virtual void Free(void *ptr) = 0;
+};
+
+}  // namespace SinMap
+#endif  // SIN_ARENA_H
@@ -5,20 +5,32 @@
 #include <time.h>
 #include <functional>
 
+#include <algorithm>
 #include <atomic>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
+#include "../common/clock.h"
+#include "../common/hash.h"
+#include "../common/timing_wheel.h"
+#include "./sin_arena.h"
+
 namespace SinMap {
-template <typename Key, typename Value>
-struct ItemNode {
+// Links are MapWheel::WheelLinks if the map has a wheel, an empty base
+// otherwise
+template <typename Key, typename Value, typename Links = MapWheel::NoLinks>
+struct ItemNode : public Links {
   ItemNode *_next;
   Key _key;
   Value _value;
-  volatile int _expire;
+  volatile int64_t _expire;  // milliseconds of the wall clock, 0 for never
 
   std::atomic<int> _invalid;  // 0 - valid  1 - add garbage list  2 - should to
                               // delete 3 - writing
+  std::atomic<uint32_t> _version;  // odd - value is writing
   ItemNode *_del_next;
+  uint64_t _retire_epoch;  // epoch when unlinked from the bucket
 };
 
 struct BucketItem {
@@ -26,14 +38,37 @@ struct BucketItem {
 
   void *_head;
   std::atomic<void *> _tail;
+  std::atomic<bool> _migrated;  // chain is moving to the new bucket table
+  std::atomic<bool> _unlinking;  // one thread unlinks nodes at the same time
 
   BucketItem() {
     _count = 0;
     _head = NULL;
     _tail = NULL;
+    _migrated = false;
+    _unlinking = false;
   }
 };
 
+struct BucketTable {
+  // size is a power of two, buckets are picked by masking the hash
+  explicit BucketTable(int bucket_size) {
+    bucket_size = MapHash::RoundUpPowerOfTwo(bucket_size);
+    _buckets = new BucketItem[bucket_size];
+    _bucket_size = bucket_size;
+  }
+
+  ~BucketTable() { delete[] _buckets; }
+
+  BucketItem *_buckets;
+  int _bucket_size;
+};
+
+const float DEFAULT_MAX_LOAD_FACTOR = 4.0;
+const int MIGRATE_STEP = 4;        // buckets moved on the back of one Insert
+const int GC_MIGRATE_STEP = 4096;  // buckets moved on the back of one GC
+const int MULTI_GET_BATCH = 16;    // lookups whose memory loads overlap
+
 enum SinHashRet {
   RET_OK = 0,
   RET_NOT_FOUND = 1,
@@ -45,293 +80,965 @@ enum ItemStatus {
   WAITING_DELETE = 2,
   WRITING = 3,
   READING = 4,
+  MIGRATED = 5,
+};
+
+// epoch based reclamation:
+//   readers publish the global epoch they entered with, memory unlinked at
+//   epoch e is freed once no reader is still in an epoch <= e
+struct EpochRecord {
+  EpochRecord() {
+    _epoch = 0;
+    _in_use = true;
+    _depth = 0;
+    _next = NULL;
+  }
+
+  std::atomic<uint64_t> _epoch;  // 0 - not reading
+  std::atomic<bool> _in_use;
+  int _depth;  // nested guards, touched by the owner thread only
+  EpochRecord *_next;
+};
+
+class EpochDomain {
+ public:
+  static EpochDomain &Instance() {
+    static EpochDomain domain;
+    return domain;
+  }
+
+  void Enter() {
+    EpochRecord *record = LocalRecord();
+    if (record->_depth++ > 0) return;
+
+    // pairs with the fence in SafeEpoch, either the reclaimer sees us or
+    // we see the node unlinked
+    record->_epoch.store(_epoch.load(std::memory_order_seq_cst),
+                         std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  void Exit() {
+    EpochRecord *record = LocalRecord();
+    if (--record->_depth > 0) return;
+
+    record->_epoch.store(0, std::memory_order_release);
+  }
+
+  uint64_t Current() { return _epoch.load(std::memory_order_seq_cst); }
+
+  // readers entering after Advance can't reach memory unlinked before it
+  void Advance() { _epoch.fetch_add(1, std::memory_order_seq_cst); }
+
+  // memory retired at an epoch less than the result can be freed
+  uint64_t SafeEpoch() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    uint64_t safe = Current();
+    for (EpochRecord *p = _records.load(std::memory_order_acquire); p != NULL;
+         p = p->_next) {
+      uint64_t epoch = p->_epoch.load(std::memory_order_acquire);
+      if (epoch != 0 && epoch < safe) safe = epoch;
+    }
+    return safe;
+  }
+
+ private:
+  struct LocalHolder {
+    LocalHolder(EpochRecord *record) : _record(record) {}
+
+    ~LocalHolder() {
+      _record->_epoch.store(0, std::memory_order_release);
+      _record->_in_use.store(false, std::memory_order_release);
+    }
+
+    EpochRecord *_record;
+  };
+
+  EpochDomain() {
+    _epoch = 1;
+    _records = NULL;
+  }
+
+  EpochRecord *LocalRecord() {
+    static thread_local LocalHolder holder(AcquireRecord());
+    return holder._record;
+  }
+
+  EpochRecord *AcquireRecord() {
+    // reuse a record left by an exited thread, records are never freed
+    for (EpochRecord *p = _records.load(std::memory_order_acquire); p != NULL;
+         p = p->_next) {
+      bool expected = false;
+      if (!p->_in_use.load(std::memory_order_relaxed) &&
+          p->_in_use.compare_exchange_strong(expected, true,
+                                             std::memory_order_acq_rel)) {
+        p->_depth = 0;
+        return p;
+      }
+    }
+
+    EpochRecord *record = new EpochRecord;
+    EpochRecord *head = _records.load(std::memory_order_relaxed);
+    do {
+      record->_next = head;
+    } while (!_records.compare_exchange_weak(head, record,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed));
+    return record;
+  }
+
+  std::atomic<uint64_t> _epoch;
+  std::atomic<EpochRecord *> _records;
 };
 
-#define Item ItemNode<Key, Value>
+struct EpochGuard {
+  EpochGuard() { EpochDomain::Instance().Enter(); }
+  ~EpochGuard() { EpochDomain::Instance().Exit(); }
+};
 
-template <typename Key, typename Value>
-class SinHashMap {
+#define Item ItemNode<Key, Value, Links>
+
+// Hasher is one of MapHash, the default calls the virtual HashCode,
+// Allocator is VirtualAllocator calling the virtual Allocate and Free,
+// or ArenaAllocator, Clock is one of MapClock, Links is
+// MapWheel::WheelLinks for a timing wheel, with which GC visits the nodes
+// due instead of every chain, nodes of a map without one are smaller
+template <typename Key, typename Value,
+          typename Hasher = MapHash::VirtualHasher,
+          typename Allocator = VirtualAllocator,
+          typename Clock = MapClock::SystemClock,
+          typename Links = MapWheel::NoLinks>
+class SinHashMap : public MapHash::HashAdapter<Key, Hasher>,
+                   public AllocatorAdapter<Item, Allocator> {
  public:
-  explicit SinHashMap(int bucket_size);
+  // bucket array doubles when count / bucket_size is over max_load_factor,
+  // 0 to keep the bucket size fixed
+  explicit SinHashMap(int bucket_size,
+                      float max_load_factor = DEFAULT_MAX_LOAD_FACTOR);
 
   virtual ~SinHashMap();
 
+  // expire in seconds, 0 for never
   void Insert(const Key &key, const Value &value, int expire = 0);
 
+  // expire in milliseconds
+  void InsertMs(const Key &key, const Value &value, int64_t expire_ms);
+
   int Get(const Key &key, Value &value);
 
+  // rets[i] is the return of Get(keys[i], values[i])
+  void MultiGet(const Key *keys, size_t n, Value *values, int *rets);
+
+  // unlink the node at once, memory is freed by the next GC
+  int Erase(const Key &key);
+
   int GetAllValues(std::vector<Value> &values);
 
   int GetCount();
 
   void GC();
 
+  // GC with thread_num threads scanning disjoint bucket ranges, each keeps
+  // the nodes it unlinks in its own list, the lists are joined for SafeFree
+  // when all threads finished
+  void ParallelGC(int thread_num);
+
  protected:
-  virtual void *Allocate(int size) = 0;
+  using MapHash::HashAdapter<Key, Hasher>::Hash;
 
-  virtual void Free(void *ptr) = 0;
+  using AllocatorAdapter<Item, Allocator>::AllocateNode;
 
-  virtual uint32_t HashCode(const Key &key) = 0;
+  using AllocatorAdapter<Item, Allocator>::FreeNode;
 
  private:
-  void SafeFree();
+  typedef MapWheel::TimingWheel<MapWheel::SpinLock> Wheel;
 
-  void Scan();
+  static const bool HAS_WHEEL =
+      std::is_same<Links, MapWheel::WheelLinks>::value;
 
-  void AddGarbageList(Item *node);
+  // without links there is no wheel and Node is never called
+  struct WheelAdapter {
+    MapWheel::WheelLinks &Node(uint64_t ref) {
+      return *(typename std::conditional<HAS_WHEEL, Item,
+                                         MapWheel::WheelLinks>::type *)ref;
+    }
 
-  void RemoveExpireNode(Item *p, BucketItem &bucket);
+    bool Lock(MapWheel::SpinLock &lock) {
+      lock.Lock();
+      return false;
+    }
 
-  void AddNodeItem(int index, const Key &key, const Value &value, int expire);
+    void Unlock(MapWheel::SpinLock &lock) { lock.Unlock(); }
+  };
 
-  Item *GetNode(uint32_t index, const Key &key);
+  // nodes unlinked by one GC thread
+  struct GarbageSublist {
+    GarbageSublist() : _head(NULL), _tail(NULL) {}
 
-  BucketItem *_buckets;
-  int _bucket_size;
-  std::atomic<uint32_t> _gc_timestamp;
+    Item *_head;
+    Item *_tail;
+  };
+
+  void Collect(int thread_num);
+
+  void SafeFree(uint64_t safe_epoch);
+
+  void Scan(int thread_num);
+
+  void ScanRange(BucketTable *table, int begin, int end,
+                 GarbageSublist *garbage);
+
+  // expire the nodes due by the wheel
+  void ScanWheel();
+
+  void ExpireNode(Item *p, int64_t now);
+
+  void WheelUnlink(Item *node);
+
+  // append to garbage if given, to the garbage list otherwise
+  void AddGarbageList(Item *node, uint64_t epoch,
+                      GarbageSublist *garbage = NULL);
+
+  void SpliceGarbageList(GarbageSublist &garbage);
+
+  void RemoveExpireNode(Item *p, BucketItem &bucket,
+                        GarbageSublist *garbage = NULL);
+
+  // false if node is not in the bucket
+  bool UnlinkNode(BucketItem &bucket, Item *node);
+
+  void LockBucket(BucketItem &bucket);
+
+  bool TryLockBucket(BucketItem &bucket);
+
+  void UnlockBucket(BucketItem &bucket);
+
+  void AddNodeItem(BucketTable *table, uint32_t hash, const Key &key,
+                   const Value &value, int64_t expire_at);
+
+  Item *GetNode(BucketTable *table, uint32_t hash, const Key &key);
+
+  Item *FindNode(uint32_t hash, const Key &key);
+
+  int LockItem(Item *item, int status);
+
+  int ReadItem(Item *item, Value &value);
+
+  // resize
+  void StartResize(BucketTable *table);
+
+  void Migrate(int step);
+
+  void MigrateBucket(BucketItem &bucket);
+
+  void MigrateNode(BucketItem &bucket, Item *p);
+
+  void FreeRetiredTable(uint64_t safe_epoch);
+
+  bool TryLockMaintain();
+
+  void UnlockMaintain();
+
+  std::atomic<BucketTable *> _table;
+
+  // incremental resize, _old_table is not NULL while migrating
+  std::atomic<BucketTable *> _old_table;
+  int _migrate_index;
+  BucketTable *_retired_table;
+  uint64_t _retired_epoch;
+
+  float _max_load_factor;
+  std::atomic<int> _item_count;
+
+  // one thread scan or migrate at the same time
+  std::atomic<bool> _maintaining;
+
+  Clock _clock;
+
+  // expiry index by second, NULL if GC scans every chain
+  Wheel *_wheel;
 
   // garbage list
   Item *_garbage_list_head;
   Item *_garbage_list_tail;
+
+  // nodes unlinked by Erase, moved into garbage list by GC
+  std::atomic<Item *> _erased_list;
 };
 
 // implements
-template <typename Key, typename Value>
-SinHashMap<Key, Value>::SinHashMap(int bucket_size) {
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::SinHashMap(
+    int bucket_size, float max_load_factor) {
   if (bucket_size <= 0) bucket_size = 1024;
-  _buckets = new BucketItem[bucket_size];
-  _bucket_size = bucket_size;
+  _clock.Attach(NULL);
+  _wheel = HAS_WHEEL ? new Wheel(_clock.NowMs() / 1000) : NULL;
+  _table = new BucketTable(bucket_size);
+  _old_table = NULL;
+  _migrate_index = 0;
+  _retired_table = NULL;
+  _retired_epoch = 0;
+  _max_load_factor = max_load_factor;
+  _item_count = 0;
+  _maintaining = false;
   _garbage_list_head = NULL;
   _garbage_list_tail = NULL;
+  _erased_list = NULL;
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::~SinHashMap() {
+  delete _table.load(std::memory_order_acquire);
+  delete _old_table.load(std::memory_order_acquire);
+  delete _retired_table;
+  delete _wheel;
+  _table = NULL;
+  _old_table = NULL;
+  _retired_table = NULL;
+  _wheel = NULL;
 }
 
-template <typename Key, typename Value>
-SinHashMap<Key, Value>::~SinHashMap() {
-  if (_buckets != NULL) delete _buckets;
-  _buckets = NULL;
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::Insert(
+    const Key &key, const Value &value, int expire) {
+  InsertMs(key, value, expire * 1000LL);
 }
 
-template <typename Key, typename Value>
-void SinHashMap<Key, Value>::Insert(const Key &key, const Value &value,
-                                    int expire) {
-  int index = HashCode(key) % _bucket_size;
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::InsertMs(
+    const Key &key, const Value &value, int64_t expire_ms) {
+  EpochGuard guard;
+
+  if (_old_table.load(std::memory_order_acquire) != NULL && TryLockMaintain()) {
+    Migrate(MIGRATE_STEP);
+    UnlockMaintain();
+  }
 
-  Item *item = GetNode(index, key);
+  uint32_t hash = Hash(key);
+  int64_t expire_at = expire_ms != 0 ? _clock.NowMs() + expire_ms : 0;
+  BucketTable *table = NULL;
 
-  if (item == NULL || (item->_expire != 0 && item->_expire < time(NULL))) {
-    AddNodeItem(index, key, value, expire);
-  } else {
-    int invalid = VALID, write = WRITING;
+  while (true) {
+    table = _table.load(std::memory_order_acquire);
+    Item *item = FindNode(hash, key);
+
+    if (item == NULL ||
+        (item->_expire != 0 && item->_expire < _clock.NowMs())) {
+      AddNodeItem(table, hash, key, value, expire_at);
+      break;
+    }
 
     // lock the item first
-    while (!item->_invalid.compare_exchange_strong(invalid, write,
-                                                   std::memory_order_acq_rel)) {
-      if (item->_invalid.load(std::memory_order_acquire) == WRITING) {
-        // writing occur, so wait
-        invalid = VALID, write = WRITING;
-        continue;
-      } else {
-        // item is add to garbage list
-        AddNodeItem(index, key, value, expire);
-        return;
-      }
+    int status = LockItem(item, WRITING);
+    if (status == MIGRATED) {
+      // item is moving to the new table, find it again
+      continue;
+    } else if (status != VALID) {
+      // item is add to garbage list
+      AddNodeItem(table, hash, key, value, expire_at);
+      break;
     }
 
+    // readers copy the value optimistically, let them know it changes
+    uint32_t version = item->_version.load(std::memory_order_relaxed);
+    item->_version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
     item->_value = value;
-    item->_expire = expire != 0 ? time(NULL) + expire : 0;
+    if (_wheel != NULL && item->_expire != expire_at) {
+      WheelAdapter links;
+      _wheel->Relink(links, (uint64_t)item, expire_at / 1000);
+    }
+    item->_expire = expire_at;
+
+    item->_version.store(version + 2, std::memory_order_release);
     item->_invalid.store(VALID, std::memory_order_release);
+    break;
+  }
+
+  if (_max_load_factor > 0 &&
+      _item_count.load(std::memory_order_relaxed) >
+          _max_load_factor * table->_bucket_size) {
+    StartResize(table);
   }
 }
 
-template <typename Key, typename Value>
-int SinHashMap<Key, Value>::Get(const Key &key, Value &value) {
-  int index = HashCode(key) % _bucket_size;
-  Item *item = GetNode(index, key);
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+int SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::Get(
+    const Key &key, Value &value) {
+  EpochGuard guard;
+  uint32_t hash = Hash(key);
+
+  while (true) {
+    Item *item = FindNode(hash, key);
+
+    if (item == NULL ||
+        (item->_expire != 0 && item->_expire < _clock.NowMs())) {
+      return RET_NOT_FOUND;
+    }
+
+    int status = ReadItem(item, value);
+    if (status == MIGRATED) continue;
+    if (status != VALID) return RET_NOT_FOUND;
 
-  if (item == NULL || (item->_expire != 0 && item->_expire < time(NULL))) {
-    return RET_NOT_FOUND;
+    return RET_OK;
   }
+}
 
-  // lock the item
-  // TODO: use reference count to allow multiple readers read at same time
-  int invalid = VALID, read = READING;
-  while (!item->_invalid.compare_exchange_strong(invalid, read,
-                                                 std::memory_order_acq_rel)) {
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::MultiGet(
+    const Key *keys, size_t n, Value *values, int *rets) {
+  /* lookups of a batch go stage by stage, the memory of every lookup in
+     the next stage is prefetched while the current stage runs:
+      1. hash keys, prefetch buckets
+      2. load chain heads, prefetch head nodes
+      3. step every chain one node per round, prefetch the next nodes
+
+     keys not settled by the current table fall back to Get
+  */
+  EpochGuard guard;
+  BucketTable *table = _table.load(std::memory_order_acquire);
+  bool migrating = _old_table.load(std::memory_order_acquire) != NULL;
+
+  BucketItem *buckets[MULTI_GET_BATCH];
+  Item *items[MULTI_GET_BATCH];
+
+  for (size_t begin = 0; begin < n; begin += MULTI_GET_BATCH) {
+    int count = std::min(n - begin, (size_t)MULTI_GET_BATCH);
+    const Key *batch = keys + begin;
+
+    for (int i = 0; i < count; ++i) {
+      buckets[i] = &table->_buckets[MapHash::BucketIndex(Hash(batch[i]),
+                                                         table->_bucket_size)];
+      __builtin_prefetch(buckets[i]);
+    }
+
+    for (int i = 0; i < count; ++i) {
+      items[i] = (Item *)buckets[i]->_head;
+      if (items[i] != NULL) __builtin_prefetch(items[i]);
+    }
+
+    uint32_t walking = (1u << count) - 1;
+    while (walking != 0) {
+      for (int i = 0; i < count; ++i) {
+        if (!(walking & (1u << i))) continue;
+
+        if (items[i] == NULL || items[i]->_key == batch[i]) {
+          walking &= ~(1u << i);
+        } else {
+          items[i] = items[i]->_next;
+          if (items[i] != NULL) __builtin_prefetch(items[i]);
+        }
+      }
+    }
+
+    int64_t now = _clock.NowMs();
+    for (int i = 0; i < count; ++i) {
+      Item *item = items[i];
+      int &ret = rets[begin + i];
+
+      if (item == NULL && !migrating) {
+        ret = RET_NOT_FOUND;
+      } else if (item != NULL && item->_expire != 0 && item->_expire < now) {
+        ret = RET_NOT_FOUND;
+      } else if (item == NULL) {
+        // may be in the old table
+        ret = Get(batch[i], values[begin + i]);
+      } else {
+        int status = ReadItem(item, values[begin + i]);
+        if (status == VALID) {
+          ret = RET_OK;
+        } else if (status == MIGRATED) {
+          ret = Get(batch[i], values[begin + i]);
+        } else {
+          ret = RET_NOT_FOUND;
+        }
+      }
+    }
   }
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+int SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::Erase(
+    const Key &key) {
+  EpochGuard guard;
+  uint32_t hash = Hash(key);
+
+  while (true) {
+    BucketTable *table = _table.load(std::memory_order_acquire);
+    BucketTable *old_table = _old_table.load(std::memory_order_acquire);
+
+    BucketTable *owner = table;
+    Item *item = GetNode(table, hash, key);
+    if (item == NULL && old_table != NULL && old_table != table) {
+      owner = old_table;
+      item = GetNode(old_table, hash, key);
+    }
+
+    if (item == NULL) return RET_NOT_FOUND;
+
+    // the bucket lock is taken first, Scan never sees a node
+    // collecting but still linked
+    BucketItem &bucket =
+        owner->_buckets[MapHash::BucketIndex(hash, owner->_bucket_size)];
+    LockBucket(bucket);
+
+    int status = LockItem(item, COLLECTING);
+    if (status != VALID) {
+      UnlockBucket(bucket);
 
-  value = item->_value;
-  item->_invalid.store(VALID, std::memory_order_release);
+      // item is moving to the new table, find it again
+      if (status == MIGRATED) continue;
+      return RET_NOT_FOUND;
+    }
+
+    UnlinkNode(bucket, item);
+    UnlockBucket(bucket);
+
+    bucket._count.fetch_sub(1, std::memory_order_acq_rel);
+    _item_count.fetch_sub(1, std::memory_order_relaxed);
+
+    // readers entered from now on can't reach it
+    item->_retire_epoch = EpochDomain::Instance().Current();
+    Item *head = _erased_list.load(std::memory_order_relaxed);
+    do {
+      item->_del_next = head;
+    } while (!_erased_list.compare_exchange_weak(head, item,
+                                                 std::memory_order_release,
+                                                 std::memory_order_relaxed));
+
+    // the old node the copy was made from would send readers back to the
+    // new table, retire it with the old table
+    if (owner == table && old_table != NULL && old_table != table) {
+      Item *old_item = GetNode(old_table, hash, key);
+      int migrated = MIGRATED;
+      if (old_item != NULL)
+        old_item->_invalid.compare_exchange_strong(migrated, COLLECTING,
+                                                   std::memory_order_acq_rel);
+    }
 
-  return RET_OK;
+    if (item->_expire != 0 && item->_expire < _clock.NowMs())
+      return RET_NOT_FOUND;
+    return RET_OK;
+  }
 }
 
-template <typename Key, typename Value>
-int SinHashMap<Key, Value>::GetAllValues(std::vector<Value> &values) {
-  for (int i = 0; i < _bucket_size; ++i) {
-    BucketItem &bucket = _buckets[i];
-    Item *p = (Item *)bucket._head;
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+int SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::ReadItem(
+    Item *item, Value &value) {
+  if (!std::is_trivially_copyable<Value>::value) {
+    // value can't be copied while changing, lock the item
+    int status = LockItem(item, READING);
+    if (status != VALID) return status;
 
-    while (p != NULL) {
-      values.push_back(p->_value);
-      p = p->_next;
+    value = item->_value;
+    item->_invalid.store(VALID, std::memory_order_release);
+    return VALID;
+  }
+
+  // seqlock, copy the value and retry if a writer overlapped,
+  // readers never write the item so they don't serialize each other
+  while (true) {
+    uint32_t version = item->_version.load(std::memory_order_acquire);
+    if (version & 1) continue;  // writing occur, so wait
+
+    int status = item->_invalid.load(std::memory_order_acquire);
+    if (status != VALID && status != WRITING && status != READING)
+      return status;
+
+    value = item->_value;
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (item->_version.load(std::memory_order_relaxed) == version)
+      return VALID;
+  }
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+int SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::GetAllValues(
+    std::vector<Value> &values) {
+  EpochGuard guard;
+  BucketTable *tables[2] = {_table.load(std::memory_order_acquire),
+                            _old_table.load(std::memory_order_acquire)};
+
+  for (int t = 0; t < 2 && tables[t] != NULL; ++t) {
+    for (int i = 0; i < tables[t]->_bucket_size; ++i) {
+      BucketItem &bucket = tables[t]->_buckets[i];
+      Item *p = (Item *)bucket._head;
+
+      while (p != NULL) {
+        if (p->_invalid.load(std::memory_order_acquire) != MIGRATED)
+          values.push_back(p->_value);
+        p = p->_next;
+      }
     }
   }
   return 0;
 }
 
-template <typename Key, typename Value>
-int SinHashMap<Key, Value>::GetCount() {
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+int SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::GetCount() {
+  EpochGuard guard;
+  BucketTable *tables[2] = {_table.load(std::memory_order_acquire),
+                            _old_table.load(std::memory_order_acquire)};
+
   int sum = 0;
-  for (int i = 0; i < _bucket_size; ++i)
-    sum += _buckets[i]._count.load(std::memory_order_consume);
+  for (int t = 0; t < 2 && tables[t] != NULL; ++t) {
+    for (int i = 0; i < tables[t]->_bucket_size; ++i)
+      sum += tables[t]->_buckets[i]._count.load(std::memory_order_consume);
+  }
   return sum;
 }
 
-template <typename Key, typename Value>
-void SinHashMap<Key, Value>::GC() {
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::GC() {
+  Collect(1);
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::ParallelGC(
+    int thread_num) {
+  Collect(thread_num < 1 ? 1 : thread_num);
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::Collect(
+    int thread_num) {
   /* two steps:
-      1. scan expire ItemNode, push into garbage list
-      2. clear ItemNode-s whose cal more than 1 in garbage list
+      1. scan expire ItemNode, unlink and push into garbage list with the
+         current epoch
+      2. free ItemNode-s whose epoch all readers have left
 
-      the two steps need pause at least BREAK_TIME seconds
+     nodes unlinked by this round are freed as soon as the readers which
+     may still hold them return, at the latest by the next round
   */
+  if (!TryLockMaintain()) return;
 
-  const int BREAK_TIME = 2;
-  uint32_t last_timestamp = _gc_timestamp.load(std::memory_order_acquire);
-
-  // for better performance using cas weak version
-  uint32_t now = time(0);
-  if (last_timestamp + BREAK_TIME < time(NULL) &&
-      _gc_timestamp.compare_exchange_weak(last_timestamp, now,
-                                          std::memory_order_release)) {
-    Scan();
-    SafeFree();
+  Migrate(GC_MIGRATE_STEP);
+  if (_wheel != NULL) {
+    ScanWheel();
+  } else {
+    Scan(thread_num);
   }
-}
 
-template <typename Key, typename Value>
-void SinHashMap<Key, Value>::SafeFree() {
-  Item *p0 = _garbage_list_head;
-  if (p0 == NULL) {
-    return;
+  // nodes unlinked by Erase
+  Item *p = _erased_list.exchange(NULL, std::memory_order_acquire);
+  while (p != NULL) {
+    Item *next = p->_del_next;
+    AddGarbageList(p, p->_retire_epoch);
+    p = next;
   }
 
-  Item *p1 = p0->_del_next;
+  EpochDomain &domain = EpochDomain::Instance();
+  domain.Advance();
 
-  while (p1) {
-    if (p1->_invalid.fetch_add(1, std::memory_order_acq_rel) == 2) {
-      // free
-      p0->_del_next = p1->_del_next;
-      p1->~Item();
-      Free(p1);
-      p1 = p0->_del_next;
-    } else {
-      p0 = p1;
-      p1 = p1->_del_next;
-    }
-  }
-  _garbage_list_tail = p0;
-}
+  uint64_t safe_epoch = domain.SafeEpoch();
+  SafeFree(safe_epoch);
+  FreeRetiredTable(safe_epoch);
 
-template <typename Key, typename Value>
-void SinHashMap<Key, Value>::Scan() {
-  for (int i = 0; i < _bucket_size; ++i) {
-    BucketItem &bucket = _buckets[i];
+  UnlockMaintain();
+}
 
-    Item *p0 = (Item *)bucket._head;
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::SafeFree(
+    uint64_t safe_epoch) {
+  // garbage list is ordered by epoch
+  while (_garbage_list_head != NULL &&
+         _garbage_list_head->_retire_epoch < safe_epoch) {
+    Item *p = _garbage_list_head;
+    _garbage_list_head = p->_del_next;
+
+    WheelUnlink(p);
+    p->~Item();
+    FreeNode(p);
+  }
 
-    if (p0 == NULL) continue;
+  if (_garbage_list_head == NULL) _garbage_list_tail = NULL;
+}
 
-    Item *p1 = p0->_next;
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::Scan(
+    int thread_num) {
+  // the caller scans the first range, the lists are joined in range order
+  BucketTable *table = _table.load(std::memory_order_acquire);
+  std::vector<GarbageSublist> garbage(thread_num);
+  std::vector<std::thread> threads;
+
+  auto range = [&](int slice) {
+    ScanRange(table, (int64_t)table->_bucket_size * slice / thread_num,
+              (int64_t)table->_bucket_size * (slice + 1) / thread_num,
+              &garbage[slice]);
+  };
+
+  for (int i = 1; i < thread_num; ++i) threads.push_back(std::thread(range, i));
+  range(0);
+  for (auto &t : threads) t.join();
+
+  for (auto &sublist : garbage) SpliceGarbageList(sublist);
+}
 
-    while (p1 != NULL && p1->_next != NULL) {
-      if (p1->_expire && p1->_expire < time(NULL)) {
-        // find expire ItemNode
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::ScanRange(
+    BucketTable *table, int begin, int end, GarbageSublist *garbage) {
+  for (int i = begin; i < end; ++i) {
+    BucketItem &bucket = table->_buckets[i];
+    if (bucket._head == NULL) continue;
 
-        int valid = VALID;
-        int collecting = COLLECTING;
+    // erasing, try next round
+    if (!TryLockBucket(bucket)) continue;
 
-        // lock the item
-        if (p1->_invalid.compare_exchange_strong(valid, collecting,
-                                                 std::memory_order_acq_rel)) {
-          RemoveExpireNode(p1, bucket);
+    int64_t now = _clock.NowMs();
+    Item *prev = NULL, *p = (Item *)bucket._head;
+    while (p != NULL) {
+      int valid = VALID;
 
-          // remove the node
-          p0->_next = p1->_next;
-          p1 = p0->_next;
-        }
+      // find expire ItemNode and lock it
+      if (p->_expire && p->_expire < now &&
+          p->_invalid.compare_exchange_strong(valid, COLLECTING,
+                                              std::memory_order_acq_rel)) {
+        UnlinkNode(bucket, p);
+        RemoveExpireNode(p, bucket, garbage);
 
+        p = prev != NULL ? prev->_next : (Item *)bucket._head;
       } else {
-        p0 = p1;
-        p1 = p1->_next;
+        prev = p;
+        p = p->_next;
       }
     }
 
-    // check head invalid
-    p0 = (Item *)bucket._head;
-    if (p0->_expire && p0->_expire < time(NULL)) {
-      int valid = VALID;
-      int collecting = COLLECTING;
-
-      // lock the head
-      if (p0->_invalid.compare_exchange_strong(valid, collecting,
-                                               std::memory_order_acq_rel)) {
-        RemoveExpireNode(p0, bucket);
-        if (p0 == bucket._tail.load(std::memory_order_consume)) {
-          void *expected = p0, *desire = NULL;
-          if (bucket._tail.compare_exchange_strong(expected, desire,
-                                                   std::memory_order_acq_rel)) {
-            bucket._head = NULL;
-          } else {
-            bucket._head = expected;
-          }
-        } else {
-          bucket._head = p0->_next;
-        }
-      }
+    UnlockBucket(bucket);
+  }
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::ScanWheel() {
+  // slots are seconds, a node is in the slot of the second it expires in
+  int64_t now = _clock.NowMs();
+  WheelAdapter links;
+  _wheel->Advance(links, now / 1000, [this, now](uint64_t ref) {
+    ExpireNode((Item *)ref, now);
+  });
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::ExpireNode(
+    Item *p, int64_t now) {
+  /* p is popped from the wheel, the item lock keeps its expiry steady:
+      - erased or migrated, it is retired by others
+      - not due, Insert changed the expiry, link it again
+      - due, unlink it from its chain, the old table if not migrated yet
+  */
+  WheelAdapter links;
+  if (LockItem(p, WRITING) != VALID) {
+    _wheel->Drop(links, (uint64_t)p);
+    return;
+  }
+
+  if (p->_expire == 0 || p->_expire >= now) {
+    if (p->_expire != 0) {
+      _wheel->Link(links, (uint64_t)p, p->_expire / 1000);
+    } else {
+      _wheel->Drop(links, (uint64_t)p);
     }
+    p->_invalid.store(VALID, std::memory_order_release);
+    return;
+  }
+
+  // not waiting for the bucket lock with the item locked, Erase takes
+  // them the other way round
+  p->_invalid.store(COLLECTING, std::memory_order_release);
+  _wheel->Drop(links, (uint64_t)p);
+
+  uint32_t hash = Hash(p->_key);
+  BucketTable *tables[2] = {_table.load(std::memory_order_acquire),
+                            _old_table.load(std::memory_order_acquire)};
+  for (int t = 0; t < 2 && tables[t] != NULL; ++t) {
+    uint32_t index = MapHash::BucketIndex(hash, tables[t]->_bucket_size);
+    BucketItem &bucket = tables[t]->_buckets[index];
+    LockBucket(bucket);
+    bool unlinked = UnlinkNode(bucket, p);
+    if (unlinked) RemoveExpireNode(p, bucket);
+    UnlockBucket(bucket);
+
+    if (unlinked) return;
+  }
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::WheelUnlink(
+    Item *node) {
+  if (_wheel == NULL) return;
+
+  WheelAdapter links;
+  _wheel->Unlink(links, (uint64_t)node);
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::AddGarbageList(
+    Item *node, uint64_t epoch, GarbageSublist *garbage) {
+  node->_retire_epoch = epoch;
+  node->_del_next = NULL;
+
+  Item *&head = garbage != NULL ? garbage->_head : _garbage_list_head;
+  Item *&tail = garbage != NULL ? garbage->_tail : _garbage_list_tail;
+  if (head == NULL) {
+    head = node;
+    tail = node;
+  } else {
+    tail->_del_next = node;
+    tail = node;
   }
 }
 
-template <typename Key, typename Value>
-void SinHashMap<Key, Value>::AddGarbageList(Item *node) {
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::SpliceGarbageList(
+    GarbageSublist &garbage) {
+  if (garbage._head == NULL) return;
+
   if (_garbage_list_head == NULL) {
-    _garbage_list_head = node;
-    _garbage_list_tail = node;
+    _garbage_list_head = garbage._head;
   } else {
-    _garbage_list_tail->_del_next = node;
-    _garbage_list_tail = node;
+    _garbage_list_tail->_del_next = garbage._head;
   }
+  _garbage_list_tail = garbage._tail;
+  garbage._head = garbage._tail = NULL;
 }
 
-template <typename Key, typename Value>
-void SinHashMap<Key, Value>::RemoveExpireNode(Item *p, BucketItem &bucket) {
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::RemoveExpireNode(
+    Item *p, BucketItem &bucket, GarbageSublist *garbage) {
   //    // (1) atomic change invalid to 1
   //    p->_invalid.store(1, std::memory_order_release);
 
-  // (2) add garbage list
-  AddGarbageList(p);
+  // (2) add garbage list, readers entered from now on can't reach it
+  AddGarbageList(p, EpochDomain::Instance().Current(), garbage);
 
   // (3) count reduce 1
   bucket._count.fetch_sub(1, std::memory_order_acq_rel);
+  _item_count.fetch_sub(1, std::memory_order_relaxed);
 }
 
-template <typename Key, typename Value>
-void SinHashMap<Key, Value>::AddNodeItem(int index, const Key &key,
-                                         const Value &value, int expire) {
-  void *ptr = (Item *)Allocate(sizeof(Item));
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+bool SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::UnlinkNode(
+    BucketItem &bucket, Item *node) {
+  /* caller holds the bucket lock, only appenders race with us and they
+     touch nothing but _tail and _next of the tail (or _head if empty):
+      - node with a successor is skipped over by its predecessor
+      - tail is moved back to the predecessor by cas, if an appender wins
+        wait until it links node->_next, then node has a successor
+  */
+  Item *prev = NULL, *p = (Item *)bucket._head;
+  while (p != NULL && p != node) {
+    prev = p;
+    p = p->_next;
+  }
+
+  // not linked
+  if (p == NULL) return false;
+
+  if (__atomic_load_n(&node->_next, __ATOMIC_ACQUIRE) == NULL) {
+    void *expected = node;
+    if (bucket._tail.compare_exchange_strong(expected, prev,
+                                             std::memory_order_acq_rel)) {
+      // an appender after the cas links to prev itself, keep its link
+      Item *tail = node;
+      if (prev != NULL) {
+        __atomic_compare_exchange_n(&prev->_next, &tail, (Item *)NULL, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+      } else {
+        void *head = node;
+        __atomic_compare_exchange_n(&bucket._head, &head, (void *)NULL, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+      }
+      return true;
+    }
+
+    while (__atomic_load_n(&node->_next, __ATOMIC_ACQUIRE) == NULL) {
+      // appender is linking, so wait
+    }
+  }
+
+  if (prev != NULL) {
+    prev->_next = node->_next;
+  } else {
+    bucket._head = node->_next;
+  }
+  return true;
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::LockBucket(
+    BucketItem &bucket) {
+  while (!TryLockBucket(bucket)) {
+  }
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+bool SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::TryLockBucket(
+    BucketItem &bucket) {
+  bool expected = false;
+  return bucket._unlinking.compare_exchange_strong(expected, true,
+                                                   std::memory_order_acq_rel);
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::UnlockBucket(
+    BucketItem &bucket) {
+  bucket._unlinking.store(false, std::memory_order_release);
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::AddNodeItem(
+    BucketTable *table, uint32_t hash, const Key &key, const Value &value,
+    int64_t expire_at) {
+  void *ptr = AllocateNode();
 
   // construct node data
   Item *new_node = new (ptr) Item;
   new_node->_invalid.store(0, std::memory_order_release);
+  new_node->_version.store(0, std::memory_order_release);
   new_node->_key = key;
   new_node->_value = value;
   new_node->_next = NULL;
-  new_node->_expire = expire != 0 ? time(NULL) + expire : 0;
+  new_node->_expire = expire_at;
   new_node->_del_next = NULL;
+  new_node->_retire_epoch = 0;
+  if (_wheel != NULL && expire_at != 0) {
+    WheelAdapter links;
+    _wheel->Link(links, (uint64_t)new_node, expire_at / 1000);
+  }
 
   // exchange tail
-  BucketItem &bucket = _buckets[index];
+  BucketItem &bucket =
+      table->_buckets[MapHash::BucketIndex(hash, table->_bucket_size)];
   Item *old_node =
       (Item *)bucket._tail.exchange(new_node, std::memory_order_acq_rel);
 
@@ -343,11 +1050,22 @@ void SinHashMap<Key, Value>::AddNodeItem(int index, const Key &key,
   }
 
   bucket._count.fetch_add(1, std::memory_order_acq_rel);
+  _item_count.fetch_add(1, std::memory_order_relaxed);
+
+  // pairs with MigrateBucket, the migrator either walks over the new node
+  // or we see the bucket is migrated and move the node ourselves
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (bucket._migrated.load(std::memory_order_relaxed)) {
+    MigrateNode(bucket, new_node);
+  }
 }
 
-template <typename Key, typename Value>
-Item *SinHashMap<Key, Value>::GetNode(uint32_t index, const Key &key) {
-  BucketItem &bucket = _buckets[index];
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+Item *SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::GetNode(
+    BucketTable *table, uint32_t hash, const Key &key) {
+  BucketItem &bucket =
+      table->_buckets[MapHash::BucketIndex(hash, table->_bucket_size)];
   Item *p = (Item *)bucket._head;
 
   while (p != NULL) {
@@ -357,6 +1075,152 @@ Item *SinHashMap<Key, Value>::GetNode(uint32_t index, const Key &key) {
 
   return NULL;
 };
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+Item *SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::FindNode(
+    uint32_t hash, const Key &key) {
+  // _old_table is published before _table when resize starts, so a reader
+  // seeing the new table always sees the old one until migration finished
+  BucketTable *table = _table.load(std::memory_order_acquire);
+  BucketTable *old_table = _old_table.load(std::memory_order_acquire);
+
+  Item *item = GetNode(table, hash, key);
+  if (item == NULL && old_table != NULL && old_table != table)
+    item = GetNode(old_table, hash, key);
+
+  return item;
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+int SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::LockItem(
+    Item *item, int status) {
+  // return VALID if locked, otherwise the status blocking us
+  int invalid = VALID;
+  while (!item->_invalid.compare_exchange_strong(invalid, status,
+                                                 std::memory_order_acq_rel)) {
+    if (invalid != WRITING && invalid != READING) return invalid;
+
+    // writing or reading occur, so wait
+    invalid = VALID;
+  }
+  return VALID;
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::StartResize(
+    BucketTable *table) {
+  if (!TryLockMaintain()) return;
+
+  // one resize at a time, the retired table must be freed first
+  if (_table.load(std::memory_order_acquire) == table &&
+      _old_table.load(std::memory_order_acquire) == NULL &&
+      _retired_table == NULL && table->_bucket_size <= (1 << 29)) {
+    BucketTable *new_table = new BucketTable(table->_bucket_size * 2);
+    _migrate_index = 0;
+    _old_table.store(table, std::memory_order_release);
+    _table.store(new_table, std::memory_order_release);
+  }
+
+  UnlockMaintain();
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::Migrate(
+    int step) {
+  /* move step buckets from old table to new table:
+      1. nodes are copied to the new table, old nodes are kept in the old
+         chains as MIGRATED so lock-free readers can finish walking them
+      2. old table with its nodes is freed by GC once readers and writers
+         holding it left the epoch it is unpublished in
+
+     caller holds the maintain lock
+  */
+  BucketTable *old_table = _old_table.load(std::memory_order_acquire);
+  if (old_table != NULL) {
+    for (int i = 0; i < step && _migrate_index < old_table->_bucket_size; ++i)
+      MigrateBucket(old_table->_buckets[_migrate_index++]);
+
+    if (_migrate_index >= old_table->_bucket_size) {
+      _old_table.store(NULL, std::memory_order_seq_cst);
+      _retired_table = old_table;
+      _retired_epoch = EpochDomain::Instance().Current();
+    }
+  }
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::MigrateBucket(
+    BucketItem &bucket) {
+  bucket._migrated.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  Item *p = (Item *)bucket._head;
+  while (p != NULL) {
+    MigrateNode(bucket, p);
+    p = p->_next;
+  }
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::MigrateNode(
+    BucketItem &bucket, Item *p) {
+  // lock forever, writers seeing MIGRATED look for the copy instead
+  if (LockItem(p, MIGRATED) != VALID) return;
+  WheelUnlink(p);
+
+  bucket._count.fetch_sub(1, std::memory_order_acq_rel);
+  _item_count.fetch_sub(1, std::memory_order_relaxed);
+
+  if (p->_expire != 0 && p->_expire < _clock.NowMs()) return;
+
+  AddNodeItem(_table.load(std::memory_order_acquire), Hash(p->_key),
+              p->_key, p->_value, p->_expire);
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::FreeRetiredTable(
+    uint64_t safe_epoch) {
+  if (_retired_table == NULL || _retired_epoch >= safe_epoch) return;
+
+  // writers appending to the old table have returned, and moved their
+  // nodes themselves, so every node left is MIGRATED or expired
+  for (int i = 0; i < _retired_table->_bucket_size; ++i) {
+    Item *p = (Item *)_retired_table->_buckets[i]._head;
+
+    while (p != NULL) {
+      Item *next = p->_next;
+      WheelUnlink(p);
+      p->~Item();
+      FreeNode(p);
+      p = next;
+    }
+  }
+
+  delete _retired_table;
+  _retired_table = NULL;
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+bool
+SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::TryLockMaintain() {
+  bool expected = false;
+  return _maintaining.compare_exchange_strong(expected, true,
+                                              std::memory_order_acq_rel);
+}
+
+template <typename Key, typename Value, typename Hasher, typename Allocator,
+          typename Clock, typename Links>
+void SinHashMap<Key, Value, Hasher, Allocator, Clock, Links>::UnlockMaintain() {
+  _maintaining.store(false, std::memory_order_release);
+}
 #undef Item
 }  // namespace SinMap
 
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <iostream>
 #include <map>
 #include <mutex>
@@ -81,6 +82,21 @@ class MyHashMap : public SinHashMap<uint32_t, uint32_t> {
     return key + key % 100 + (key / 100) % 35;
   }
 };
+
+// nodes from the map's arena instead of malloc
+class ArenaHashMap
+    : public SinHashMap<uint32_t, uint32_t, MapHash::VirtualHasher,
+                        ArenaAllocator> {
+ public:
+  ArenaHashMap(int size)
+      : SinHashMap<uint32_t, uint32_t, MapHash::VirtualHasher,
+                   ArenaAllocator>(size) {}
+
+ protected:
+  virtual uint32_t HashCode(const uint32_t& key) {
+    return key + key % 100 + (key / 100) % 35;
+  }
+};
 #endif
 
 const uint32_t MAX_UIN = 0xffffffff;
@@ -128,6 +144,12 @@ void SimpleTest() {
   ret = hash_map.Get(key3, value);
   cout << ret << " " << value << endl;
 
+  ret = hash_map.Erase(key2);
+  cout << "erase: " << ret << endl;
+
+  ret = hash_map.Get(key2, value);
+  cout << ret << endl;
+
   cout << "count: " << hash_map.GetCount() << endl;
 }
 
@@ -217,6 +239,159 @@ void MultipleThreadsTest() {
   }
 }
 
+// two words a writer sets to the same number, a read mixed of two writes
+// has them differ
+struct HotValue {
+  uint64_t _low;
+  uint64_t _high;
+};
+
+// the same words copied by a user-provided assignment, SinHashMap reads it
+// under the item lock, the path every read took before the seqlock
+struct LockedHotValue : public HotValue {
+  LockedHotValue() {}
+  LockedHotValue(const LockedHotValue& other) : HotValue(other) {}
+  LockedHotValue& operator=(const LockedHotValue& other) {
+    HotValue::operator=(other);
+    return *this;
+  }
+};
+
+// a few keys read by every thread, the case readers used to serialize on
+template <typename Map>
+void HotKeyReadThreads(Map& hash_map, int hot_keys, std::atomic<bool>& stop,
+                       std::atomic<uint64_t>& ops) {
+  uint64_t count = 0;
+  typename Map::ValueType value;
+  while (!stop.load(std::memory_order_relaxed)) {
+    uint32_t key = count % hot_keys;
+    int ret = hash_map.Get(key, value);
+    if (ret == 0 && (value._low != value._high ||
+                     value._low % hot_keys != key)) {
+      cout << "ERROR" << endl;
+      exit(0);
+    }
+    count++;
+  }
+  ops.fetch_add(count, std::memory_order_acq_rel);
+}
+
+template <typename Map>
+void HotKeyWriteThread(Map& hash_map, int hot_keys, std::atomic<bool>& stop) {
+  typename Map::ValueType value;
+  uint64_t i = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    value._low = value._high = i;
+    hash_map.Insert(i++ % hot_keys, value);
+    usleep(100);
+  }
+}
+
+template <typename Value>
+class HotKeyMap
+    : public SinHashMap<uint32_t, Value, MapHash::IntHasher, ArenaAllocator> {
+ public:
+  typedef Value ValueType;
+
+  HotKeyMap(int size)
+      : SinHashMap<uint32_t, Value, MapHash::IntHasher, ArenaAllocator>(
+            size) {}
+};
+
+template <typename Map>
+void HotKeyCost(const char* name) {
+  const int HOT_KEYS = 8;
+  const int RUN_MS = 1000;
+
+  Map hash_map(1024);
+  typename Map::ValueType value;
+  for (int i = 0; i < HOT_KEYS; ++i) {
+    value._low = value._high = i;
+    hash_map.Insert(i, value);
+  }
+
+  for (int readers = 1; readers <= 16; readers *= 2) {
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> ops(0);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < readers; ++i) {
+      threads.push_back(std::thread(std::bind(&HotKeyReadThreads<Map>,
+                                              std::ref(hash_map), HOT_KEYS,
+                                              std::ref(stop), std::ref(ops))));
+    }
+    threads.push_back(std::thread(std::bind(&HotKeyWriteThread<Map>,
+                                            std::ref(hash_map), HOT_KEYS,
+                                            std::ref(stop))));
+
+    uint64_t begin = GetTimestampMS();
+    usleep(RUN_MS * 1000);
+    stop.store(true, std::memory_order_relaxed);
+    for (auto& t : threads) t.join();
+    uint64_t cost = GetTimestampMS() - begin;
+
+    cout << name << " hot key readers: " << readers
+         << " reads/s: " << ops.load() * 1000 / (cost ? cost : 1) << endl;
+  }
+}
+
+// seqlock reads against the locked reads they replaced
+void ContendedHotKeyTest() {
+  HotKeyCost<HotKeyMap<LockedHotValue>>("locked");
+  HotKeyCost<HotKeyMap<HotValue>>("seqlock");
+}
+
+// table far bigger than the cache, random keys looked up one by one or
+// batched
+void MultiGetTest() {
+  const uint32_t KEY_NUM = 2000000;
+  const int BATCH = 256;
+  const int ROUND = 4000;
+
+  MyHashMap hash_map(KEY_NUM / 2);
+
+#ifdef STRING_TEST
+  for (uint32_t i = 0; i < KEY_NUM; ++i)
+    hash_map.Insert(to_string(i), to_string(i));
+  std::vector<string> keys(BATCH * ROUND);
+  string values[BATCH];
+#else
+  for (uint32_t i = 0; i < KEY_NUM; ++i) hash_map.Insert(i, i);
+  std::vector<uint32_t> keys(BATCH * ROUND);
+  uint32_t values[BATCH];
+#endif
+  int rets[BATCH];
+
+  std::default_random_engine engine(GetTimestampNs());
+  for (auto& key : keys) {
+#ifdef STRING_TEST
+    key = to_string(engine() % (KEY_NUM * 2));
+#else
+    key = engine() % (KEY_NUM * 2);
+#endif
+  }
+
+  uint64_t begin = GetTimestampMS();
+  for (int r = 0; r < ROUND; ++r) {
+    for (int i = 0; i < BATCH; ++i)
+      rets[i] = hash_map.Get(keys[r * BATCH + i], values[i]);
+  }
+  cout << "get cost: " << GetTimestampMS() - begin << "ms" << endl;
+
+  begin = GetTimestampMS();
+  for (int r = 0; r < ROUND; ++r) {
+    hash_map.MultiGet(&keys[r * BATCH], BATCH, values, rets);
+
+    for (int i = 0; i < BATCH; ++i) {
+      if (rets[i] == 0 && values[i] != keys[r * BATCH + i]) {
+        cout << "ERROR" << endl;
+        exit(0);
+      }
+    }
+  }
+  cout << "multi get cost: " << GetTimestampMS() - begin << "ms" << endl;
+}
+
 mutex _mutux;
 pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
 pthread_mutex_t pthread_mutex;
@@ -350,9 +525,284 @@ void UnorderedMultipleThreadsTest() {
   }
 }
 
+#ifndef STRING_TEST
+// insert, erase and GC so nodes are recycled, insert again, random gets
+template <typename Map>
+void ArenaCost(const char* name) {
+  const uint32_t KEY_NUM = 1000000;
+  const int THREAD_NUM = 4;
+
+  Map hash_map(KEY_NUM / 4);
+  std::vector<uint32_t> keys(KEY_NUM);
+  for (uint32_t i = 0; i < KEY_NUM; ++i) keys[i] = i;
+  std::shuffle(keys.begin(), keys.end(),
+               std::default_random_engine(GetTimestampNs()));
+
+  auto insert = [&](int index) {
+    for (uint32_t i = index; i < KEY_NUM; i += THREAD_NUM)
+      hash_map.Insert(keys[i], keys[i]);
+  };
+
+  uint64_t begin = GetTimestampMS();
+  for (int round = 0; round < 2; ++round) {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREAD_NUM; ++t)
+      threads.push_back(std::thread(insert, t));
+    for (auto& t : threads) t.join();
+
+    if (round == 0) {
+      for (uint32_t i = 0; i < KEY_NUM; i += 2) hash_map.Erase(i);
+      hash_map.GC();
+      hash_map.GC();
+    }
+  }
+  cout << name << " insert cost: " << GetTimestampMS() - begin << "ms" << endl;
+
+  begin = GetTimestampMS();
+  uint32_t value;
+  for (uint32_t key : keys) {
+    if (hash_map.Get(key, value) != 0 || value != key) {
+      cout << "ERROR" << endl;
+      exit(0);
+    }
+  }
+  cout << name << " get cost: " << GetTimestampMS() - begin << "ms" << endl;
+}
+
+void ArenaTest() {
+  ArenaCost<MyHashMap>("malloc");
+  ArenaCost<ArenaHashMap>("arena");
+}
+
+// a few keys expire among many long-lived ones, GC by scanning every chain
+// or by the timing wheel
+template <typename Map>
+void WheelCost(const char* name) {
+  const uint32_t KEY_NUM = 1000000;
+  const uint32_t EXPIRE_NUM = KEY_NUM / 100;
+
+  Map hash_map(KEY_NUM / 4);
+  for (uint32_t i = 0; i < KEY_NUM; ++i) hash_map.Insert(i, i, 3600);
+  // expiry shortened, then lengthened again for half of them
+  for (uint32_t i = 0; i < 2 * EXPIRE_NUM; ++i) hash_map.Insert(i, i, 1);
+  for (uint32_t i = 0; i < EXPIRE_NUM; ++i) hash_map.Insert(i, i, 3600);
+
+  sleep(2);
+  uint64_t begin = GetTimestampMS();
+  for (int round = 0; round < 10; ++round) hash_map.GC();
+  cout << name << " gc cost: " << GetTimestampMS() - begin << "ms" << endl;
+
+  if (hash_map.GetCount() != (int)(KEY_NUM - EXPIRE_NUM)) {
+    cout << "ERROR" << endl;
+    exit(0);
+  }
+}
+
+void WheelTest() {
+  typedef SinHashMap<uint32_t, uint32_t, MapHash::IntHasher, ArenaAllocator>
+      ScanMap;
+  typedef SinHashMap<uint32_t, uint32_t, MapHash::IntHasher, ArenaAllocator,
+                     MapClock::SystemClock, MapWheel::WheelLinks>
+      WheelMap;
+
+  WheelCost<ScanMap>("scan");
+  WheelCost<WheelMap>("wheel");
+}
+
+// half of the keys expired, collected by GC threads of 1 to 8
+void ParallelGCTest() {
+  const uint32_t KEY_NUM = 1000000;
+
+  for (int thread_num = 1; thread_num <= 8; thread_num *= 2) {
+    SinHashMap<uint32_t, uint32_t, MapHash::IntHasher, ArenaAllocator>
+        hash_map(KEY_NUM / 4);
+    for (uint32_t i = 0; i < KEY_NUM; ++i) hash_map.Insert(i, i, i % 2);
+
+    sleep(2);
+    uint64_t begin = GetTimestampMS();
+    hash_map.ParallelGC(thread_num);
+    hash_map.ParallelGC(thread_num);
+    cout << thread_num << " threads gc cost: " << GetTimestampMS() - begin
+         << "ms" << endl;
+
+    if (hash_map.GetCount() != (int)(KEY_NUM / 2)) {
+      cout << "ERROR" << endl;
+      exit(0);
+    }
+  }
+}
+
+// gets of keys with an expiry read the clock, then half of the keys are
+// given 100ms
+template <typename Map>
+void ClockCost(const char* name) {
+  const uint32_t KEY_NUM = 1000000;
+
+  Map hash_map(KEY_NUM / 4);
+  for (uint32_t i = 0; i < KEY_NUM; ++i) hash_map.InsertMs(i, i, 3600 * 1000);
+
+  uint64_t begin = GetTimestampMS();
+  uint32_t value;
+  for (uint32_t i = 0; i < KEY_NUM; ++i) {
+    if (hash_map.Get(i, value) != 0 || value != i) {
+      cout << "ERROR" << endl;
+      exit(0);
+    }
+  }
+  cout << name << " get cost: " << GetTimestampMS() - begin << "ms" << endl;
+
+  for (uint32_t i = 1; i < KEY_NUM; i += 2) hash_map.InsertMs(i, i, 100);
+  usleep(200 * 1000);
+  int count = 0;
+  for (uint32_t i = 0; i < KEY_NUM; ++i) count += hash_map.Get(i, value) == 0;
+  if (count != (int)(KEY_NUM / 2)) {
+    cout << "ERROR" << endl;
+    exit(0);
+  }
+}
+
+void ClockTest() {
+  typedef SinHashMap<uint32_t, uint32_t, MapHash::IntHasher, ArenaAllocator>
+      SystemClockMap;
+  typedef SinHashMap<uint32_t, uint32_t, MapHash::IntHasher, ArenaAllocator,
+                     MapClock::CoarseClock>
+      CoarseClockMap;
+
+  ClockCost<SystemClockMap>("system clock");
+  ClockCost<CoarseClockMap>("coarse clock");
+}
+
+// keys inserted while the table doubles eight times, readers check every key
+// inserted already, GC frees each retired table so the next resize starts
+void ResizeTest() {
+  const uint32_t KEY_NUM = 1000000;
+  const int READ_THREAD = 4;
+
+  SinHashMap<uint32_t, uint32_t, MapHash::IntHasher, ArenaAllocator> hash_map(
+      1024);
+  std::atomic<uint32_t> inserted(0);
+  std::atomic<bool> stop(false);
+
+  std::vector<std::thread> readers;
+  for (int t = 0; t < READ_THREAD; ++t) {
+    readers.push_back(std::thread([&, t]() {
+      std::default_random_engine engine(t);
+      uint32_t value;
+      while (!stop.load(std::memory_order_relaxed)) {
+        uint32_t num = inserted.load(std::memory_order_acquire);
+        if (num == 0) continue;
+
+        uint32_t key = engine() % num;
+        if (hash_map.Get(key, value) != 0 || value != key * 2 + 1) {
+          cout << "ERROR" << endl;
+          exit(0);
+        }
+      }
+    }));
+  }
+  std::thread gc([&]() {
+    while (!stop.load(std::memory_order_relaxed)) {
+      hash_map.GC();
+      usleep(1000);
+    }
+  });
+
+  for (uint32_t i = 0; i < KEY_NUM; ++i) {
+    hash_map.Insert(i, i * 2 + 1);
+    inserted.store(i + 1, std::memory_order_release);
+  }
+  stop = true;
+  for (auto& t : readers) t.join();
+  gc.join();
+
+  uint32_t value;
+  for (uint32_t i = 0; i < KEY_NUM; ++i) {
+    if (hash_map.Get(i, value) != 0 || value != i * 2 + 1) {
+      cout << "ERROR" << endl;
+      exit(0);
+    }
+  }
+  if (hash_map.GetCount() != (int)KEY_NUM) {
+    cout << "ERROR" << endl;
+    exit(0);
+  }
+}
+
+// nodes freed counted
+class CountedHashMap
+    : public SinHashMap<uint32_t, uint32_t, MapHash::IntHasher> {
+ public:
+  CountedHashMap(int size)
+      : SinHashMap<uint32_t, uint32_t, MapHash::IntHasher>(size) {
+    _freed = 0;
+  }
+
+  std::atomic<uint32_t> _freed;
+
+ protected:
+  virtual void* Allocate(int size) { return malloc(size); }
+
+  virtual void Free(void* ptr) {
+    _freed++;
+    free(ptr);
+  }
+};
+
+// keys erased while a reader is in the middle of reading, GC frees them
+// only after it left
+void EpochTest() {
+  const uint32_t KEY_NUM = 10000;
+
+  CountedHashMap hash_map(KEY_NUM / 4);
+  for (uint32_t i = 0; i < KEY_NUM; ++i) hash_map.Insert(i, i);
+
+  std::atomic<int> state(0);
+  std::thread reader([&]() {
+    EpochGuard guard;
+    state = 1;
+    while (state != 2) usleep(1000);
+  });
+  while (state != 1) usleep(1000);
+
+  for (uint32_t i = 0; i < KEY_NUM; ++i) hash_map.Erase(i);
+  hash_map.GC();
+  hash_map.GC();
+  if (hash_map._freed != 0 || hash_map.GetCount() != 0) {
+    cout << "ERROR" << endl;
+    exit(0);
+  }
+
+  state = 2;
+  reader.join();
+  hash_map.GC();
+  if (hash_map._freed != KEY_NUM) {
+    cout << "ERROR" << endl;
+    exit(0);
+  }
+}
+#endif
+
 int main() {
   cout << MAX_UIN << endl;
 
+  ContendedHotKeyTest();
+
+  MultiGetTest();
+
+#ifndef STRING_TEST
+  ArenaTest();
+
+  WheelTest();
+
+  ParallelGCTest();
+
+  ClockTest();
+
+  ResizeTest();
+
+  EpochTest();
+#endif
+
   int num = READ_AND_WRITE_NUM;
   for (int i = 1; i <= 5; ++i) {
     int begin = time(0);